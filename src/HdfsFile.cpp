@@ -193,6 +193,16 @@ bool HdfsFile::createSymlink(std::string oldpath, std::string newpath) {
   return true;
 }
 
+bool HdfsFile::rename(const std::string& newname) {
+  if (!fileSys || hdfsRename(fileSys, filename.c_str(), newname.c_str()) != 0) {
+    LOG_OPER("[hdfs] Failed to rename %s to %s", filename.c_str(),
+             newname.c_str());
+    return false;
+  }
+  filename = newname;
+  return true;
+}
+
 /**
  * If the URI is specified of the form
  * hdfs://server::port/path, then connect to the
@@ -0,0 +1,228 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "compression.h"
+
+#ifdef USE_SCRIBE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef USE_SCRIBE_LZ4
+#include <lz4.h>
+#endif
+
+// largest block we'll try to decompress, anything bigger is corrupt
+#define COMPRESSED_BLOCK_MAX_SIZE 0x7fffffff
+
+// lz4 can't expand its input more than this, at most 255 bytes come out of
+// each byte that goes in
+#define LZ4_MAX_RATIO 255
+
+using namespace std;
+
+static const char block_magic[4] = {'S', 'C', 'Z', 'B'};
+
+static void putUInt(unsigned long value, char* buffer) {
+  for (int i = 0; i < 4; ++i) {
+    buffer[i] = (char)(value >> (8 * i));
+  }
+}
+
+static unsigned long getUInt(const char* buffer) {
+  unsigned long value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= (unsigned long)(unsigned char)buffer[i] << (8 * i);
+  }
+  return value;
+}
+
+bool parseCompression(const string& name, compression_t& _return) {
+  if (0 == name.compare("none")) {
+    _return = COMPRESSION_NONE;
+    return true;
+  }
+#ifdef USE_SCRIBE_ZSTD
+  if (0 == name.compare("zstd")) {
+    _return = COMPRESSION_ZSTD;
+    return true;
+  }
+#endif
+#ifdef USE_SCRIBE_LZ4
+  if (0 == name.compare("lz4")) {
+    _return = COMPRESSION_LZ4;
+    return true;
+  }
+#endif
+  return false;
+}
+
+const char* compressionName(compression_t compression) {
+  switch (compression) {
+  case COMPRESSION_NONE:
+    return "none";
+  case COMPRESSION_ZSTD:
+    return "zstd";
+  case COMPRESSION_LZ4:
+    return "lz4";
+  default:
+    return "unknown";
+  }
+}
+
+bool compressBlock(compression_t compression, int level, const char* data,
+                   unsigned long length, string& _return) {
+  if (length > COMPRESSED_BLOCK_MAX_SIZE) {
+    LOG_OPER("Can't compress <%lu> bytes in one block", length);
+    return false;
+  }
+
+  unsigned long bound;
+  switch (compression) {
+#ifdef USE_SCRIBE_ZSTD
+  case COMPRESSION_ZSTD:
+    bound = ZSTD_compressBound(length);
+    break;
+#endif
+#ifdef USE_SCRIBE_LZ4
+  case COMPRESSION_LZ4:
+    bound = LZ4_compressBound(length);
+    break;
+#endif
+  default:
+    LOG_OPER("Compression <%s> isn't built in", compressionName(compression));
+    return false;
+  }
+
+  unsigned long start = _return.size();
+  _return.resize(start + COMPRESSED_BLOCK_HEADER_SIZE + bound);
+  char* header = &_return[start];
+#if defined(USE_SCRIBE_ZSTD) || defined(USE_SCRIBE_LZ4)
+  char* payload = header + COMPRESSED_BLOCK_HEADER_SIZE;
+#endif
+
+  unsigned long compressed = 0;
+  switch (compression) {
+#ifdef USE_SCRIBE_ZSTD
+  case COMPRESSION_ZSTD: {
+    size_t result = ZSTD_compress(payload, bound, data, length,
+                                  level ? level : ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(result)) {
+      LOG_OPER("zstd compression failed: %s", ZSTD_getErrorName(result));
+      _return.resize(start);
+      return false;
+    }
+    compressed = result;
+    break;
+  }
+#endif
+#ifdef USE_SCRIBE_LZ4
+  case COMPRESSION_LZ4: {
+    int result = LZ4_compress_default(data, payload, length, bound);
+    if (result <= 0) {
+      LOG_OPER("lz4 compression of <%lu> bytes failed", length);
+      _return.resize(start);
+      return false;
+    }
+    compressed = result;
+    break;
+  }
+#endif
+  default:
+    break;
+  }
+
+  memcpy(header, block_magic, sizeof(block_magic));
+  header[4] = (char)compression;
+  header[5] = header[6] = header[7] = 0;
+  putUInt(compressed, header + 8);
+  putUInt(length, header + 12);
+  _return.resize(start + COMPRESSED_BLOCK_HEADER_SIZE + compressed);
+  return true;
+}
+
+bool isCompressedBlock(const char* data, unsigned long available,
+                       unsigned long& block_length) {
+  if (available < COMPRESSED_BLOCK_HEADER_SIZE ||
+      0 != memcmp(data, block_magic, sizeof(block_magic)) ||
+      data[5] || data[6] || data[7]) {
+    return false;
+  }
+  block_length = COMPRESSED_BLOCK_HEADER_SIZE + getUInt(data + 8);
+  return true;
+}
+
+bool decompressBlock(const char* data, unsigned long block_length,
+                     string& _return) {
+  compression_t compression = (compression_t)data[4];
+  unsigned long length = getUInt(data + 12);
+#if defined(USE_SCRIBE_ZSTD) || defined(USE_SCRIBE_LZ4)
+  unsigned long compressed = block_length - COMPRESSED_BLOCK_HEADER_SIZE;
+  const char* payload = data + COMPRESSED_BLOCK_HEADER_SIZE;
+#endif
+
+  if (length > COMPRESSED_BLOCK_MAX_SIZE) {
+    return false;
+  }
+
+  // Check the length in the header against what the codec says before
+  // allocating it, so a damaged header can't ask for gigabytes
+  switch (compression) {
+#ifdef USE_SCRIBE_ZSTD
+  case COMPRESSION_ZSTD: {
+    unsigned long long content_size =
+      ZSTD_getFrameContentSize(payload, compressed);
+    if (content_size != length) {
+      return false;
+    }
+    break;
+  }
+#endif
+#ifdef USE_SCRIBE_LZ4
+  case COMPRESSION_LZ4:
+    if (length > compressed * LZ4_MAX_RATIO) {
+      return false;
+    }
+    break;
+#endif
+  default:
+    break;
+  }
+
+  _return.resize(length);
+  if (!length) {
+    return true;
+  }
+
+  switch (compression) {
+#ifdef USE_SCRIBE_ZSTD
+  case COMPRESSION_ZSTD: {
+    size_t result = ZSTD_decompress(&_return[0], length, payload, compressed);
+    return !ZSTD_isError(result) && result == length;
+  }
+#endif
+#ifdef USE_SCRIBE_LZ4
+  case COMPRESSION_LZ4: {
+    int result = LZ4_decompress_safe(payload, &_return[0], compressed, length);
+    return result >= 0 && (unsigned long)result == length;
+  }
+#endif
+  default:
+    LOG_OPER("Can't read a block compressed with <%s>, it isn't built in",
+             compressionName(compression));
+    return false;
+  }
+}
@@ -0,0 +1,65 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_COMPRESSION_H
+#define SCRIBE_COMPRESSION_H
+
+#include <string>
+
+/*
+ * Compressed blocks for file stores with compression=zstd or lz4. Each
+ * write is compressed on its own and stored behind a header:
+ *
+ *   [4 bytes "SCZB"][1 byte codec][3 bytes zero]
+ *   [4 bytes compressed length][4 bytes uncompressed length]
+ *
+ * Blocks don't depend on each other, so a file can be appended to or read
+ * from any block, and a block torn by a crash only loses its own messages.
+ * The uncompressed data is exactly what would have been written without
+ * compression, so it's split into messages the same way.
+ *
+ * Codecs are built in with --enable-zstd and --enable-lz4.
+ */
+
+#define COMPRESSED_BLOCK_HEADER_SIZE 16
+
+enum compression_t {
+  COMPRESSION_NONE = 0,
+  COMPRESSION_ZSTD = 1,
+  COMPRESSION_LZ4 = 2
+};
+
+// false if name isn't a codec, or isn't built in
+bool parseCompression(const std::string& name, compression_t& _return);
+const char* compressionName(compression_t compression);
+
+// Compresses length bytes at data into one block, header and all, and
+// appends it to _return. level only applies to zstd, 0 for its default.
+bool compressBlock(compression_t compression, int level, const char* data,
+                   unsigned long length, std::string& _return);
+
+// Checks for a block header at data, and sets block_length to the length
+// of the whole block
+bool isCompressedBlock(const char* data, unsigned long available,
+                       unsigned long& block_length);
+
+// Replaces _return with the uncompressed contents of the block at data,
+// which must be whole
+bool decompressBlock(const char* data, unsigned long block_length,
+                     std::string& _return);
+
+#endif // SCRIBE_COMPRESSION_H
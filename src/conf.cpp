@@ -86,6 +86,23 @@ void StoreConf::setUnsigned(const std::string& stringName, unsigned long value)
   setString(stringName, oss.str());
 }
 
+pStoreConf StoreConf::copy() {
+  pStoreConf result(new StoreConf);
+  result->values = values;
+  for (store_conf_map_t::iterator iter = stores.begin(); iter != stores.end(); ++iter) {
+    result->stores[iter->first] = iter->second->copy();
+  }
+  return result;
+}
+
+void StoreConf::setStringRecursive(const std::string& stringName,
+                                   const std::string& value) {
+  setString(stringName, value);
+  for (store_conf_map_t::iterator iter = stores.begin(); iter != stores.end(); ++iter) {
+    iter->second->setStringRecursive(stringName, value);
+  }
+}
+
 // reads and parses the config data
 void StoreConf::parseConfig(const std::string& filename) {
 
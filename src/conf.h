@@ -60,6 +60,11 @@ class StoreConf {
   void setString(const std::string& stringName, const std::string& value);
   void setUnsigned(const std::string& intName, unsigned long value);
 
+  // Returns a copy that shares nothing with this one, nested stores included
+  pStoreConf copy();
+  // Sets a string in this store and in every store nested in it
+  void setStringRecursive(const std::string& stringName, const std::string& value);
+
   // Reads configuration from a file and throws an exception if it fails.
   void parseConfig(const std::string& filename);
 
@@ -35,6 +35,7 @@ using namespace apache::thrift::transport;
 using namespace apache::thrift::server;
 using namespace scribe::thrift;
 
+static StatCounter statSent("sent");
 
 ConnPool::ConnPool() {
   pthread_mutex_init(&mapMutex, NULL);
@@ -276,9 +277,7 @@ bool scribeConn::send(boost::shared_ptr<logentry_vector_t> messages) {
     result = resendClient->Log(msgs);
 
     if (result == OK) {
-      if (g_Handler) {
-        g_Handler->incrementCounter("sent", size);
-      }
+      statSent.increment(size);
       LOG_OPER("Successfully sent <%d> messages to remote scribe server %s",
           size, connectionString().c_str());
       return true;
@@ -0,0 +1,236 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <pthread.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define CRC32C_HARDWARE 1
+#include <nmmintrin.h>
+#endif
+
+// reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+// bytes per stream in the three stream loops, both powers of two
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+namespace {
+
+pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+bool hardware = false;
+
+// slicing by eight for the software checksum
+uint32_t table[8][256];
+
+#ifdef CRC32C_HARDWARE
+// applies CRC32C_LONG or CRC32C_SHORT zero bytes to a crc, a byte at a time
+uint32_t longShift[4][256];
+uint32_t shortShift[4][256];
+#endif
+
+uint32_t matrixTimes(const uint32_t* matrix, uint32_t vector) {
+  uint32_t sum = 0;
+  while (vector) {
+    if (vector & 1) {
+      sum ^= *matrix;
+    }
+    vector >>= 1;
+    ++matrix;
+  }
+  return sum;
+}
+
+void matrixSquare(uint32_t* square, const uint32_t* matrix) {
+  for (int n = 0; n < 32; ++n) {
+    square[n] = matrixTimes(matrix, matrix[n]);
+  }
+}
+
+// The operator that appends length zero bytes to a crc, length a power
+// of two
+void zerosOperator(uint32_t* even, unsigned long length) {
+  uint32_t odd[32];
+  odd[0] = CRC32C_POLY;
+  uint32_t row = 1;
+  for (int n = 1; n < 32; ++n) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  // two zero bits in even, then four in odd
+  matrixSquare(even, odd);
+  matrixSquare(odd, even);
+  // each square doubles it, from one zero byte on
+  while (true) {
+    matrixSquare(even, odd);
+    length >>= 1;
+    if (!length) {
+      return;
+    }
+    matrixSquare(odd, even);
+    length >>= 1;
+    if (!length) {
+      break;
+    }
+  }
+  memcpy(even, odd, sizeof(odd));
+}
+
+#ifdef CRC32C_HARDWARE
+void makeShiftTable(uint32_t shift[4][256], unsigned long length) {
+  uint32_t op[32];
+  zerosOperator(op, length);
+  for (uint32_t n = 0; n < 256; ++n) {
+    shift[0][n] = matrixTimes(op, n);
+    shift[1][n] = matrixTimes(op, n << 8);
+    shift[2][n] = matrixTimes(op, n << 16);
+    shift[3][n] = matrixTimes(op, n << 24);
+  }
+}
+
+inline uint32_t shiftCrc(uint32_t shift[4][256], uint32_t crc) {
+  return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^
+         shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+#endif
+
+void makeTables() {
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t crc = n;
+    for (int k = 0; k < 8; ++k) {
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    table[0][n] = crc;
+  }
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t crc = table[0][n];
+    for (int k = 1; k < 8; ++k) {
+      crc = table[0][crc & 0xff] ^ (crc >> 8);
+      table[k][n] = crc;
+    }
+  }
+
+#ifdef CRC32C_HARDWARE
+  __builtin_cpu_init();
+  hardware = __builtin_cpu_supports("sse4.2");
+  if (hardware) {
+    makeShiftTable(longShift, CRC32C_LONG);
+    makeShiftTable(shortShift, CRC32C_SHORT);
+  }
+#endif
+}
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char* next,
+                        unsigned long length) {
+  while (length && ((uintptr_t)next & 7)) {
+    crc = table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    --length;
+  }
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, next, 8);
+    word ^= crc;
+    crc = table[7][word & 0xff] ^
+          table[6][(word >> 8) & 0xff] ^
+          table[5][(word >> 16) & 0xff] ^
+          table[4][(word >> 24) & 0xff] ^
+          table[3][(word >> 32) & 0xff] ^
+          table[2][(word >> 40) & 0xff] ^
+          table[1][(word >> 48) & 0xff] ^
+          table[0][word >> 56];
+    next += 8;
+    length -= 8;
+  }
+  while (length) {
+    crc = table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+    --length;
+  }
+  return crc;
+}
+
+#ifdef CRC32C_HARDWARE
+// One crc32 instruction takes three cycles but a new one can start every
+// cycle, so three independent streams are checksummed together and then
+// combined by shifting each one past the data after it.
+__attribute__((target("sse4.2")))
+uint32_t crc32cHardware(uint32_t crc, const unsigned char* next,
+                        unsigned long length) {
+  uint64_t crc0 = crc;
+  while (length && ((uintptr_t)next & 7)) {
+    crc0 = _mm_crc32_u8(crc0, *next++);
+    --length;
+  }
+
+  while (length >= 3 * CRC32C_LONG) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const unsigned char* end = next + CRC32C_LONG;
+    do {
+      crc0 = _mm_crc32_u64(crc0, *(const uint64_t*)next);
+      crc1 = _mm_crc32_u64(crc1, *(const uint64_t*)(next + CRC32C_LONG));
+      crc2 = _mm_crc32_u64(crc2, *(const uint64_t*)(next + 2 * CRC32C_LONG));
+      next += 8;
+    } while (next < end);
+    crc0 = shiftCrc(longShift, crc0) ^ crc1;
+    crc0 = shiftCrc(longShift, crc0) ^ crc2;
+    next += 2 * CRC32C_LONG;
+    length -= 3 * CRC32C_LONG;
+  }
+
+  while (length >= 3 * CRC32C_SHORT) {
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const unsigned char* end = next + CRC32C_SHORT;
+    do {
+      crc0 = _mm_crc32_u64(crc0, *(const uint64_t*)next);
+      crc1 = _mm_crc32_u64(crc1, *(const uint64_t*)(next + CRC32C_SHORT));
+      crc2 = _mm_crc32_u64(crc2, *(const uint64_t*)(next + 2 * CRC32C_SHORT));
+      next += 8;
+    } while (next < end);
+    crc0 = shiftCrc(shortShift, crc0) ^ crc1;
+    crc0 = shiftCrc(shortShift, crc0) ^ crc2;
+    next += 2 * CRC32C_SHORT;
+    length -= 3 * CRC32C_SHORT;
+  }
+
+  while (length >= 8) {
+    crc0 = _mm_crc32_u64(crc0, *(const uint64_t*)next);
+    next += 8;
+    length -= 8;
+  }
+  while (length) {
+    crc0 = _mm_crc32_u8(crc0, *next++);
+    --length;
+  }
+  return crc0;
+}
+#endif
+
+} // namespace
+
+uint32_t crc32c(uint32_t crc, const void* data, unsigned long length) {
+  pthread_once(&tablesOnce, makeTables);
+  const unsigned char* next = (const unsigned char*)data;
+#ifdef CRC32C_HARDWARE
+  if (hardware) {
+    return ~crc32cHardware(~crc, next, length);
+  }
+#endif
+  return ~crc32cSoftware(~crc, next, length);
+}
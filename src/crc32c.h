@@ -0,0 +1,33 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_CRC32C_H
+#define SCRIBE_CRC32C_H
+
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli), the checksum of framed batches. On x86-64 CPUs
+ * with SSE4.2 it uses the crc32 instruction on three streams at once,
+ * which keeps up with memory, and a table otherwise.
+ *
+ * crc is the checksum of whatever came before data, 0 to start, so a
+ * checksum can be taken over several pieces.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, unsigned long length);
+
+#endif // SCRIBE_CRC32C_H
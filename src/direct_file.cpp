@@ -0,0 +1,246 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <fcntl.h>
+
+#include "common.h"
+#include "direct_file.h"
+
+// O_DIRECT needs offsets, lengths and memory aligned to the logical block
+// size, which is never more than a page
+#define DIRECT_IO_ALIGNMENT       4096
+#define DIRECT_IO_DEFAULT_BUFFER  1048576
+// free staging buffers kept for reuse, per size
+#define DIRECT_IO_POOL_SIZE       16
+
+using namespace std;
+
+namespace {
+
+pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+map<unsigned long, vector<char*> > pool;
+
+bool pwriteAll(int fd, const char* data, unsigned long length,
+               unsigned long offset) {
+  while (length) {
+    ssize_t written = pwrite(fd, data, length, offset);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    length -= written;
+    offset += written;
+  }
+  return true;
+}
+
+} // namespace
+
+char* DirectFile::acquireBuffer(unsigned long size) {
+  pthread_mutex_lock(&poolLock);
+  vector<char*>& free_buffers = pool[size];
+  if (!free_buffers.empty()) {
+    char* buffer = free_buffers.back();
+    free_buffers.pop_back();
+    pthread_mutex_unlock(&poolLock);
+    return buffer;
+  }
+  pthread_mutex_unlock(&poolLock);
+
+  void* buffer = NULL;
+  if (posix_memalign(&buffer, DIRECT_IO_ALIGNMENT, size) != 0) {
+    return NULL;
+  }
+  return (char*)buffer;
+}
+
+void DirectFile::releaseBuffer(char* buffer, unsigned long size) {
+  pthread_mutex_lock(&poolLock);
+  vector<char*>& free_buffers = pool[size];
+  if (free_buffers.size() < DIRECT_IO_POOL_SIZE) {
+    free_buffers.push_back(buffer);
+    buffer = NULL;
+  }
+  pthread_mutex_unlock(&poolLock);
+  free(buffer);
+}
+
+DirectFile::DirectFile(const std::string& name, bool frame,
+                       unsigned long buffer_size)
+  : PosixFile(name, frame),
+    bufferSize(buffer_size ? buffer_size : DIRECT_IO_DEFAULT_BUFFER),
+    buffer(NULL),
+    buffered(0),
+    fileOffset(0),
+    tailFd(-1),
+    failed(false) {
+  // round up to whole blocks
+  bufferSize = (bufferSize + DIRECT_IO_ALIGNMENT - 1) &
+               ~(unsigned long)(DIRECT_IO_ALIGNMENT - 1);
+}
+
+DirectFile::~DirectFile() {
+  close();
+}
+
+bool DirectFile::openWrite() {
+  return openForWrite(O_WRONLY | O_CREAT);
+}
+
+bool DirectFile::openTruncate() {
+  return openForWrite(O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+bool DirectFile::openForWrite(int flags) {
+  if (!open(flags | O_DIRECT)) {
+    if (errno != EINVAL || !open(flags)) {
+      return false;
+    }
+    static bool warned = false;
+    if (!warned) {
+      LOG_OPER("O_DIRECT not supported for <%s>, writing through the page "
+               "cache", filename.c_str());
+      warned = true;
+    }
+  }
+
+  tailFd = ::open(filename.c_str(), O_RDWR);
+  buffer = acquireBuffer(bufferSize);
+  if (tailFd < 0 || !buffer) {
+    LOG_OPER("Failed to set up direct writes to <%s>: %s",
+             filename.c_str(), strerror(errno));
+    close();
+    return false;
+  }
+
+  // Start at the last whole block, with whatever follows it staged
+  off_t size = lseek(tailFd, 0, SEEK_END);
+  if (size < 0) {
+    size = 0;
+  }
+  fileOffset = size & ~(off_t)(DIRECT_IO_ALIGNMENT - 1);
+  buffered = size - fileOffset;
+  failed = false;
+  if (buffered && pread(tailFd, buffer, buffered, fileOffset) !=
+                  (ssize_t)buffered) {
+    LOG_OPER("Failed to read the end of <%s>: %s",
+             filename.c_str(), strerror(errno));
+    close();
+    return false;
+  }
+  return true;
+}
+
+void DirectFile::close() {
+  if (buffer) {
+    if (!failed) {
+      flush();
+    }
+    releaseBuffer(buffer, bufferSize);
+    buffer = NULL;
+  }
+  if (tailFd >= 0) {
+    // the tail went through the page cache, don't leave it there
+    posix_fadvise(tailFd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(tailFd);
+    tailFd = -1;
+  }
+  buffered = 0;
+  PosixFile::close();
+}
+
+// Writes the first length bytes of the buffer, which must be whole blocks
+bool DirectFile::writeBlocks(unsigned long length) {
+  if (!pwriteAll(fd, buffer, length, fileOffset)) {
+    LOG_OPER("Failed to write <%lu> bytes to <%s> at offset <%lu>: %s",
+             length, filename.c_str(), fileOffset, strerror(errno));
+    failed = true;
+    return false;
+  }
+
+  fileOffset += length;
+  buffered -= length;
+  if (buffered) {
+    memmove(buffer, buffer + length, buffered);
+  }
+  return true;
+}
+
+bool DirectFile::writeTail() {
+  if (!pwriteAll(tailFd, buffer, buffered, fileOffset)) {
+    LOG_OPER("Failed to write <%lu> bytes to <%s> at offset <%lu>: %s",
+             buffered, filename.c_str(), fileOffset, strerror(errno));
+    failed = true;
+    return false;
+  }
+  return true;
+}
+
+bool DirectFile::writeSegments(const write_segments_t& segments,
+                               unsigned long& written) {
+  written = 0;
+  if (fd < 0 || failed) {
+    return false;
+  }
+
+  // where this write starts, to work out how much of it is on disk
+  unsigned long start = fileOffset + buffered;
+
+  for (write_segments_t::const_iterator iter = segments.begin();
+       iter != segments.end();
+       ++iter) {
+    const char* data = (const char*)iter->iov_base;
+    unsigned long remaining = iter->iov_len;
+    while (remaining) {
+      unsigned long bytes = min(remaining, bufferSize - buffered);
+      memcpy(buffer + buffered, data, bytes);
+      buffered += bytes;
+      data += bytes;
+      remaining -= bytes;
+
+      if (buffered == bufferSize && !writeBlocks(bufferSize)) {
+        written = fileOffset > start ? fileOffset - start : 0;
+        return false;
+      }
+    }
+  }
+
+  written = fileOffset + buffered - start;
+  return true;
+}
+
+void DirectFile::flush() {
+  if (fd < 0 || failed) {
+    return;
+  }
+
+  unsigned long blocks = buffered & ~(unsigned long)(DIRECT_IO_ALIGNMENT - 1);
+  if (blocks && !writeBlocks(blocks)) {
+    return;
+  }
+  if (buffered) {
+    writeTail();
+  }
+}
+
+bool DirectFile::sync() {
+  flush();
+  return !failed && datasync();
+}
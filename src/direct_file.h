@@ -0,0 +1,69 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_DIRECT_FILE_H
+#define SCRIBE_DIRECT_FILE_H
+
+#include "file.h"
+
+/*
+ * Used by file stores with direct_io=yes. Writes bypass the page cache with
+ * O_DIRECT, so logs nobody is reading don't push other data out of memory.
+ *
+ * Data is staged in an aligned buffer of buffer_size bytes, taken from a
+ * pool shared by all files, and written whenever the buffer fills. flush()
+ * also writes every whole block that's staged. The unaligned tail is
+ * written through the page cache so readers see it, and stays staged until
+ * the rest of its block is written over it directly.
+ *
+ * Filesystems that refuse O_DIRECT get ordinary writes, still in
+ * buffer_size pieces. Reading works the same as fs_type=posix.
+ */
+class DirectFile : public PosixFile {
+ public:
+  DirectFile(const std::string& name, bool framed, unsigned long buffer_size);
+  virtual ~DirectFile();
+
+  bool openWrite();
+  bool openTruncate();
+  void close();
+  bool writeSegments(const write_segments_t& segments, unsigned long& written);
+  void flush();
+  bool sync();
+
+ private:
+  bool openForWrite(int flags);
+  bool writeBlocks(unsigned long length);
+  bool writeTail();
+
+  static char* acquireBuffer(unsigned long size);
+  static void releaseBuffer(char* buffer, unsigned long size);
+
+  unsigned long bufferSize;
+  char* buffer;
+  unsigned long buffered;     // bytes staged in buffer
+  unsigned long fileOffset;   // where buffer[0] goes, always aligned
+  int tailFd;                 // the same file without O_DIRECT
+  bool failed;
+
+  // disallow copy, assignment, and empty construction
+  DirectFile();
+  DirectFile(DirectFile& rhs);
+  DirectFile& operator=(DirectFile& rhs);
+};
+
+#endif // SCRIBE_DIRECT_FILE_H
@@ -19,13 +19,25 @@
 // @author Jason Sobel
 // @author Avinash Lakshman
 
+#include <fcntl.h>
+#include <limits.h>
+
 #include "common.h"
 #include "file.h"
+#include "frame_batch.h"
 #include "HdfsFile.h"
+#include "uring_file.h"
 
 // INITIAL_BUFFER_SIZE must always be >= UINT_SIZE
 #define INITIAL_BUFFER_SIZE 4096
 #define UINT_SIZE 4
+// how much unframed files are read at a time, and the longest line
+#define LINE_READ_SIZE (INITIAL_BUFFER_SIZE * 64)
+#define MAX_LINE_SIZE 0x80000000UL
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
 using namespace std;
 using boost::shared_ptr;
@@ -35,6 +47,10 @@ boost::shared_ptr<FileInterface> FileInterface::createFileInterface(const std::s
                                                                     bool framed) {
   if (0 == type.compare("std")) {
     return shared_ptr<FileInterface>(new StdFile(name, framed));
+  } else if (0 == type.compare("posix")) {
+    return shared_ptr<FileInterface>(new PosixFile(name, framed));
+  } else if (0 == type.compare("uring")) {
+    return shared_ptr<FileInterface>(new UringFile(name, framed));
   } else if (0 == type.compare("hdfs")) {
     return shared_ptr<FileInterface>(new HdfsFile(name));
   } else {
@@ -58,8 +74,38 @@ FileInterface::FileInterface(const std::string& name, bool frame)
 FileInterface::~FileInterface() {
 }
 
+bool FileInterface::sync() {
+  flush();
+  return true;
+}
+
+bool FileInterface::writeSegments(const write_segments_t& segments,
+                                  unsigned long& written) {
+  unsigned long length = 0;
+  for (write_segments_t::const_iterator iter = segments.begin();
+       iter != segments.end();
+       ++iter) {
+    length += iter->iov_len;
+  }
+
+  string buffer;
+  buffer.reserve(length);
+  for (write_segments_t::const_iterator iter = segments.begin();
+       iter != segments.end();
+       ++iter) {
+    buffer.append((const char*)iter->iov_base, iter->iov_len);
+  }
+
+  // we can't tell how much of a failed write made it
+  bool success = write(buffer);
+  written = success ? length : 0;
+  return success;
+}
+
 StdFile::StdFile(const std::string& name, bool frame)
-  : FileInterface(name, frame), inputBuffer(NULL), bufferSize(0) {
+  : FileInterface(name, frame), batchFrames(NULL), batchLength(0),
+    batchPos(0), preallocated(false), inputBuffer(NULL), bufferSize(0),
+    inputPos(0), inputEnd(0), inputEof(false) {
 }
 
 StdFile::~StdFile() {
@@ -81,7 +127,7 @@ bool StdFile::openWrite() {
 
 bool StdFile::openTruncate() {
   // open an existing file for write and truncate its contents
-  ios_base::openmode mode = fstream::out | fstream::app | fstream::trunc;
+  ios_base::openmode mode = fstream::out | fstream::trunc;
   return open(mode);
 }
 
@@ -92,6 +138,11 @@ bool StdFile::open(ios_base::openmode mode) {
   }
 
   file.open(filename.c_str(), mode);
+  batchLength = 0;
+  batchPos = 0;
+  inputPos = 0;
+  inputEnd = 0;
+  inputEof = false;
 
   return file.good();
 }
@@ -104,6 +155,7 @@ void StdFile::close() {
   if (file.is_open()) {
     file.close();
   }
+  releasePreallocation();
 }
 
 string StdFile::getFrame(unsigned data_length) {
@@ -137,50 +189,228 @@ void StdFile::flush() {
   }
 }
 
+// The fstream doesn't give out its descriptor, so sync through another one
+bool StdFile::sync() {
+  if (!file.is_open()) {
+    return false;
+  }
+  file.flush();
+  if (file.fail()) {
+    return false;
+  }
+
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0 || fdatasync(fd) != 0) {
+    LOG_OPER("Failed to sync <%s>: %s", filename.c_str(), strerror(errno));
+    if (fd >= 0) {
+      ::close(fd);
+    }
+    return false;
+  }
+  ::close(fd);
+  return true;
+}
+
 bool StdFile::readNext(std::string& _return) {
 
+  if (!framed) {
+    return readLine(_return);
+  }
+
   if (!inputBuffer) {
     bufferSize = INITIAL_BUFFER_SIZE;
     inputBuffer = new char[bufferSize];
   }
 
-  if (framed) {
-    unsigned size;
+  while (!nextBatchRecord(_return)) {
     file.read(inputBuffer, UINT_SIZE);  // assumes INITIAL_BUFFER_SIZE > UINT_SIZE
-    if (file.good() && (size = unserializeUInt(inputBuffer))) {
-
-      // check if size is larger than half the max uint size
-      if (size >= (((unsigned)1) << (UINT_SIZE*8 - 1))) {
-        LOG_OPER("WARNING: attempting to read message of size %d bytes", size);
-
-        // Do not try to make bufferSize any larger than this or you might overflow
-        bufferSize = size;
-      }
+    if (!file.good()) {
+      return false;
+    }
 
-      while (size > bufferSize) {
-        bufferSize = 2 * bufferSize;
-        delete[] inputBuffer;
-        inputBuffer = new char[bufferSize];
+    if (isBatchMagic(inputBuffer, UINT_SIZE)) {
+      unsigned long offset = (unsigned long)file.tellg() - UINT_SIZE;
+      unsigned long batch_length;
+      batch.assign(inputBuffer, UINT_SIZE);
+      batch.resize(BATCH_HEADER_SIZE);
+      file.read(&batch[UINT_SIZE], BATCH_HEADER_SIZE - UINT_SIZE);
+      if (!file.good()) {
+        return false;
       }
-      file.read(inputBuffer, size);
-      if (file.good()) {
-        _return.assign(inputBuffer, size);
-        return true;
-      } else {
-        int offset = file.tellg();
-        LOG_OPER("ERROR: Failed to read file %s at offset %d",
+      if (!isBatchHeader(batch.data(), batch.size(), batch_length)) {
+        LOG_OPER("ERROR: Bad batch header in file %s at offset %lu",
                  filename.c_str(), offset);
-        return false;
+        if (!skipToBatch(offset)) {
+          return false;
+        }
+        continue;
       }
+      // A batch that's cut short or fails its checks may still have good
+      // batches inside what it claims, like after a torn write
+      bool whole = offset + batch_length <= fileSize();
+      if (whole) {
+        batch.resize(batch_length);
+        file.read(&batch[BATCH_HEADER_SIZE], batch_length - BATCH_HEADER_SIZE);
+      }
+      if (!whole || !file.good() || !openBatch(offset)) {
+        if (!skipToBatch(offset)) {
+          return false;
+        }
+      }
+      continue;
     }
-  } else {
-    file.getline(inputBuffer, bufferSize);
+
+    unsigned size = unserializeUInt(inputBuffer);
+    if (!size) {
+      return false;
+    }
+
+    // a bad length mustn't cost an allocation bigger than the file
+    if (size > bufferSize) {
+      unsigned long offset = (unsigned long)file.tellg();
+      if (offset + size > fileSize()) {
+        // cut short, or a bad length, unless there's a batch after it
+        LOG_OPER("ERROR: Frame of %u bytes runs past the end of file %s at "
+                 "offset %lu", size, filename.c_str(), offset - UINT_SIZE);
+        if (!skipToBatch(offset - UINT_SIZE)) {
+          return false;
+        }
+        continue;
+      }
+    }
+
+    // check if size is larger than half the max uint size
+    if (size >= (((unsigned)1) << (UINT_SIZE*8 - 1))) {
+      LOG_OPER("WARNING: attempting to read message of size %d bytes", size);
+
+      // Do not try to make bufferSize any larger than this or you might overflow
+      bufferSize = size;
+    }
+
+    while (size > bufferSize) {
+      bufferSize = 2 * bufferSize;
+      delete[] inputBuffer;
+      inputBuffer = new char[bufferSize];
+    }
+    file.read(inputBuffer, size);
     if (file.good()) {
-      _return = inputBuffer;
+      _return.assign(inputBuffer, size);
       return true;
+    } else {
+      int offset = file.tellg();
+      LOG_OPER("ERROR: Failed to read file %s at offset %d",
+               filename.c_str(), offset);
+      return false;
+    }
+  }
+  return true;
+}
+
+// A line, not including the newline. Lines are found in big reads, and
+// the buffer only grows for a line that doesn't fit in it. Like getline,
+// an unterminated last line isn't returned.
+bool StdFile::readLine(std::string& _return) {
+  if (!inputBuffer) {
+    bufferSize = LINE_READ_SIZE;
+    inputBuffer = new char[bufferSize];
+  }
+
+  unsigned long scanned = inputPos;
+  while (true) {
+    const char* newline = (const char*)memchr(inputBuffer + scanned, '\n',
+                                              inputEnd - scanned);
+    if (newline) {
+      _return.assign(inputBuffer + inputPos, newline - inputBuffer - inputPos);
+      inputPos = newline + 1 - inputBuffer;
+      return true;
+    }
+    if (inputEof) {
+      return false;
+    }
+
+    // make room for more at the end of the buffer
+    unsigned long buffered = inputEnd - inputPos;
+    if (buffered == bufferSize) {
+      if (bufferSize >= MAX_LINE_SIZE) {
+        LOG_OPER("ERROR: Line longer than %lu bytes in file %s",
+                 MAX_LINE_SIZE, filename.c_str());
+        return false;
+      }
+      char* bigger = new char[bufferSize * 2];
+      memcpy(bigger, inputBuffer + inputPos, buffered);
+      delete[] inputBuffer;
+      inputBuffer = bigger;
+      bufferSize *= 2;
+    } else if (inputPos > 0) {
+      memmove(inputBuffer, inputBuffer + inputPos, buffered);
+    }
+    inputPos = 0;
+    inputEnd = buffered;
+    scanned = buffered;
+
+    file.read(inputBuffer + inputEnd, bufferSize - inputEnd);
+    inputEnd += file.gcount();
+    if (!file.good()) {
+      inputEof = true;
+    }
+  }
+}
+
+// Moves on to the next intact batch header after the bad data at offset,
+// if there is one
+bool StdFile::skipToBatch(unsigned long offset) {
+  string data;
+  char buffer[INITIAL_BUFFER_SIZE * 16];
+  unsigned long start = offset + 1;  // where data starts in the file
+
+  file.clear();
+  file.seekg(start);
+  while (true) {
+    file.read(buffer, sizeof(buffer));
+    data.append(buffer, file.gcount());
+
+    unsigned long found;
+    if (findBatchHeader(data.data(), data.size(), 0, found)) {
+      LOG_OPER("Skipping <%lu> unreadable bytes at offset <%lu> of <%s>",
+               start + found - offset, offset, filename.c_str());
+      file.clear();
+      file.seekg(start + found);
+      return file.good();
+    }
+    if (!file.good()) {
+      return false;
+    }
+
+    // the end could be the start of a header
+    if (data.size() >= BATCH_HEADER_SIZE) {
+      unsigned long searched = data.size() - (BATCH_HEADER_SIZE - 1);
+      data.erase(0, searched);
+      start += searched;
     }
   }
-  return false;
+}
+
+// Checks the batch that was just read, so its records can be returned.
+bool StdFile::openBatch(unsigned long offset) {
+  batchPos = 0;
+  if (!readBatch(batch.data(), batch.size(), batchDecoded, batchFrames,
+                 batchLength)) {
+    LOG_OPER("ERROR: Bad checksum or records in batch in file %s at offset "
+             "%lu, skipping it", filename.c_str(), offset);
+    batchLength = 0;
+    return false;
+  }
+  return true;
+}
+
+bool StdFile::nextBatchRecord(std::string& _return) {
+  if (batchPos >= batchLength) {
+    return false;
+  }
+  unsigned size = unserializeUInt(batchFrames + batchPos);
+  _return.assign(batchFrames + batchPos + UINT_SIZE, size);
+  batchPos += UINT_SIZE + size;
+  return true;
 }
 
 unsigned long StdFile::fileSize() {
@@ -233,6 +463,50 @@ bool StdFile::createSymlink(std::string oldpath, std::string newpath) {
   return false;
 }
 
+bool StdFile::rename(const std::string& newname) {
+  if (::rename(filename.c_str(), newname.c_str()) != 0) {
+    LOG_OPER("Failed to rename <%s> to <%s>: %s", filename.c_str(),
+             newname.c_str(), strerror(errno));
+    return false;
+  }
+  filename = newname;
+  return true;
+}
+
+bool StdFile::preallocate(unsigned long length) {
+  int fd = ::open(filename.c_str(), O_WRONLY);
+  if (fd < 0) {
+    return false;
+  }
+  int result = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length);
+  ::close(fd);
+  if (result != 0) {
+    static bool warned = false;
+    if (!warned) {
+      LOG_OPER("Failed to preallocate <%s>, leaving files to grow as they're "
+               "written: %s", filename.c_str(), strerror(errno));
+      warned = true;
+    }
+    return false;
+  }
+  preallocated = true;
+  return true;
+}
+
+// Truncating to the current size frees the reserved space past the end
+void StdFile::releasePreallocation() {
+  if (!preallocated) {
+    return;
+  }
+  preallocated = false;
+  struct stat st;
+  if (stat(filename.c_str(), &st) == 0 &&
+      truncate(filename.c_str(), st.st_size) != 0) {
+    LOG_OPER("Failed to release unused space in <%s>: %s", filename.c_str(),
+             strerror(errno));
+  }
+}
+
 // Buffer had better be at least UINT_SIZE long!
 unsigned FileInterface::unserializeUInt(const char* buffer) {
   unsigned retval = 0;
@@ -249,3 +523,282 @@ void FileInterface::serializeUInt(unsigned data, char* buffer) {
     buffer[i] = (unsigned char)((data >> (8 * i)) & 0xFF);
   }
 }
+
+PosixFile::PosixFile(const std::string& name, bool frame)
+  : StdFile(name, frame), fd(-1), readPos(0), readEof(false) {
+}
+
+PosixFile::~PosixFile() {
+  close();
+}
+
+bool PosixFile::openRead() {
+  return open(O_RDONLY);
+}
+
+bool PosixFile::openWrite() {
+  return open(O_WRONLY | O_CREAT | O_APPEND);
+}
+
+bool PosixFile::openTruncate() {
+  return open(O_WRONLY | O_CREAT | O_APPEND | O_TRUNC);
+}
+
+bool PosixFile::open(int flags) {
+  if (fd >= 0) {
+    return false;
+  }
+
+  fd = ::open(filename.c_str(), flags, 0644);
+  batchLength = 0;
+  batchPos = 0;
+  readBuffer.clear();
+  readPos = 0;
+  readEof = false;
+  return fd >= 0;
+}
+
+bool PosixFile::isOpen() {
+  return fd >= 0;
+}
+
+void PosixFile::close() {
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  releasePreallocation();
+}
+
+bool PosixFile::write(const std::string& data) {
+  write_segments_t segments(1);
+  segments[0].iov_base = (void*)data.data();
+  segments[0].iov_len = data.size();
+  unsigned long written;
+  return writeSegments(segments, written);
+}
+
+// One writev per IOV_MAX segments, carrying on after short writes
+bool PosixFile::writeSegments(const write_segments_t& segments,
+                              unsigned long& written) {
+  written = 0;
+  if (fd < 0) {
+    return false;
+  }
+
+  unsigned long index = 0;
+  unsigned long offset = 0;  // into segments[index]
+  struct iovec batch[IOV_MAX];
+
+  while (index < segments.size()) {
+    int count = 0;
+    for (unsigned long i = index; i < segments.size() && count < IOV_MAX; ++i) {
+      batch[count] = segments[i];
+      if (i == index) {
+        batch[count].iov_base = (char*)batch[count].iov_base + offset;
+        batch[count].iov_len -= offset;
+      }
+      ++count;
+    }
+
+    ssize_t bytes = ::writev(fd, batch, count);
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_OPER("Failed to write to file <%s> after <%lu> bytes: %s",
+               filename.c_str(), written, strerror(errno));
+      return false;
+    }
+    written += bytes;
+
+    // skip past whatever was written
+    unsigned long remaining = bytes;
+    while (index < segments.size() &&
+           remaining >= segments[index].iov_len - offset) {
+      remaining -= segments[index].iov_len - offset;
+      offset = 0;
+      ++index;
+    }
+    offset += remaining;
+  }
+  return true;
+}
+
+void PosixFile::flush() {
+  // nothing is buffered in user space
+}
+
+bool PosixFile::sync() {
+  flush();
+  return datasync();
+}
+
+bool PosixFile::datasync() {
+  if (fd < 0) {
+    return false;
+  }
+  if (fdatasync(fd) != 0) {
+    LOG_OPER("Failed to sync <%s>: %s", filename.c_str(), strerror(errno));
+    return false;
+  }
+  return true;
+}
+
+// Makes sure at least bytes of unread data are buffered, unless the file
+// ends first
+bool PosixFile::fillReadBuffer(unsigned long bytes) {
+  if (readPos > 0 && readPos >= readBuffer.size() / 2) {
+    readBuffer.erase(0, readPos);
+    readPos = 0;
+  }
+
+  char buffer[INITIAL_BUFFER_SIZE * 16];
+  while (readBuffer.size() - readPos < bytes && !readEof) {
+    ssize_t got = ::read(fd, buffer, sizeof(buffer));
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_OPER("ERROR: Failed to read file %s: %s",
+               filename.c_str(), strerror(errno));
+      return false;
+    } else if (got == 0) {
+      readEof = true;
+    } else {
+      readBuffer.append(buffer, got);
+    }
+  }
+  return readBuffer.size() - readPos >= bytes;
+}
+
+// Like StdFile::skipToBatch, for the bad data at readPos, which is at
+// offset in the file
+bool PosixFile::skipToBatch(unsigned long offset) {
+  ++readPos;
+  unsigned long skipped = 1;
+  while (true) {
+    unsigned long found;
+    if (findBatchHeader(readBuffer.data(), readBuffer.size(), readPos,
+                        found)) {
+      skipped += found - readPos;
+      readPos = found;
+      LOG_OPER("Skipping <%lu> unreadable bytes at offset <%lu> of <%s>",
+               skipped, offset, filename.c_str());
+      return true;
+    }
+    if (readEof) {
+      readPos = readBuffer.size();
+      return false;
+    }
+
+    // the end could be the start of a header
+    if (readBuffer.size() >= readPos + BATCH_HEADER_SIZE) {
+      unsigned long keep = readBuffer.size() - (BATCH_HEADER_SIZE - 1);
+      skipped += keep - readPos;
+      readPos = keep;
+    }
+    if (!fillReadBuffer(readBuffer.size() - readPos +
+                        INITIAL_BUFFER_SIZE * 16) && !readEof) {
+      return false;
+    }
+  }
+}
+
+bool PosixFile::readNext(std::string& _return) {
+  if (fd < 0) {
+    return false;
+  }
+
+  if (framed) {
+    while (!nextBatchRecord(_return)) {
+      if (!fillReadBuffer(UINT_SIZE)) {
+        return false;
+      }
+      unsigned long offset = (unsigned long)lseek(fd, 0, SEEK_CUR) -
+                             (readBuffer.size() - readPos);
+
+      if (isBatchMagic(readBuffer.data() + readPos, UINT_SIZE)) {
+        unsigned long batch_length;
+        if (!fillReadBuffer(BATCH_HEADER_SIZE)) {
+          return false;
+        }
+        if (!isBatchHeader(readBuffer.data() + readPos, BATCH_HEADER_SIZE,
+                           batch_length)) {
+          LOG_OPER("ERROR: Bad batch header in file %s at offset %lu",
+                   filename.c_str(), offset);
+          if (!skipToBatch(offset)) {
+            return false;
+          }
+          continue;
+        }
+        // like StdFile, a bad batch may have good ones inside it
+        struct stat st;
+        if ((fstat(fd, &st) == 0 &&
+             offset + batch_length > (unsigned long)st.st_size) ||
+            !fillReadBuffer(batch_length)) {
+          if (!skipToBatch(offset)) {
+            return false;
+          }
+          continue;
+        }
+        batch.assign(readBuffer, readPos, batch_length);
+        if (!openBatch(offset)) {
+          if (!skipToBatch(offset)) {
+            return false;
+          }
+          continue;
+        }
+        readPos += batch_length;
+        continue;
+      }
+
+      unsigned size = unserializeUInt(readBuffer.data() + readPos);
+      if (!size) {
+        return false;
+      }
+
+      // a bad length mustn't have the whole file read in looking for the end
+      struct stat st;
+      if (UINT_SIZE + (unsigned long)size > readBuffer.size() - readPos &&
+          fstat(fd, &st) == 0 &&
+          offset + UINT_SIZE + size > (unsigned long)st.st_size) {
+        // cut short, or a bad length, unless there's a batch after it
+        LOG_OPER("ERROR: Frame of %u bytes runs past the end of file %s at "
+                 "offset %lu", size, filename.c_str(), offset);
+        if (!skipToBatch(offset)) {
+          return false;
+        }
+        continue;
+      }
+
+      if (!fillReadBuffer(UINT_SIZE + (unsigned long)size)) {
+        LOG_OPER("ERROR: Failed to read file %s at offset %lu",
+                 filename.c_str(), offset);
+        return false;
+      }
+      _return.assign(readBuffer, readPos + UINT_SIZE, size);
+      readPos += UINT_SIZE + size;
+      return true;
+    }
+    return true;
+  }
+
+  // a line, not including the newline. Like StdFile, an unterminated
+  // last line isn't returned. What's been searched isn't searched again
+  // while a long line is read in.
+  unsigned long scanned = 0;
+  const char* newline;
+  while (!(newline = (const char*)memchr(readBuffer.data() + readPos + scanned,
+                                         '\n', readBuffer.size() - readPos -
+                                                scanned))) {
+    scanned = readBuffer.size() - readPos;
+    if (readEof || !fillReadBuffer(scanned + 1)) {
+      return false;
+    }
+  }
+  unsigned long length = newline - readBuffer.data() - readPos;
+  _return.assign(readBuffer, readPos, length);
+  readPos += length + 1;
+  return true;
+}
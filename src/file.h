@@ -22,8 +22,14 @@
 #ifndef SCRIBE_FILE_H
 #define SCRIBE_FILE_H
 
+#include <sys/uio.h>
+
 #include "common.h"
 
+// Pieces of data to be written one after another, without copying them
+// into a single buffer first
+typedef std::vector<struct iovec> write_segments_t;
+
 class FileInterface {
  public:
   FileInterface(const std::string& name, bool framed);
@@ -40,7 +46,15 @@ class FileInterface {
   virtual bool isOpen() = 0;
   virtual void close() = 0;
   virtual bool write(const std::string& data) = 0;
+  // Writes every segment in order. written is set to the number of bytes
+  // that made it to the file, even when the write fails part way through.
+  // The default copies the segments into one buffer and calls write().
+  virtual bool writeSegments(const write_segments_t& segments,
+                             unsigned long& written);
   virtual void flush() = 0;
+  // Flushes, then waits until everything written is on disk. The default
+  // only flushes.
+  virtual bool sync();
   virtual unsigned long fileSize() = 0;
   virtual bool readNext(std::string& _return) = 0; // returns a line if unframed or a record if framed
   virtual void deleteFile() = 0;
@@ -48,6 +62,12 @@ class FileInterface {
   virtual std::string getFrame(unsigned data_size) {return std::string();};
   virtual bool createDirectory(std::string path) = 0;
   virtual bool createSymlink(std::string oldpath, std::string newpath) = 0;
+  // Renames the file, open or not. The default can't.
+  virtual bool rename(const std::string& newname) { return false; }
+  // Reserves space on disk for the file to grow to length bytes, without
+  // changing its size. Whatever isn't used is given back when the file is
+  // closed. The default can't.
+  virtual bool preallocate(unsigned long length) { return false; }
 
  protected:
   bool framed;
@@ -69,6 +89,7 @@ class StdFile : public FileInterface {
   void close();
   bool write(const std::string& data);
   void flush();
+  bool sync();
   unsigned long fileSize();
   bool readNext(std::string& _return);
   void deleteFile();
@@ -76,12 +97,34 @@ class StdFile : public FileInterface {
   std::string getFrame(unsigned data_size);
   bool createDirectory(std::string path);
   bool createSymlink(std::string newpath, std::string oldpath);
+  bool rename(const std::string& newname);
+  bool preallocate(unsigned long length);
+
+ protected:
+  void releasePreallocation();
+  bool openBatch(unsigned long offset);
+  bool nextBatchRecord(std::string& _return);
+
+  // the version 2 batch being read (see frame_batch.h), and its frames
+  std::string batch;
+  std::string batchDecoded;
+  const char* batchFrames;
+  unsigned long batchLength;
+  unsigned long batchPos;
 
  private:
   bool open(std::ios_base::openmode mode);
+  bool readLine(std::string& _return);
+  bool skipToBatch(unsigned long offset);
+
+  bool preallocated;
 
   char* inputBuffer;
-  unsigned bufferSize;
+  unsigned long bufferSize;
+  // unread lines of an unframed file are inputBuffer[inputPos, inputEnd)
+  unsigned long inputPos;
+  unsigned long inputEnd;
+  bool inputEof;
   std::fstream file;
 
   // disallow copy, assignment, and empty construction
@@ -90,4 +133,43 @@ class StdFile : public FileInterface {
   StdFile& operator=(StdFile& rhs);
 };
 
+// fs_type=posix: a plain file descriptor instead of an fstream, so that
+// writeSegments can hand the segments straight to writev. Listing,
+// deleting and directories work the same as for StdFile.
+class PosixFile : public StdFile {
+ public:
+  PosixFile(const std::string& name, bool framed);
+  virtual ~PosixFile();
+
+  bool openRead();
+  bool openWrite();
+  bool openTruncate();
+  bool isOpen();
+  void close();
+  bool write(const std::string& data);
+  bool writeSegments(const write_segments_t& segments, unsigned long& written);
+  void flush();
+  bool sync();
+  bool readNext(std::string& _return);
+
+ protected:
+  bool open(int flags);
+  bool datasync();
+
+  int fd;
+
+ private:
+  bool fillReadBuffer(unsigned long bytes);
+  bool skipToBatch(unsigned long offset);
+
+  std::string readBuffer;
+  unsigned long readPos;  // start of the unread data in readBuffer
+  bool readEof;
+
+  // disallow copy, assignment, and empty construction
+  PosixFile();
+  PosixFile(PosixFile& rhs);
+  PosixFile& operator=(PosixFile& rhs);
+};
+
 #endif // !defined SCRIBE_FILE_H
@@ -0,0 +1,218 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "file_rotate.h"
+#include "stats.h"
+#include "thread_placement.h"
+
+using namespace std;
+using boost::shared_ptr;
+
+static StatCounter statPreopened("file store preopened rotations");
+static StatCounter statNotPreopened("file store rotations not preopened");
+
+namespace {
+
+void* rotateThreadStatic(void *this_ptr) {
+  FileRotator *rotator_ptr = (FileRotator*)this_ptr;
+  ThreadPlacement::placeCurrentThread(THREAD_STORE);
+  rotator_ptr->threadMember();
+  return NULL;
+}
+
+} // namespace
+
+SymlinkTask::SymlinkTask(const string& fs_type, const string& target_,
+                         const string& name_)
+  : fsType(fs_type),
+    target(target_),
+    name(name_) {
+}
+
+void SymlinkTask::run() {
+  shared_ptr<FileInterface> link =
+    FileInterface::createFileInterface(fsType, name);
+  if (link) {
+    link->deleteFile();
+    link->createSymlink(target, name);
+  }
+}
+
+AppendTask::AppendTask(const string& fs_type, const string& filename_,
+                       const string& directory_, const string& text_)
+  : fsType(fs_type),
+    filename(filename_),
+    directory(directory_),
+    text(text_) {
+}
+
+void AppendTask::run() {
+  shared_ptr<FileInterface> file =
+    FileInterface::createFileInterface(fsType, filename);
+  if (!file ||
+      !file->createDirectory(directory) ||
+      !file->openWrite()) {
+    LOG_OPER("Failed to open <%s> of type <%s> for writing",
+             filename.c_str(), fsType.c_str());
+    return;
+  }
+  file->write(text);
+  file->close();
+}
+
+PreopenedFile::PreopenedFile(shared_ptr<FileInterface> file_,
+                             const string& filename_,
+                             unsigned long preallocate_)
+  : state(PREOPEN_PENDING),
+    abandoned(false),
+    file(file_),
+    filename(filename_),
+    preallocate(preallocate_) {
+  pthread_mutex_init(&lock, NULL);
+}
+
+PreopenedFile::~PreopenedFile() {
+  pthread_mutex_destroy(&lock);
+}
+
+string PreopenedFile::hiddenName(const string& filename) {
+  string::size_type slash = filename.rfind('/');
+  string::size_type name_pos = slash == string::npos ? 0 : slash + 1;
+  return filename.substr(0, name_pos) + "." + filename.substr(name_pos) +
+         ".preopen";
+}
+
+void PreopenedFile::run() {
+  pthread_mutex_lock(&lock);
+  if (state == PREOPEN_PENDING && !abandoned) {
+    pthread_mutex_unlock(&lock);
+
+    // truncated in case an earlier run left it behind
+    bool opened = file->openTruncate();
+    if (!opened) {
+      LOG_OPER("Failed to open <%s> ahead of time", filename.c_str());
+    } else if (preallocate) {
+      file->preallocate(preallocate);
+    }
+
+    pthread_mutex_lock(&lock);
+    state = opened ? PREOPEN_OPEN : PREOPEN_CLOSED;
+  } else if (state == PREOPEN_PENDING) {
+    state = PREOPEN_CLOSED;
+  }
+
+  bool cleanup = state == PREOPEN_OPEN && abandoned;
+  if (cleanup) {
+    state = PREOPEN_CLOSED;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (cleanup) {
+    file->close();
+    file->deleteFile();
+  }
+}
+
+shared_ptr<FileInterface> PreopenedFile::take() {
+  pthread_mutex_lock(&lock);
+  abandoned = true;
+  bool ready = state == PREOPEN_OPEN;
+  if (ready) {
+    state = PREOPEN_TAKEN;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (!ready) {
+    statNotPreopened.increment();
+    return shared_ptr<FileInterface>();
+  }
+  if (!file->rename(filename)) {
+    statNotPreopened.increment();
+    file->close();
+    file->deleteFile();
+    return shared_ptr<FileInterface>();
+  }
+  statPreopened.increment();
+  return file;
+}
+
+void PreopenedFile::abandon() {
+  pthread_mutex_lock(&lock);
+  abandoned = true;
+  bool cleanup = state == PREOPEN_OPEN;
+  if (cleanup) {
+    state = PREOPEN_CLOSED;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (cleanup) {
+    file->close();
+    file->deleteFile();
+  }
+}
+
+// Never deleted, the thread may still be using it during exit
+FileRotator* FileRotator::get() {
+  static FileRotator* instance = new FileRotator();
+  return instance;
+}
+
+FileRotator::FileRotator()
+  : running(false) {
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&hasTasks, NULL);
+}
+
+void FileRotator::add(shared_ptr<RotationTask> task) {
+  pthread_mutex_lock(&lock);
+  if (!running) {
+    if (pthread_create(&rotateThread, NULL, rotateThreadStatic,
+                       (void*)this) != 0) {
+      pthread_mutex_unlock(&lock);
+      LOG_OPER("Failed to create the file rotation thread: %s",
+               strerror(errno));
+      task->run();
+      return;
+    }
+    pthread_detach(rotateThread);
+    running = true;
+  }
+  tasks.push_back(task);
+  pthread_cond_signal(&hasTasks);
+  pthread_mutex_unlock(&lock);
+}
+
+void FileRotator::threadMember() {
+  LOG_OPER("Starting the file rotation thread");
+
+  pthread_mutex_lock(&lock);
+  while (true) {
+    if (tasks.empty()) {
+      pthread_cond_wait(&hasTasks, &lock);
+      continue;
+    }
+    shared_ptr<RotationTask> task = tasks.front();
+    tasks.pop_front();
+    pthread_mutex_unlock(&lock);
+
+    task->run();
+    task.reset();
+
+    pthread_mutex_lock(&lock);
+  }
+}
@@ -0,0 +1,138 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_FILE_ROTATE_H
+#define SCRIBE_FILE_ROTATE_H
+
+#include "common.h"
+#include "file.h"
+
+// Work a file store hands to the rotation thread
+class RotationTask {
+ public:
+  virtual ~RotationTask() {}
+  virtual void run() = 0;
+};
+
+// Points the symlink name at target, replacing what was there
+class SymlinkTask : public RotationTask {
+ public:
+  SymlinkTask(const std::string& fs_type, const std::string& target,
+              const std::string& name);
+  void run();
+
+ private:
+  std::string fsType;
+  std::string target;
+  std::string name;
+};
+
+// Appends text to filename, creating directory first if it's missing
+class AppendTask : public RotationTask {
+ public:
+  AppendTask(const std::string& fs_type, const std::string& filename,
+             const std::string& directory, const std::string& text);
+  void run();
+
+ private:
+  std::string fsType;
+  std::string filename;
+  std::string directory;
+  std::string text;
+};
+
+/*
+ * The next file of a file store, opened ahead of time under a hidden name
+ * (see hiddenName) and optionally preallocated, so rotating to it is a
+ * rename.
+ *
+ * take() and abandon() are for the store. If the file isn't open yet, it's
+ * too late: the store opens its next file itself, and this one is closed
+ * and deleted as soon as it has been opened.
+ */
+class PreopenedFile : public RotationTask {
+ public:
+  PreopenedFile(boost::shared_ptr<FileInterface> file,
+                const std::string& filename, unsigned long preallocate);
+  virtual ~PreopenedFile();
+
+  void run();
+
+  // The name the file gets when it's taken
+  const std::string& getFilename() { return filename; }
+
+  // Returns the file under its real name, or an empty pointer if it isn't
+  // ready
+  boost::shared_ptr<FileInterface> take();
+  void abandon();
+
+  // ".<name>.preopen" in the same directory, which no store lists
+  static std::string hiddenName(const std::string& filename);
+
+ private:
+  enum preopen_state_t {
+    PREOPEN_PENDING,
+    PREOPEN_OPEN,
+    PREOPEN_TAKEN,
+    PREOPEN_CLOSED
+  };
+
+  pthread_mutex_t lock;   // Must be held to read/modify the two below
+  preopen_state_t state;
+  bool abandoned;
+
+  boost::shared_ptr<FileInterface> file;
+  std::string filename;
+  unsigned long preallocate;
+
+  // disallow copy, assignment, and empty construction
+  PreopenedFile();
+  PreopenedFile(const PreopenedFile& rhs);
+  PreopenedFile& operator=(const PreopenedFile& rhs);
+};
+
+/*
+ * One thread shared by every file store with async_rotate=yes, which runs
+ * the slow parts of rotating in the order they were added: opening the
+ * next file, moving the symlink, and writing scribe_stats. Started the
+ * first time a task is added and runs until exit.
+ */
+class FileRotator {
+ public:
+  static FileRotator* get();
+
+  void add(boost::shared_ptr<RotationTask> task);
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void threadMember();
+
+ private:
+  FileRotator();
+
+  pthread_mutex_t lock;
+  pthread_cond_t hasTasks;
+  pthread_t rotateThread;
+  bool running;
+  std::deque<boost::shared_ptr<RotationTask> > tasks;
+
+  // disallow copy and assignment
+  FileRotator(const FileRotator& rhs);
+  FileRotator& operator=(const FileRotator& rhs);
+};
+
+#endif // SCRIBE_FILE_ROTATE_H
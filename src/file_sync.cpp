@@ -0,0 +1,222 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "file_sync.h"
+#include "thread_placement.h"
+
+using namespace std;
+
+static StatCounter statSyncs("file store syncs");
+static StatCounter statSyncedFiles("file store synced files");
+static StatCounter statSyncErrors("file store sync errors");
+
+namespace {
+
+void* syncThreadStatic(void *this_ptr) {
+  FileSyncer *syncer_ptr = (FileSyncer*)this_ptr;
+  ThreadPlacement::placeCurrentThread(THREAD_STORE);
+  syncer_ptr->threadMember();
+  return NULL;
+}
+
+} // namespace
+
+// Never deleted, the thread may still be using it during exit
+FileSyncer* FileSyncer::get() {
+  static FileSyncer* instance = new FileSyncer();
+  return instance;
+}
+
+FileSyncer::FileSyncer()
+  : running(false),
+    nextHandle(0) {
+  pthread_mutex_init(&lock, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&changed, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+}
+
+// Called with lock held
+bool FileSyncer::start() {
+  if (running) {
+    return true;
+  }
+  if (pthread_create(&syncThread, NULL, syncThreadStatic, (void*)this) != 0) {
+    LOG_OPER("Failed to create the file sync thread: %s", strerror(errno));
+    return false;
+  }
+  pthread_detach(syncThread);
+  running = true;
+  return true;
+}
+
+int FileSyncer::add(const string& filename, unsigned long interval_ms,
+                    const StageLatency& latency) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    LOG_OPER("Failed to open <%s> for syncing: %s", filename.c_str(),
+             strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (!start()) {
+    pthread_mutex_unlock(&lock);
+    close(fd);
+    return -1;
+  }
+  int handle = nextHandle++;
+  Entry& entry = entries[handle];
+  entry.filename = filename;
+  entry.fd = fd;
+  entry.device = st.st_dev;
+  entry.intervalMs = interval_ms;
+  entry.lastSync = monotonicMillis();
+  entry.isDirty = false;
+  entry.latency = latency;
+  pthread_mutex_unlock(&lock);
+  return handle;
+}
+
+void FileSyncer::remove(int handle) {
+  pthread_mutex_lock(&lock);
+  map<int, Entry>::iterator iter = entries.find(handle);
+  if (iter != entries.end()) {
+    close(iter->second.fd);
+    entries.erase(iter);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void FileSyncer::dirty(int handle) {
+  pthread_mutex_lock(&lock);
+  map<int, Entry>::iterator iter = entries.find(handle);
+  if (iter != entries.end() && !iter->second.isDirty) {
+    iter->second.isDirty = true;
+    pthread_cond_signal(&changed);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void FileSyncer::threadMember() {
+  LOG_OPER("Starting the file sync thread");
+  struct timespec abs_timeout;
+
+  pthread_mutex_lock(&lock);
+  while (true) {
+    // Find the filesystems with a file that's due, and when the next one
+    // will be if none are
+    uint64_t now = monotonicMillis();
+    uint64_t next_due = 0;
+    set<dev_t> due_devices;
+    for (map<int, Entry>::iterator iter = entries.begin();
+         iter != entries.end();
+         ++iter) {
+      Entry& entry = iter->second;
+      if (!entry.isDirty) {
+        continue;
+      }
+      uint64_t due = entry.lastSync + entry.intervalMs;
+      if (due <= now) {
+        due_devices.insert(entry.device);
+      } else if (next_due == 0 || due < next_due) {
+        next_due = due;
+      }
+    }
+
+    if (due_devices.empty()) {
+      if (next_due == 0) {
+        pthread_cond_wait(&changed, &lock);
+      } else {
+        abs_timeout.tv_sec = next_due / 1000;
+        abs_timeout.tv_nsec = (next_due % 1000) * 1000000;
+        pthread_cond_timedwait(&changed, &lock, &abs_timeout);
+      }
+      continue;
+    }
+
+    // Take every dirty file on those filesystems. Anything written from
+    // here on marks its file dirty again.
+    map<dev_t, vector<Pending> > groups;
+    for (map<int, Entry>::iterator iter = entries.begin();
+         iter != entries.end();
+         ++iter) {
+      Entry& entry = iter->second;
+      if (!entry.isDirty || due_devices.find(entry.device) ==
+                            due_devices.end()) {
+        continue;
+      }
+      Pending pending;
+      pending.filename = entry.filename;
+      pending.fd = dup(entry.fd);
+      pending.device = entry.device;
+      pending.latency = entry.latency;
+      if (pending.fd < 0) {
+        LOG_OPER("Failed to sync <%s>: %s", entry.filename.c_str(),
+                 strerror(errno));
+        statSyncErrors.increment();
+        continue;
+      }
+      groups[entry.device].push_back(pending);
+      entry.isDirty = false;
+      entry.lastSync = now;
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (map<dev_t, vector<Pending> >::iterator iter = groups.begin();
+         iter != groups.end();
+         ++iter) {
+      syncDevice(iter->second);
+    }
+
+    pthread_mutex_lock(&lock);
+  }
+}
+
+void FileSyncer::syncDevice(vector<Pending>& group) {
+  uint64_t start = monotonicMicros();
+  int result = group.size() == 1 ? fdatasync(group[0].fd)
+                                 : syncfs(group[0].fd);
+  if (result != 0) {
+    LOG_OPER("Failed to sync <%s>%s: %s", group[0].filename.c_str(),
+             group.size() == 1 ? "" : " and the rest of its filesystem",
+             strerror(errno));
+    statSyncErrors.increment();
+  }
+
+  statSyncs.increment();
+  statSyncedFiles.increment(group.size());
+  for (vector<Pending>::iterator iter = group.begin();
+       iter != group.end();
+       ++iter) {
+    if (result == 0) {
+      iter->latency.recordSince(start);
+    }
+    close(iter->fd);
+  }
+}
@@ -0,0 +1,93 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_FILE_SYNC_H
+#define SCRIBE_FILE_SYNC_H
+
+#include <sys/types.h>
+
+#include "common.h"
+#include "stats.h"
+
+/*
+ * The sync thread for file stores with fsync=interval. Each store registers
+ * the file it's writing along with how often it must be synced, and marks it
+ * dirty after writing to it. The thread syncs a dirty file once its interval
+ * is up.
+ *
+ * Files are synced together per filesystem: when one file is due, every
+ * dirty file on the same filesystem goes with it, whether or not it's due
+ * yet. A lone file gets an fdatasync; several get one syncfs, so the
+ * filesystem can write them all back and flush its journal once instead of
+ * once per file. Every store covered by a sync has its time recorded in its
+ * fsync latency histogram.
+ *
+ * The thread starts the first time a file is added and runs until exit.
+ */
+class FileSyncer {
+ public:
+  static FileSyncer* get();
+
+  // Returns a handle for the other calls, or -1 if filename can't be opened
+  int add(const std::string& filename, unsigned long interval_ms,
+          const StageLatency& latency);
+  // After this returns the file is no longer synced
+  void remove(int handle);
+  // The file has been written to since it was last synced
+  void dirty(int handle);
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void threadMember();
+
+ private:
+  FileSyncer();
+  bool start();
+
+  struct Entry {
+    std::string filename;
+    int fd;
+    dev_t device;
+    unsigned long intervalMs;
+    uint64_t lastSync;    // monotonicMillis() of the last sync
+    bool isDirty;
+    StageLatency latency;
+  };
+
+  // a file being synced in one pass of the thread
+  struct Pending {
+    std::string filename;
+    int fd;               // a dup, so remove() can close the entry's fd
+    dev_t device;
+    StageLatency latency;
+  };
+
+  void syncDevice(std::vector<Pending>& group);
+
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  pthread_t syncThread;
+  bool running;
+  int nextHandle;
+  std::map<int, Entry> entries;
+
+  // disallow copy and assignment
+  FileSyncer(const FileSyncer& rhs);
+  FileSyncer& operator=(const FileSyncer& rhs);
+};
+
+#endif // SCRIBE_FILE_SYNC_H
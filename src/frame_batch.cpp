@@ -0,0 +1,145 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "compression.h"
+#include "crc32c.h"
+#include "frame_batch.h"
+
+// size of a frame header, as written by FileInterface::getFrame
+#define FRAME_SIZE 4
+
+using namespace std;
+
+static const char batch_magic[4] = {'S', 'C', 'F', 'B'};
+
+static void putUInt(unsigned long value, char* buffer) {
+  for (int i = 0; i < 4; ++i) {
+    buffer[i] = (char)(value >> (8 * i));
+  }
+}
+
+static unsigned long getUInt(const char* buffer) {
+  unsigned long value = 0;
+  for (int i = 0; i < 4; ++i) {
+    value |= (unsigned long)(unsigned char)buffer[i] << (8 * i);
+  }
+  return value;
+}
+
+// Checks that the frames fill length bytes exactly, records of them
+static bool checkFrames(const char* data, unsigned long length,
+                        unsigned long records) {
+  unsigned long offset = 0;
+  unsigned long count = 0;
+  while (length - offset >= FRAME_SIZE) {
+    unsigned long frame_size = getUInt(data + offset);
+    if (length - offset - FRAME_SIZE < frame_size) {
+      return false;
+    }
+    offset += FRAME_SIZE + frame_size;
+    ++count;
+  }
+  return offset == length && count == records;
+}
+
+bool makeBatchHeader(const write_segments_t& segments, unsigned long records,
+                     unsigned char flags, string& _return) {
+  unsigned long length = 0;
+  uint32_t crc = 0;
+  for (write_segments_t::const_iterator iter = segments.begin();
+       iter != segments.end();
+       ++iter) {
+    length += iter->iov_len;
+    crc = crc32c(crc, iter->iov_base, iter->iov_len);
+  }
+  if (length > 0xffffffffUL || records > 0xffffffffUL) {
+    return false;
+  }
+
+  char header[BATCH_HEADER_SIZE];
+  memcpy(header, batch_magic, sizeof(batch_magic));
+  header[4] = BATCH_VERSION;
+  header[5] = flags;
+  header[6] = 0;
+  header[7] = 0;
+  putUInt(records, header + 8);
+  putUInt(length, header + 12);
+  putUInt(crc, header + 16);
+  putUInt(crc32c(0, header, 20), header + 20);
+  _return.assign(header, BATCH_HEADER_SIZE);
+  return true;
+}
+
+bool isBatchMagic(const char* data, unsigned long available) {
+  return available >= sizeof(batch_magic) &&
+         0 == memcmp(data, batch_magic, sizeof(batch_magic));
+}
+
+bool isBatchHeader(const char* data, unsigned long available,
+                   unsigned long& batch_length) {
+  if (available < BATCH_HEADER_SIZE || !isBatchMagic(data, available) ||
+      data[4] != BATCH_VERSION ||
+      getUInt(data + 20) != crc32c(0, data, 20)) {
+    return false;
+  }
+  batch_length = BATCH_HEADER_SIZE + getUInt(data + 12);
+  return true;
+}
+
+bool findBatchHeader(const char* data, unsigned long length,
+                     unsigned long offset, unsigned long& found) {
+  while (offset + BATCH_HEADER_SIZE <= length) {
+    const char* magic = (const char*)memchr(data + offset, batch_magic[0],
+                                            length - offset);
+    if (!magic) {
+      break;
+    }
+    offset = magic - data;
+    unsigned long batch_length;
+    if (isBatchHeader(magic, length - offset, batch_length)) {
+      found = offset;
+      return true;
+    }
+    ++offset;
+  }
+  return false;
+}
+
+bool readBatch(const char* data, unsigned long batch_length, string& decoded,
+               const char*& frames, unsigned long& frames_length) {
+  const char* payload = data + BATCH_HEADER_SIZE;
+  unsigned long payload_length = batch_length - BATCH_HEADER_SIZE;
+  if (getUInt(data + 16) != crc32c(0, payload, payload_length)) {
+    return false;
+  }
+
+  if (data[5] & BATCH_COMPRESSED) {
+    unsigned long block_length;
+    if (!isCompressedBlock(payload, payload_length, block_length) ||
+        block_length != payload_length ||
+        !decompressBlock(payload, block_length, decoded)) {
+      return false;
+    }
+    frames = decoded.data();
+    frames_length = decoded.length();
+  } else {
+    frames = payload;
+    frames_length = payload_length;
+  }
+  return checkFrames(frames, frames_length, getUInt(data + 8));
+}
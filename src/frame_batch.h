@@ -0,0 +1,81 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_FRAME_BATCH_H
+#define SCRIBE_FRAME_BATCH_H
+
+#include "file.h"
+
+/*
+ * Version 2 of the framed format, for buffer files with frame_version=2.
+ * Version 1 is only the frames: a 4 byte little endian length before each
+ * record. A torn write or a flipped bit in a length throws off every frame
+ * after it, and nothing says where the next good one starts.
+ *
+ * In version 2 each write is a batch, with the same frames behind a
+ * header:
+ *
+ *   [4 bytes "SCFB"][1 byte version][1 byte flags][2 bytes zero]
+ *   [4 bytes record count][4 bytes payload length]
+ *   [4 bytes CRC32C of the payload][4 bytes CRC32C of the header before it]
+ *
+ * The payload is the frames, or with BATCH_COMPRESSED one compressed block
+ * of them, and its checksum is of the bytes on disk. A batch is only read
+ * once its checksums and record count agree, so a bad batch costs its own
+ * records and nothing else. Every header is also a sync marker: a reader
+ * that hits bad data looks ahead for the next header whose checksum holds
+ * (findBatchHeader), and carries on from there.
+ *
+ * Readers tell the versions apart at every record, so a file that was
+ * started as version 1 still reads after frame_version is changed. As a
+ * version 1 frame, a header would be a 1.1GB record.
+ */
+
+#define BATCH_HEADER_SIZE 24
+#define BATCH_VERSION 2
+
+// flags
+#define BATCH_COMPRESSED 0x01
+
+// Builds the header for a batch whose payload is the segments, holding
+// records frames
+bool makeBatchHeader(const write_segments_t& segments, unsigned long records,
+                     unsigned char flags, std::string& _return);
+
+// Checks for the start of a header at data, all a reader can look for
+// before it has the rest
+bool isBatchMagic(const char* data, unsigned long available);
+
+// Checks for an intact header at data, and sets batch_length to the length
+// of the whole batch, header and all
+bool isBatchHeader(const char* data, unsigned long available,
+                   unsigned long& batch_length);
+
+// Looks for the next intact header in the length bytes at data, starting
+// at offset or after it. A header only counts if all of it is there, so a
+// reader going through a file in pieces has to look again at the last
+// BATCH_HEADER_SIZE - 1 bytes once it has more.
+bool findBatchHeader(const char* data, unsigned long length,
+                     unsigned long offset, unsigned long& found);
+
+// Checks the whole batch at data against its header, and finds its frames.
+// They're left in the batch, or decompressed into decoded.
+bool readBatch(const char* data, unsigned long batch_length,
+               std::string& decoded, const char*& frames,
+               unsigned long& frames_length);
+
+#endif // SCRIBE_FRAME_BATCH_H
@@ -0,0 +1,450 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <algorithm>
+#include <fcntl.h>
+#include <dirent.h>
+
+#include "common.h"
+#include "file.h"
+#include "ingest_wal.h"
+#include "stats.h"
+#include "thread_placement.h"
+
+using namespace std;
+using namespace boost;
+using namespace scribe::thrift;
+
+#define DEFAULT_INGEST_WAL_COMMIT_WINDOW_MS 2
+#define DEFAULT_INGEST_WAL_SEGMENT_SIZE     67108864
+#define INGEST_WAL_PREFIX                   "ingest.wal."
+#define INGEST_WAL_LENGTH_SIZE              4
+
+static StatCounter statWalCommits("ingest wal commits");
+static StatCounter statWalMessages("ingest wal messages");
+static StatCounter statWalFailed("ingest wal failed commits");
+
+static shared_ptr<LatencyHistogram> walSyncLatency =
+  LatencyHistogram::get("ingest_wal", "sync");
+
+namespace {
+
+void* commitThreadStatic(void *this_ptr) {
+  IngestWal *wal_ptr = (IngestWal*)this_ptr;
+  ThreadPlacement::placeCurrentThread(THREAD_STORE);
+  wal_ptr->threadMember();
+  return NULL;
+}
+
+void appendLength(string& buffer, unsigned length) {
+  for (int i = 0; i < INGEST_WAL_LENGTH_SIZE; ++i) {
+    buffer += (char)((length >> (8 * i)) & 0xFF);
+  }
+}
+
+unsigned readLength(const char* data) {
+  unsigned length = 0;
+  for (int i = 0; i < INGEST_WAL_LENGTH_SIZE; ++i) {
+    length |= (unsigned)(unsigned char)data[i] << (8 * i);
+  }
+  return length;
+}
+
+bool writeAll(int fd, const char* data, size_t length) {
+  while (length) {
+    ssize_t written = write(fd, data, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+} // namespace
+
+IngestWalSegment::IngestWalSegment(const string& filename_)
+  : filename(filename_),
+    kept(false) {
+}
+
+IngestWalSegment::~IngestWalSegment() {
+  if (kept) {
+    LOG_OPER("ingest wal: keeping segment <%s> for the next start, some of "
+             "its messages were dropped", filename.c_str());
+    return;
+  }
+  if (unlink(filename.c_str()) != 0 && errno != ENOENT) {
+    LOG_OPER("ingest wal: failed to delete segment <%s>: %s",
+             filename.c_str(), strerror(errno));
+  }
+}
+
+IngestWal::IngestWal(const string& wal_path)
+  : path(wal_path),
+    running(false),
+    started(false),
+    stopping(false),
+    commitWindow(DEFAULT_INGEST_WAL_COMMIT_WINDOW_MS),
+    segmentSize(DEFAULT_INGEST_WAL_SEGMENT_SIZE),
+    currentSegmentBytes(0),
+    nextSequence(1),
+    fd(-1),
+    openBytes(0) {
+  pthread_mutex_init(&lock, NULL);
+  pthread_cond_init(&workCond, NULL);
+  pthread_cond_init(&doneCond, NULL);
+}
+
+IngestWal::~IngestWal() {
+  stop();
+  pthread_mutex_destroy(&lock);
+  pthread_cond_destroy(&workCond);
+  pthread_cond_destroy(&doneCond);
+}
+
+void IngestWal::configure(StoreConf& config) {
+  config.getUnsigned("ingest_wal_commit_window_ms", commitWindow);
+  config.getUnsigned("ingest_wal_segment_size", segmentSize);
+}
+
+string IngestWal::segmentName(unsigned long sequence) {
+  ostringstream name;
+  name << path << '/' << INGEST_WAL_PREFIX << sequence;
+  return name.str();
+}
+
+void IngestWal::findSegments(vector<wal_segment_ptr_t>& leftover) {
+  vector<unsigned long> found;
+  DIR* dir = opendir(path.c_str());
+  if (dir) {
+    string prefix = INGEST_WAL_PREFIX;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      string name = entry->d_name;
+      if (name.compare(0, prefix.size(), prefix) == 0 &&
+          name.size() > prefix.size() &&
+          name.find_first_not_of("0123456789", prefix.size()) == string::npos) {
+        found.push_back(strtoul(name.c_str() + prefix.size(), NULL, 10));
+      }
+    }
+    closedir(dir);
+  }
+  sort(found.begin(), found.end());
+
+  for (vector<unsigned long>::iterator iter = found.begin();
+       iter != found.end();
+       ++iter) {
+    leftover.push_back(wal_segment_ptr_t(
+      new IngestWalSegment(segmentName(*iter))));
+    nextSequence = *iter + 1;
+  }
+}
+
+bool IngestWal::start(vector<wal_segment_ptr_t>& leftover) {
+  if (running) {
+    return true;
+  }
+
+  shared_ptr<FileInterface> dir = FileInterface::createFileInterface("std", path);
+  if (!dir || !dir->createDirectory(path)) {
+    LOG_OPER("ingest wal: failed to create directory <%s>", path.c_str());
+    return false;
+  }
+
+  if (!started) {
+    findSegments(leftover);
+    started = true;
+    if (!leftover.empty()) {
+      LOG_OPER("ingest wal: found <%lu> segments to replay in <%s>",
+               (unsigned long)leftover.size(), path.c_str());
+    }
+  }
+
+  pthread_mutex_lock(&lock);
+  currentBatch = shared_ptr<Batch>(new Batch);
+  newSegment();
+  pthread_mutex_unlock(&lock);
+
+  stopping = false;
+  if (pthread_create(&commitThread, NULL, commitThreadStatic,
+                     (void*)this) != 0) {
+    LOG_OPER("ingest wal: failed to create commit thread: %s",
+             strerror(errno));
+    return false;
+  }
+  running = true;
+  LOG_OPER("ingest wal: logging to <%s> with a <%lu> ms commit window",
+           path.c_str(), commitWindow);
+  return true;
+}
+
+// Anyone still waiting in commit() is let go before this returns
+void IngestWal::stop() {
+  if (!running) {
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_signal(&workCond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(commitThread, NULL);
+  running = false;
+
+  if (fd >= 0) {
+    close(fd);
+    fd = -1;
+  }
+  openFilename.clear();
+  currentBatch.reset();
+  currentSegment.reset();
+}
+
+bool IngestWal::commit(const vector<LogEntry>& messages,
+                       wal_segment_ptr_t& segment) {
+  // build the records before taking the lock
+  string records;
+  unsigned long count = 0;
+  for (vector<LogEntry>::const_iterator iter = messages.begin();
+       iter != messages.end();
+       ++iter) {
+    // Log() drops these anyway
+    if (iter->category.empty()) {
+      continue;
+    }
+    appendLength(records, INGEST_WAL_LENGTH_SIZE + iter->category.size() +
+                          iter->message.size());
+    appendLength(records, iter->category.size());
+    records += iter->category;
+    records += iter->message;
+    ++count;
+  }
+  if (records.empty()) {
+    return true;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (!running || stopping) {
+    pthread_mutex_unlock(&lock);
+    return false;
+  }
+
+  shared_ptr<Batch> batch = currentBatch;
+  if (batch->data.empty()) {
+    pthread_cond_signal(&workCond);
+  }
+  batch->data += records;
+  while (!batch->done) {
+    pthread_cond_wait(&doneCond, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (batch->success) {
+    statWalMessages.increment(count);
+    segment = batch->segment;
+  }
+  return batch->success;
+}
+
+// Swaps in a new batch for appends to go to, moving on to a new segment
+// if this batch fills the current one
+shared_ptr<IngestWal::Batch> IngestWal::takeBatch() {
+  shared_ptr<Batch> batch = currentBatch;
+  currentBatch = shared_ptr<Batch>(new Batch);
+
+  currentSegmentBytes += batch->data.size();
+  if (currentSegmentBytes >= segmentSize) {
+    newSegment();
+  } else {
+    currentBatch->segment = currentSegment;
+  }
+  return batch;
+}
+
+// Points the current batch at a new segment. Must hold lock.
+void IngestWal::newSegment() {
+  currentSegment = wal_segment_ptr_t(
+    new IngestWalSegment(segmentName(nextSequence++)));
+  currentSegmentBytes = 0;
+  currentBatch->segment = currentSegment;
+}
+
+bool IngestWal::openSegment(const wal_segment_ptr_t& segment) {
+  if (fd >= 0) {
+    close(fd);
+  }
+  openFilename = segment->getFilename();
+  openBytes = 0;
+  fd = open(openFilename.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0) {
+    LOG_OPER("ingest wal: failed to open segment <%s>: %s",
+             openFilename.c_str(), strerror(errno));
+    openFilename.clear();
+    return false;
+  }
+
+  // make sure the new file itself survives a crash
+  int dir_fd = open(path.c_str(), O_RDONLY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+  return true;
+}
+
+bool IngestWal::writeBatch(Batch& batch) {
+  if (openFilename != batch.segment->getFilename() &&
+      !openSegment(batch.segment)) {
+    return false;
+  }
+
+  uint64_t start = monotonicMicros();
+  if (!writeAll(fd, batch.data.data(), batch.data.size()) ||
+      fdatasync(fd) != 0) {
+    LOG_OPER("ingest wal: failed to write <%lu> bytes to <%s>: %s",
+             (unsigned long)batch.data.size(), openFilename.c_str(),
+             strerror(errno));
+    // Cut off whatever part of the batch got written, so the records
+    // committed before it can still be read back. Later batches go to a
+    // new segment, since after a failed write or sync we can't be sure
+    // what this one holds.
+    if (ftruncate(fd, openBytes) != 0) {
+      LOG_OPER("ingest wal: failed to truncate <%s> to <%lu> bytes: %s",
+               openFilename.c_str(), openBytes, strerror(errno));
+    }
+    close(fd);
+    fd = -1;
+    openFilename.clear();
+    return false;
+  }
+  openBytes += batch.data.size();
+  walSyncLatency->recordSince(start);
+  return true;
+}
+
+void IngestWal::threadMember() {
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (currentBatch->data.empty() && !stopping) {
+      pthread_cond_wait(&workCond, &lock);
+    }
+    if (currentBatch->data.empty()) {
+      break;
+    }
+
+    // give concurrent Log() calls a chance to join this commit
+    if (commitWindow && !stopping) {
+      pthread_mutex_unlock(&lock);
+      usleep(commitWindow * 1000);
+      pthread_mutex_lock(&lock);
+    }
+
+    shared_ptr<Batch> batch = takeBatch();
+    pthread_mutex_unlock(&lock);
+
+    bool success = writeBatch(*batch);
+    if (success) {
+      statWalCommits.increment();
+    } else {
+      statWalFailed.increment();
+    }
+
+    pthread_mutex_lock(&lock);
+    if (!success && currentSegment == batch->segment) {
+      newSegment();
+    }
+    batch->done = true;
+    batch->success = success;
+    pthread_cond_broadcast(&doneCond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+bool IngestWal::readSegment(const wal_segment_ptr_t& segment,
+                            vector<LogEntry>& messages) {
+  const string& filename = segment->getFilename();
+  int read_fd = open(filename.c_str(), O_RDONLY);
+  if (read_fd < 0) {
+    LOG_OPER("ingest wal: failed to open segment <%s> for reading: %s",
+             filename.c_str(), strerror(errno));
+    return false;
+  }
+
+  string data;
+  char buffer[65536];
+  ssize_t bytes;
+  while ((bytes = read(read_fd, buffer, sizeof(buffer))) != 0) {
+    if (bytes < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_OPER("ingest wal: failed to read segment <%s>: %s",
+               filename.c_str(), strerror(errno));
+      close(read_fd);
+      return false;
+    }
+    data.append(buffer, bytes);
+  }
+  close(read_fd);
+
+  // A crash can leave a partial record at the end. It was never
+  // acknowledged, so it's skipped.
+  size_t pos = 0;
+  while (data.size() - pos >= 2 * INGEST_WAL_LENGTH_SIZE) {
+    unsigned record_length = readLength(data.data() + pos);
+    unsigned category_length =
+      readLength(data.data() + pos + INGEST_WAL_LENGTH_SIZE);
+    // Compared without adding to a length read from the file, which could
+    // wrap around
+    if (record_length < INGEST_WAL_LENGTH_SIZE ||
+        category_length > record_length - INGEST_WAL_LENGTH_SIZE ||
+        record_length > data.size() - pos - INGEST_WAL_LENGTH_SIZE) {
+      break;
+    }
+
+    pos += 2 * INGEST_WAL_LENGTH_SIZE;
+    LogEntry entry;
+    entry.category = data.substr(pos, category_length);
+    entry.message = data.substr(pos + category_length,
+                                record_length - INGEST_WAL_LENGTH_SIZE -
+                                category_length);
+    messages.push_back(entry);
+    pos += record_length - INGEST_WAL_LENGTH_SIZE;
+  }
+
+  if (pos != data.size()) {
+    LOG_OPER("ingest wal: ignoring <%lu> bytes at the end of <%s>",
+             (unsigned long)(data.size() - pos), filename.c_str());
+  }
+  return true;
+}
+
+void IngestWal::keepSegments(const logentry_vector_t& messages) {
+  for (logentry_vector_t::const_iterator iter = messages.begin();
+       iter != messages.end();
+       ++iter) {
+    WalEntryDeleter* deleter = boost::get_deleter<WalEntryDeleter>(*iter);
+    if (deleter) {
+      deleter->segment->keep();
+    }
+  }
+}
@@ -0,0 +1,162 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_INGEST_WAL_H
+#define SCRIBE_INGEST_WAL_H
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "conf.h"
+
+/*
+ * One file of the ingest WAL. The file is deleted when the last reference
+ * goes away, which is once the WAL has moved on to a newer segment and every
+ * message read from or written to this one has left scribed. A segment some
+ * of whose messages were dropped instead of stored is kept, and replayed in
+ * full at the next start.
+ */
+class IngestWalSegment {
+ public:
+  IngestWalSegment(const std::string& filename);
+  virtual ~IngestWalSegment();
+
+  const std::string& getFilename() { return filename; }
+  void keep() { kept = true; }
+
+ private:
+  std::string filename;
+  bool kept;
+
+  // disallow copy, assignment, and empty construction
+  IngestWalSegment();
+  IngestWalSegment(const IngestWalSegment& rhs);
+  IngestWalSegment& operator=(const IngestWalSegment& rhs);
+};
+
+typedef boost::shared_ptr<IngestWalSegment> wal_segment_ptr_t;
+
+// Deleter for the LogEntries handed to StoreQueues, so each one keeps the
+// segment it was committed to alive until the store is done with it
+struct WalEntryDeleter {
+  WalEntryDeleter(const wal_segment_ptr_t& segment_) : segment(segment_) {}
+  void operator()(scribe::thrift::LogEntry* entry) { delete entry; }
+
+  wal_segment_ptr_t segment;
+};
+
+/*
+ * Optional write-ahead log for messages accepted by Log(). Every accepted
+ * message is written to a segment file on local disk and fdatasync'd before
+ * Log() returns OK, so a crash can't lose a message a client was told had
+ * been accepted. Segments still on disk at startup are replayed into the
+ * stores.
+ *
+ * Commits are grouped: one thread writes and syncs everything appended
+ * during the last commit window, so concurrent Log() calls share an
+ * fdatasync instead of each paying for their own.
+ *
+ * A segment is deleted once every message in it has been handled by its
+ * StoreQueues. If a StoreQueue drops any of them instead, the segment stays
+ * on disk and is replayed at the next start, so messages from it that were
+ * stored can be delivered twice.
+ *
+ * Global config:
+ *   ingest_wal_path=/var/spool/scribe/wal
+ *   ingest_wal_commit_window_ms=2
+ *   ingest_wal_segment_size=67108864
+ */
+class IngestWal {
+ public:
+  IngestWal(const std::string& path);
+  virtual ~IngestWal();
+
+  void configure(StoreConf& config);
+
+  // Opens the WAL directory and starts the commit thread. The first time
+  // through, returns the segments left over from the last run in leftover.
+  bool start(std::vector<wal_segment_ptr_t>& leftover);
+  void stop();
+  const std::string& getPath() { return path; }
+
+  // Writes messages to the WAL and waits until they are on disk. On success
+  // segment is the segment they were written to.
+  bool commit(const std::vector<scribe::thrift::LogEntry>& messages,
+              wal_segment_ptr_t& segment);
+
+  // Reads every message in a segment from a previous run
+  static bool readSegment(const wal_segment_ptr_t& segment,
+                          std::vector<scribe::thrift::LogEntry>& messages);
+
+  // Keeps the segments of messages that are dropped instead of stored
+  static void keepSegments(const logentry_vector_t& messages);
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void threadMember();
+
+ private:
+  // Messages appended during one commit window
+  struct Batch {
+    Batch() : done(false), success(false) {}
+
+    std::string data;
+    wal_segment_ptr_t segment;
+    bool done;
+    bool success;
+  };
+
+  std::string segmentName(unsigned long sequence);
+  void findSegments(std::vector<wal_segment_ptr_t>& leftover);
+  boost::shared_ptr<Batch> takeBatch();
+  void newSegment();
+  bool writeBatch(Batch& batch);
+  bool openSegment(const wal_segment_ptr_t& segment);
+
+  std::string path;
+  pthread_t commitThread;
+  bool running;
+  bool started;   // true once leftover segments have been handed out
+  volatile bool stopping;
+
+  // configuration
+  unsigned long commitWindow; // in milliseconds
+  unsigned long segmentSize;
+
+  // Must be held to read/modify everything below, apart from the open file
+  // which only the commit thread uses
+  pthread_mutex_t lock;
+  pthread_cond_t workCond;    // signalled when a batch gets its first data
+  pthread_cond_t doneCond;    // broadcast when a batch is done
+  boost::shared_ptr<Batch> currentBatch;
+  wal_segment_ptr_t currentSegment;
+  unsigned long currentSegmentBytes;
+  unsigned long nextSequence;
+
+  // the segment the commit thread has open
+  int fd;
+  std::string openFilename;
+  unsigned long openBytes;    // synced to the open segment so far
+
+  // disallow copy, assignment, and empty construction
+  IngestWal();
+  IngestWal(const IngestWal& rhs);
+  IngestWal& operator=(const IngestWal& rhs);
+};
+
+#endif // SCRIBE_INGEST_WAL_H
@@ -0,0 +1,335 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "compression.h"
+#include "frame_batch.h"
+#include "mapped_file.h"
+
+// size of a frame header, as written by FileInterface::getFrame
+#define FRAME_SIZE 4
+
+using namespace std;
+
+MappedFile::MappedFile(const std::string& name, bool frame)
+  : filename(name),
+    framed(frame),
+    fd(-1),
+    mapped(NULL),
+    mappedSize(0),
+    released(0),
+    blockData(NULL),
+    blockSize(0),
+    blockMapped(false),
+    blockChecked(false),
+    blockOffset(0),
+    blockLength(0),
+    blockSkip(0),
+    blockPos(0) {
+}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+bool MappedFile::open() {
+  close();
+  fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    LOG_OPER("Failed to open <%s> for reading: %s",
+             filename.c_str(), strerror(errno));
+    return false;
+  }
+  remap();
+  return true;
+}
+
+void MappedFile::close() {
+  if (mapped) {
+    munmap(mapped, mappedSize);
+    mapped = NULL;
+  }
+  if (fd >= 0) {
+    ::close(fd);
+    fd = -1;
+  }
+  mappedSize = 0;
+  released = 0;
+  decoded.clear();
+  blockLength = 0;
+}
+
+bool MappedFile::remap() {
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0 ||
+      (unsigned long)st.st_size <= mappedSize) {
+    return false;
+  }
+
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    LOG_OPER("Failed to map <%lu> bytes of <%s>: %s",
+             (unsigned long)st.st_size, filename.c_str(), strerror(errno));
+    return false;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  if (mapped) {
+    munmap(mapped, mappedSize);
+  }
+  mapped = (char*)map;
+  mappedSize = st.st_size;
+  // a batch's records were in the old mapping
+  if (blockMapped) {
+    blockLength = 0;
+  }
+  return true;
+}
+
+bool MappedFile::record(const file_position_t& position, const char*& data,
+                        unsigned long& length, file_position_t& next) {
+  file_position_t current = position;
+  while (current.offset < mappedSize) {
+    if (current.skip == 0 && !isBlock(current.offset)) {
+      unsigned long end;
+      if (splitRecord(mapped, mappedSize, current.offset, data, length, end,
+                      false)) {
+        next = file_position_t(end, 0);
+        return true;
+      }
+
+      // A frame that's cut short is still being written, unless there's a
+      // batch after it to pick up from
+      unsigned long found = framed ? findBlock(current.offset + 1,
+                                               current.offset + 1)
+                                   : mappedSize;
+      if (found >= mappedSize) {
+        return false;
+      }
+      LOG_OPER("Skipping <%lu> unreadable bytes at offset <%lu> of <%s>",
+               found - current.offset, current.offset, filename.c_str());
+      current = file_position_t(found, 0);
+      continue;
+    }
+
+    if (!blockLength || blockOffset != current.offset) {
+      if (!loadBlock(current.offset)) {
+        // A block that's cut short is either still being written, or was
+        // torn by a crash and followed by blocks written after a restart.
+        // A bad batch's compressed block is no good either.
+        unsigned long blocks_from = current.offset + 1;
+        unsigned long batch_length;
+        if (framed && isBatchHeader(mapped + current.offset,
+                                    mappedSize - current.offset,
+                                    batch_length)) {
+          blocks_from = current.offset + batch_length;
+        }
+        unsigned long found = findBlock(current.offset + 1, blocks_from);
+        if (found >= mappedSize) {
+          return false;
+        }
+        LOG_OPER("Skipping <%lu> unreadable bytes at offset <%lu> of <%s>",
+                 found - current.offset, current.offset, filename.c_str());
+        current = file_position_t(found, 0);
+        continue;
+      }
+    }
+
+    if (blockSkip != current.skip) {
+      blockSkip = 0;
+      blockPos = 0;
+      unsigned long end;
+      while (blockSkip < current.skip &&
+             splitRecord(blockData, blockSize, blockPos, data, length, end,
+                         blockChecked)) {
+        blockPos = end;
+        ++blockSkip;
+      }
+    }
+
+    unsigned long end;
+    if (blockSkip == current.skip &&
+        splitRecord(blockData, blockSize, blockPos, data, length, end,
+                    blockChecked)) {
+      blockPos = end;
+      ++blockSkip;
+      if (end < blockSize) {
+        next = file_position_t(current.offset, blockSkip);
+      } else {
+        next = file_position_t(current.offset + blockLength, 0);
+      }
+      return true;
+    }
+
+    // nothing left in this block
+    current = file_position_t(current.offset + blockLength, 0);
+  }
+  return false;
+}
+
+// checked is for the frames of a batch, which are known to be whole
+bool MappedFile::splitRecord(const char* buffer, unsigned long size,
+                             unsigned long offset, const char*& data,
+                             unsigned long& length, unsigned long& next,
+                             bool checked) {
+  if (offset >= size) {
+    return false;
+  }
+
+  if (framed) {
+    if (size - offset < FRAME_SIZE) {
+      return false;
+    }
+    const unsigned char* frame = (const unsigned char*)buffer + offset;
+    unsigned long frame_size = 0;
+    for (int i = 0; i < FRAME_SIZE; ++i) {
+      frame_size |= (unsigned long)frame[i] << (8 * i);
+    }
+    // Outside a batch, a zero frame is padding or the end of what was
+    // written. In one, it's an empty record.
+    if ((!frame_size && !checked) || size - offset - FRAME_SIZE < frame_size) {
+      return false;
+    }
+    data = buffer + offset + FRAME_SIZE;
+    length = frame_size;
+    next = offset + FRAME_SIZE + frame_size;
+    return true;
+  }
+
+  // like readNext, an unterminated last line isn't a record yet
+  const char* newline = (const char*)memchr(buffer + offset, '\n',
+                                            size - offset);
+  if (!newline) {
+    return false;
+  }
+  data = buffer + offset;
+  length = newline - data;
+  next = newline + 1 - buffer;
+  return true;
+}
+
+// Whether a block or a batch starts at offset. A batch only counts once
+// its header is all there, until then it looks like a frame that's cut
+// short.
+bool MappedFile::isBlock(unsigned long offset) {
+  unsigned long block_length;
+  return isCompressedBlock(mapped + offset, mappedSize - offset,
+                           block_length) ||
+         (framed && isBatchHeader(mapped + offset, mappedSize - offset,
+                                  block_length));
+}
+
+// Checks or decompresses the block or batch at offset if it's all there
+// and intact
+bool MappedFile::loadBlock(unsigned long offset) {
+  const char* block = mapped + offset;
+  unsigned long available = mappedSize - offset;
+  unsigned long block_length;
+  bool batch = framed && isBatchHeader(block, available, block_length);
+  if ((!batch && !isCompressedBlock(block, available, block_length)) ||
+      block_length > available) {
+    return false;
+  }
+
+  blockLength = 0;
+  if (batch) {
+    if (!readBatch(block, block_length, decoded, blockData, blockSize)) {
+      LOG_OPER("Bad checksum or records in batch at offset <%lu> of <%s>",
+               offset, filename.c_str());
+      return false;
+    }
+    blockMapped = blockData != decoded.data();
+  } else {
+    if (!decompressBlock(block, block_length, decoded)) {
+      LOG_OPER("Failed to decompress block at offset <%lu> of <%s>",
+               offset, filename.c_str());
+      return false;
+    }
+    blockData = decoded.data();
+    blockSize = decoded.size();
+    blockMapped = false;
+  }
+  blockChecked = batch;
+  blockOffset = offset;
+  blockLength = block_length;
+  blockSkip = 0;
+  blockPos = 0;
+  return true;
+}
+
+// The next block or batch from offset on that can be read, or the end of
+// the file. A header could turn up inside other data, so it has to be
+// checked too. Compressed blocks before blocks_from aren't taken, nor are
+// those inside a bad batch.
+unsigned long MappedFile::findBlock(unsigned long offset,
+                                    unsigned long blocks_from) {
+  unsigned long batch = 0;
+  bool searched = false;
+  while (offset < mappedSize) {
+    // batches are found the same way the other readers find them
+    if ((!searched || batch < offset) &&
+        !(framed && findBatchHeader(mapped, mappedSize, offset, batch))) {
+      batch = mappedSize;
+    }
+    searched = true;
+
+    // a compressed block could come first
+    unsigned long next = batch;
+    for (unsigned long pos = max(offset, blocks_from); pos < batch; ++pos) {
+      const char* found = (const char*)memchr(mapped + pos, 'S', batch - pos);
+      if (!found) {
+        break;
+      }
+      pos = found - mapped;
+      unsigned long block_length;
+      if (isCompressedBlock(found, mappedSize - pos, block_length)) {
+        next = pos;
+        break;
+      }
+    }
+
+    if (next >= mappedSize) {
+      break;
+    }
+    if (loadBlock(next)) {
+      return next;
+    }
+
+    unsigned long batch_length;
+    if (next == batch &&
+        isBatchHeader(mapped + next, mappedSize - next, batch_length)) {
+      blocks_from = max(blocks_from, next + batch_length);
+    }
+    offset = next + 1;
+  }
+  return mappedSize;
+}
+
+void MappedFile::release(unsigned long offset) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  offset -= offset % page_size;
+  if (fd < 0 || offset <= released) {
+    return;
+  }
+  madvise(mapped + released, offset - released, MADV_DONTNEED);
+  posix_fadvise(fd, released, offset - released, POSIX_FADV_DONTNEED);
+  released = offset;
+}
@@ -0,0 +1,104 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_MAPPED_FILE_H
+#define SCRIBE_MAPPED_FILE_H
+
+#include <string>
+
+// Where a record starts: a file offset, and for a compressed block or a
+// batch the number of records into the one that starts there
+struct file_position_t {
+  file_position_t() : offset(0), skip(0) {}
+  file_position_t(unsigned long offset_, unsigned long skip_)
+    : offset(offset_), skip(skip_) {}
+
+  unsigned long offset;
+  unsigned long skip;
+};
+
+/*
+ * Read-only mapping of a local file for replaying buffer files. Records are
+ * found in place, the same way readNext() would split them, so the caller
+ * only copies the ones it's about to use, and pages it's finished with can
+ * be dropped from memory as it goes.
+ *
+ * Compressed blocks (see compression.h) and, in framed files, checksummed
+ * batches (see frame_batch.h) are recognized wherever a record could start.
+ * Each is checked or decompressed once, when its first record is read.
+ */
+class MappedFile {
+ public:
+  MappedFile(const std::string& name, bool framed);
+  ~MappedFile();
+
+  bool open();
+  void close();
+  unsigned long size() { return mappedSize; }
+
+  // Finds the record at position: a frame's data if framed, otherwise a
+  // line without its newline. next is set to where the following record
+  // starts. Returns false if there isn't a whole record there. Unreadable
+  // blocks and batches are skipped, and so is anything unreadable in front
+  // of one, so the record can start after position.
+  bool record(const file_position_t& position, const char*& data,
+              unsigned long& length, file_position_t& next);
+
+  // the mapped bytes from offset to the end
+  const char* at(unsigned long offset) { return mapped + offset; }
+
+  // Maps anything appended since the last map. Returns true if it grew.
+  bool remap();
+
+  // Drops the pages before offset from the page cache
+  void release(unsigned long offset);
+
+ private:
+  std::string filename;
+  bool splitRecord(const char* buffer, unsigned long size,
+                   unsigned long offset, const char*& data,
+                   unsigned long& length, unsigned long& next,
+                   bool checked);
+  bool isBlock(unsigned long offset);
+  bool loadBlock(unsigned long offset);
+  unsigned long findBlock(unsigned long offset, unsigned long blocks_from);
+
+  bool framed;
+  int fd;
+  char* mapped;
+  unsigned long mappedSize;
+  unsigned long released;
+
+  // the last block or batch read, and where its next record is. Its
+  // records are in decoded if it was compressed, otherwise in the mapping.
+  std::string decoded;
+  const char* blockData;
+  unsigned long blockSize;
+  bool blockMapped;
+  bool blockChecked;             // a batch, where every frame is a record
+  unsigned long blockOffset;
+  unsigned long blockLength;     // of the block in the file
+  unsigned long blockSkip;
+  unsigned long blockPos;
+
+  // disallow copy, assignment, and empty construction
+  MappedFile();
+  MappedFile(MappedFile& rhs);
+  MappedFile& operator=(MappedFile& rhs);
+};
+
+#endif // SCRIBE_MAPPED_FILE_H
@@ -23,6 +23,7 @@
 
 #include "common.h"
 #include "scribe_server.h"
+#include "thread_placement.h"
 
 using namespace apache::thrift;
 using namespace apache::thrift::protocol;
@@ -43,6 +44,39 @@ shared_ptr<scribeHandler> g_Handler;
 #define DEFAULT_MAX_QUEUE_SIZE     5000000
 #define DEFAULT_SERVER_THREADS     3
 
+// With max_total_queue_size, the percentage of it that requests of each
+// priority may fill, so low priority traffic is turned away first
+#define LOW_PRIORITY_QUEUE_PERCENT    50
+#define NORMAL_PRIORITY_QUEUE_PERCENT 80
+#define HIGH_PRIORITY_QUEUE_PERCENT   100
+
+static StatCounter statDeniedForRate("denied for rate");
+static StatCounter statInvalidRequests("invalid requests");
+static StatCounter statDeniedForQueueSize("denied for queue size");
+static StatCounter statReceivedGood("received good");
+static StatCounter statReceivedBad("received bad");
+static StatCounter statReceivedBlankCategory("received blank category");
+
+static StatCounter statWalReplayed("ingest wal replayed");
+
+static StatCounter statLowAccepted("priority low accepted");
+static StatCounter statNormalAccepted("priority normal accepted");
+static StatCounter statHighAccepted("priority high accepted");
+static StatCounter statLowRejected("priority low rejected");
+static StatCounter statNormalRejected("priority normal rejected");
+static StatCounter statHighRejected("priority high rejected");
+
+static StatCounter* statAccepted[NUM_PRIORITIES] =
+  { &statLowAccepted, &statNormalAccepted, &statHighAccepted };
+static StatCounter* statRejected[NUM_PRIORITIES] =
+  { &statLowRejected, &statNormalRejected, &statHighRejected };
+static const unsigned long queuePercent[NUM_PRIORITIES] =
+  { LOW_PRIORITY_QUEUE_PERCENT, NORMAL_PRIORITY_QUEUE_PERCENT,
+    HIGH_PRIORITY_QUEUE_PERCENT };
+
+static boost::shared_ptr<LatencyHistogram> logLatency =
+  LatencyHistogram::get("scribe_overall", "log");
+
 void print_usage(const char* program_name) {
   cout << "Usage: " << program_name << " [-p port] [-c config_file]" << endl;
 }
@@ -112,6 +146,13 @@ int main(int argc, char **argv) {
     TNonblockingServer server(processor, binaryProtocolFactory,
                               g_Handler->port, thread_manager);
 
+    // this thread runs the event loop
+    ThreadPlacement::placeCurrentThread(THREAD_IO);
+    string placement = ThreadPlacement::getReport();
+    if (!placement.empty()) {
+      LOG_OPER("thread placement at startup: %s", placement.c_str());
+    }
+
     LOG_OPER("Starting scribe server on port %lu", g_Handler->port);
     fflush(stderr);
 
@@ -138,6 +179,7 @@ scribeHandler::scribeHandler(unsigned long int server_port, const std::string& c
     numMsgLastSecond(0),
     maxMsgPerSecond(DEFAULT_MAX_MSG_PER_SECOND),
     maxQueueSize(DEFAULT_MAX_QUEUE_SIZE),
+    maxTotalQueueSize(0),
     newThreadPerCategory(true) {
   time(&lastMsgTime);
 }
@@ -183,29 +225,33 @@ void scribeHandler::setStatus(fb_status new_status) {
 }
 
 // Returns the handler status details if non-empty,
-// otherwise the first non-empty store status found
+// otherwise the first non-empty store status found,
+// followed by a summary of pipeline latencies
 void scribeHandler::getStatusDetails(std::string& _return) {
   RWGuard monitor(scribeHandlerLock);
   Guard status_monitor(statusLock);
 
   _return = statusDetails;
-  if (_return.empty()) {
-    if (pcategories) {
-      for (category_map_t::iterator cat_iter = pcategories->begin();
-          cat_iter != pcategories->end();
-          ++cat_iter) {
-        for (store_list_t::iterator store_iter = cat_iter->second->begin();
-            store_iter != cat_iter->second->end();
-            ++store_iter) {
+  if (_return.empty() && pcategories) {
+    for (category_map_t::iterator cat_iter = pcategories->begin();
+        cat_iter != pcategories->end() && _return.empty();
+        ++cat_iter) {
+      for (store_list_t::iterator store_iter = cat_iter->second->begin();
+          store_iter != cat_iter->second->end();
+          ++store_iter) {
 
-          if (!(_return = (*store_iter)->getStatus()).empty()) {
-            return;
-          }
-        } // for each store
-      } // for each category
-    }
+        if (!(_return = (*store_iter)->getStatus()).empty()) {
+          break;
+        }
+      } // for each store
+    } // for each category
   } // if we don't have an interesting top level status
-  return;
+
+  // Latency summary goes after whatever the status is
+  string latency = LatencyHistogram::getSummary("scribe_overall");
+  if (!latency.empty()) {
+    _return += _return.empty() ? latency : "; " + latency;
+  }
 }
 
 void scribeHandler::setStatusDetails(const string& new_status_details) {
@@ -214,6 +260,43 @@ void scribeHandler::setStatusDetails(const string& new_status_details) {
   statusDetails = new_status_details;
 }
 
+void scribeHandler::getCounters(map<string, int64_t>& _return) {
+  FacebookBase::getCounters(_return);
+  StatCounter::getCounters(_return);
+  LatencyHistogram::getCounters(_return);
+
+  int64_t queued[NUM_PRIORITIES] = { 0 };
+  int64_t queued_bytes[NUM_PRIORITIES] = { 0 };
+  {
+    RWGuard monitor(scribeHandlerLock);
+    if (pcategories) {
+      for (category_map_t::iterator cat_iter = pcategories->begin();
+           cat_iter != pcategories->end();
+           ++cat_iter) {
+        for (store_list_t::iterator store_iter = cat_iter->second->begin();
+             store_iter != cat_iter->second->end();
+             ++store_iter) {
+          store_priority_t priority = (*store_iter)->getPriority();
+          queued[priority] += (*store_iter)->getTotalCount();
+          queued_bytes[priority] += (*store_iter)->getTotalSize();
+        }
+      }
+    }
+  }
+  for (int i = 0; i < NUM_PRIORITIES; ++i) {
+    string prefix = string("priority ") + priorityName((store_priority_t)i);
+    _return[prefix + " queued"] = queued[i];
+    _return[prefix + " queued bytes"] = queued_bytes[i];
+  }
+}
+
+int64_t scribeHandler::getCounter(const string& key) {
+  map<string, int64_t> counters;
+  getCounters(counters);
+  map<string, int64_t>::iterator iter = counters.find(key);
+  return iter == counters.end() ? 0 : iter->second;
+}
+
 const char* scribeHandler::statusAsString(fb_status status) {
   switch (status) {
   case DEAD:
@@ -283,17 +366,56 @@ bool scribeHandler::createCategoryFromModel(
 
 
 // Check if we need to deny this request due to throttling
-bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
-  // Check if we need to rate limit
-  if (throttleDeny(messages.size())) {
-    incrementCounter("denied for rate");
-    return true;
+// The highest priority of any store a category is, or would be, logged to.
+// Should be called while holding a readLock on scribeHandlerLock.
+store_priority_t scribeHandler::categoryPriority(const string& category) {
+  category_map_t::iterator cat_iter = pcategories->find(category);
+  if (cat_iter != pcategories->end()) {
+    store_priority_t priority = PRIORITY_LOW;
+    for (store_list_t::iterator store_iter = cat_iter->second->begin();
+         store_iter != cat_iter->second->end();
+         ++store_iter) {
+      priority = max(priority, (*store_iter)->getPriority());
+    }
+    return priority;
   }
 
+  // not created yet, so use the model createNewCategory would use
+  for (category_prefix_map_t::iterator cat_prefix_iter =
+         pcategory_prefixes->begin();
+       cat_prefix_iter != pcategory_prefixes->end();
+       ++cat_prefix_iter) {
+    string::size_type len = cat_prefix_iter->first.size();
+    if (cat_prefix_iter->first.compare(0, len-1, category, 0, len-1) == 0) {
+      return cat_prefix_iter->second->getPriority();
+    }
+  }
+  if (defaultStore != NULL) {
+    return defaultStore->getPriority();
+  }
+  return PRIORITY_NORMAL;
+}
+
+bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
   if (!pcategories || !pcategory_prefixes) {
     // don't bother to spam anything for this, our status should already
     // be showing up as WARNING in the monitoring tools.
-    incrementCounter("invalid requests");
+    statInvalidRequests.increment();
+    return true;
+  }
+
+  // A request is as important as the most important category in it
+  store_priority_t priority = PRIORITY_LOW;
+  for (vector<LogEntry>::const_iterator msg_iter = messages.begin();
+       msg_iter != messages.end() && priority != PRIORITY_HIGH;
+       ++msg_iter) {
+    priority = max(priority, categoryPriority(msg_iter->category));
+  }
+
+  // Check if we need to rate limit
+  if (throttleDeny(messages.size())) {
+    statDeniedForRate.increment();
+    statRejected[priority]->increment(messages.size());
     return true;
   }
 
@@ -305,7 +427,11 @@ bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
   // Also note that we always check all categories, not just the ones in this request.
   // This is a simplification based on the assumption that most Log() calls contain most
   // categories.
+  // A store over max_queue_size only holds back requests that aren't more
+  // important than it is, so a backed up low priority store can't block
+  // high priority traffic.
   unsigned long max_count = 0;
+  unsigned long total_count = 0;
   for (category_map_t::iterator cat_iter = pcategories->begin();
        cat_iter != pcategories->end();
        ++cat_iter) {
@@ -320,15 +446,19 @@ bool scribeHandler::throttleRequest(const vector<LogEntry>&  messages) {
         throw std::logic_error("throttle check: iterator in store map holds null pointer");
       } else {
         unsigned long size = (*store_iter)->getSize();
-        if (size > max_count) {
+        total_count += (*store_iter)->getTotalSize();
+        if (size > max_count && (*store_iter)->getPriority() >= priority) {
           max_count = size;
         }
       }
     }
   }
 
-  if (max_count > maxQueueSize) {
-    incrementCounter("denied for queue size");
+  if (max_count > maxQueueSize ||
+      (maxTotalQueueSize &&
+       total_count > maxTotalQueueSize / 100 * queuePercent[priority])) {
+    statDeniedForQueueSize.increment();
+    statRejected[priority]->increment(messages.size());
     return true;
   }
 
@@ -382,35 +512,50 @@ shared_ptr<store_list_t> scribeHandler::createNewCategory(
   return store_list;
 }
 
-// Add this message to every store in list
+// Add this message to every store in list. With an ingest WAL, every copy
+// keeps wal_segment from being deleted until its store is done with it.
 void scribeHandler::addMessage(
   const LogEntry& entry,
-  const shared_ptr<store_list_t>& store_list) {
+  const shared_ptr<store_list_t>& store_list,
+  const wal_segment_ptr_t& wal_segment) {
 
   int numstores = 0;
+  store_priority_t priority = PRIORITY_LOW;
 
   // Add message to store_list
   for (store_list_t::iterator store_iter = store_list->begin();
        store_iter != store_list->end();
        ++store_iter) {
     ++numstores;
-    boost::shared_ptr<LogEntry> ptr(new LogEntry);
+    boost::shared_ptr<LogEntry> ptr;
+    if (wal_segment) {
+      ptr.reset(new LogEntry, WalEntryDeleter(wal_segment));
+    } else {
+      ptr.reset(new LogEntry);
+    }
     ptr->category = entry.category;
     ptr->message = entry.message;
 
     (*store_iter)->addMessage(ptr);
+    priority = max(priority, (*store_iter)->getPriority());
   }
 
   if (numstores) {
-    incrementCounter("received good");
+    statReceivedGood.increment();
+    statAccepted[priority]->increment();
   } else {
-    incrementCounter("received bad");
+    statReceivedBad.increment();
   }
 }
 
 
 ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
   ResultCode result;
+  uint64_t start = monotonicMicros();
+  wal_segment_ptr_t wal_segment;
+
+  // Thrift worker threads place themselves on their first call
+  ThreadPlacement::placeCurrentThreadOnce(THREAD_PROCESSOR);
 
   scribeHandlerLock.acquireRead();
 
@@ -419,13 +564,19 @@ ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
     goto end;
   }
 
+  // Only acknowledge messages once they're on disk
+  if (ingestWal && !ingestWal->commit(messages, wal_segment)) {
+    result = TRY_LATER;
+    goto end;
+  }
+
   for (vector<LogEntry>::const_iterator msg_iter = messages.begin();
        msg_iter != messages.end();
        ++msg_iter) {
 
     // disallow blank category from the start
     if ((*msg_iter).category.empty()) {
-      incrementCounter("received blank category");
+      statReceivedBlankCategory.increment();
       continue;
     }
 
@@ -455,12 +606,12 @@ ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
     if (store_list == NULL) {
        LOG_OPER("log entry has invalid category <%s>",
                 (*msg_iter).category.c_str());
-      incrementCounter("received bad");
+      statReceivedBad.increment();
       continue;
     }
 
     // Log this message
-    addMessage(*msg_iter, store_list);
+    addMessage(*msg_iter, store_list, wal_segment);
     
     // Check for events
    // lookForTriggers(*msg_iter, store_list);
@@ -471,6 +622,7 @@ ResultCode scribeHandler::Log(const vector<LogEntry>&  messages) {
 
  end:
   scribeHandlerLock.release();
+  logLatency->recordSince(start);
   return result;
 }
 
@@ -565,8 +717,15 @@ void scribeHandler::initialize() {
     // load the global config
     config.getUnsigned("max_msg_per_second", maxMsgPerSecond);
     config.getUnsigned("max_queue_size", maxQueueSize);
+    config.getUnsigned("max_total_queue_size", maxTotalQueueSize);
     config.getUnsigned("check_interval", checkPeriod);
 
+    unsigned long latency_window = DEFAULT_LATENCY_WINDOW_SEC;
+    unsigned long latency_categories = DEFAULT_MAX_LATENCY_CATEGORIES;
+    config.getUnsigned("latency_window_sec", latency_window);
+    config.getUnsigned("max_latency_categories", latency_categories);
+    LatencyHistogram::configure(latency_window, latency_categories);
+
     // If new_thread_per_category, then we will create a new thread/StoreQueue
     // for every unique message category seen.  Otherwise, we will just create
     // one thread for each top-level store defined in the config file.
@@ -587,6 +746,12 @@ void scribeHandler::initialize() {
       throw runtime_error("No port number configured");
     }
 
+    ThreadPlacement::configure(config);
+    configureSyslog(config);
+    configureShmIngest(config);
+    configureIngestWal(config);
+    configureStoreScheduler(config);
+
     // check if config sets the size to use for the ThreadManager
     unsigned long int num_threads;
     if (config.getUnsigned("num_thrift_server_threads", num_threads)) {
@@ -657,6 +822,30 @@ void scribeHandler::initialize() {
   pnew_category_prefixes = NULL;
   tmpDefault.reset();
 
+  // The WAL has to be running before anything can be logged, and it needs
+  // stores to replay into
+  if (ingestWal && enough_config_to_run) {
+    vector<wal_segment_ptr_t> leftover;
+    if (ingestWal->start(leftover)) {
+      replayIngestWal(leftover);
+    } else {
+      setStatusDetails("Failed to start ingest WAL");
+      perfect_config = false;
+    }
+  }
+
+  if (syslogServer && !syslogServer->start()) {
+    setStatusDetails("Failed to start syslog listener");
+    syslogServer.reset();
+    perfect_config = false;
+  }
+
+  if (shmIngest && !shmIngest->start()) {
+    setStatusDetails("Failed to open shared memory ring");
+    shmIngest.reset();
+    perfect_config = false;
+  }
+
   if (!perfect_config || !enough_config_to_run) { // perfect should be a subset of enough, but just in case
     setStatus(WARNING); // status details should have been set above
   } else {
@@ -666,6 +855,140 @@ void scribeHandler::initialize() {
 }
 
 
+// Sets up the syslog listener if syslog_port is set. It is started at the
+// end of initialize(), once the new category map is in place. Like the
+// Thrift port, the syslog port can't change without a restart, but the
+// category mapping is re-read on every reinitialize.
+// The listener thread may be blocked in Log() waiting for scribeHandlerLock,
+// so it must not be stopped from here.
+void scribeHandler::configureSyslog(StoreConf& config) {
+  unsigned long int syslog_port = 0;
+  config.getUnsigned("syslog_port", syslog_port);
+
+  if (syslogServer && syslogServer->getPort() != syslog_port) {
+    LOG_OPER("syslog port %lu from conf file ignored, still listening on %lu",
+             syslog_port, syslogServer->getPort());
+  }
+
+  if (syslog_port == 0 && !syslogServer) {
+    return;
+  }
+
+  if (!syslogServer) {
+    syslogServer = shared_ptr<SyslogServer>(new SyslogServer(syslog_port));
+  }
+  syslogServer->configure(config);
+}
+
+// Sets up the shared-memory ring if shm_ingest_path is set. As with the
+// syslog listener, the path and size only take effect on restart.
+void scribeHandler::configureShmIngest(StoreConf& config) {
+  string shm_path;
+  config.getString("shm_ingest_path", shm_path);
+
+  if (shmIngest && shmIngest->getPath() != shm_path) {
+    LOG_OPER("shm_ingest_path <%s> from conf file ignored, still reading <%s>",
+             shm_path.c_str(), shmIngest->getPath().c_str());
+  }
+
+  if (shm_path.empty() && !shmIngest) {
+    return;
+  }
+
+  if (!shmIngest) {
+    shmIngest = shared_ptr<ShmIngest>(new ShmIngest(shm_path));
+  }
+  shmIngest->configure(config);
+}
+
+// Sets up the ingest WAL if ingest_wal_path is set. Like the other ingest
+// paths it is started at the end of initialize(), and the path can't change
+// without a restart.
+void scribeHandler::configureIngestWal(StoreConf& config) {
+  string wal_path;
+  config.getString("ingest_wal_path", wal_path);
+
+  if (ingestWal && ingestWal->getPath() != wal_path) {
+    LOG_OPER("ingest_wal_path <%s> from conf file ignored, still logging to <%s>",
+             wal_path.c_str(), ingestWal->getPath().c_str());
+  }
+
+  if (wal_path.empty() && !ingestWal) {
+    return;
+  }
+
+  if (!ingestWal) {
+    ingestWal = shared_ptr<IngestWal>(new IngestWal(wal_path));
+  }
+  ingestWal->configure(config);
+}
+
+// Feeds messages left in the WAL by the last run to the stores, as if they
+// had just been logged. Each segment is deleted once its stores are done
+// with it. Should be called while holding a writeLock on scribeHandlerLock.
+void scribeHandler::replayIngestWal(const vector<wal_segment_ptr_t>& segments) {
+  unsigned long replayed = 0;
+  for (vector<wal_segment_ptr_t>::const_iterator seg_iter = segments.begin();
+       seg_iter != segments.end();
+       ++seg_iter) {
+    vector<LogEntry> messages;
+    IngestWal::readSegment(*seg_iter, messages);
+
+    for (vector<LogEntry>::iterator msg_iter = messages.begin();
+         msg_iter != messages.end();
+         ++msg_iter) {
+      shared_ptr<store_list_t> store_list;
+      category_map_t::iterator cat_iter = pcategories->find(msg_iter->category);
+      if (cat_iter != pcategories->end()) {
+        store_list = cat_iter->second;
+      } else {
+        store_list = createNewCategory(msg_iter->category);
+      }
+
+      if (store_list == NULL) {
+        LOG_OPER("ingest wal: dropping replayed message with invalid category <%s>",
+                 msg_iter->category.c_str());
+        statReceivedBad.increment();
+        continue;
+      }
+      addMessage(*msg_iter, store_list, *seg_iter);
+      ++replayed;
+    }
+  }
+
+  if (replayed) {
+    statWalReplayed.increment(replayed);
+    LOG_OPER("ingest wal: replayed <%lu> messages", replayed);
+  }
+}
+
+// Starts the shared store worker pool if num_store_threads is set. This has
+// to happen before any StoreQueues are created, and like the port it can't be
+// changed without a restart.
+void scribeHandler::configureStoreScheduler(StoreConf& config) {
+  unsigned long int num_store_threads = 0;
+  config.getUnsigned("num_store_threads", num_store_threads);
+
+  if (g_StoreScheduler) {
+    if (num_store_threads != g_StoreScheduler->getNumThreads()) {
+      LOG_OPER("num_store_threads %lu from conf file ignored, still using %lu",
+               num_store_threads, g_StoreScheduler->getNumThreads());
+    }
+    return;
+  }
+
+  if (num_store_threads == 0) {
+    return;
+  }
+
+  shared_ptr<StoreScheduler> scheduler(new StoreScheduler(num_store_threads));
+  if (scheduler->start()) {
+    g_StoreScheduler = scheduler;
+  } else {
+    LOG_OPER("failed to start store worker threads, using a thread per store");
+  }
+}
+
 // Configures the store specified by the store configuration. Returns false if failed.
 bool scribeHandler::configureStore(pStoreConf store_conf, int *numstores) {
   string category;
@@ -26,6 +26,11 @@
 
 #include "store.h"
 #include "store_queue.h"
+#include "store_scheduler.h"
+#include "syslog_server.h"
+#include "shm_ingest.h"
+#include "ingest_wal.h"
+#include "stats.h"
 
 typedef std::vector<boost::shared_ptr<StoreQueue> > store_list_t;
 typedef std::map<std::string, boost::shared_ptr<store_list_t> > category_map_t;
@@ -50,6 +55,10 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   void setStatus(facebook::fb303::fb_status new_status);
   void setStatusDetails(const std::string& new_status_details);
 
+  // fb303 counters plus everything counted with a StatCounter
+  void getCounters(std::map<std::string, int64_t>& _return);
+  int64_t getCounter(const std::string& key);
+
   unsigned long int port; // it's long because that's all I implemented in the conf class
 
   // number of threads processing new Thrift connections
@@ -80,8 +89,18 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
   unsigned long numMsgLastSecond;
   unsigned long maxMsgPerSecond;
   unsigned long maxQueueSize;
+  unsigned long maxTotalQueueSize;  // across all stores, 0 for no limit
   bool newThreadPerCategory;
 
+  // optional listener for syslog datagrams, NULL if not configured
+  boost::shared_ptr<SyslogServer> syslogServer;
+
+  // optional shared-memory ring for same-host producers, NULL if not configured
+  boost::shared_ptr<ShmIngest> shmIngest;
+
+  // optional write-ahead log for accepted messages, NULL if not configured
+  boost::shared_ptr<IngestWal> ingestWal;
+
   /* mutex to syncronize access to scribeHandler.
    * A single mutex is fine since it only needs to be locked in write mode
    * during start/stop/reinitialize or when we need to create a new category.
@@ -105,12 +124,19 @@ class scribeHandler : virtual public scribe::thrift::scribeIf,
                            const boost::shared_ptr<StoreQueue> &model,
                            bool category_list=false);
   bool configureStore(pStoreConf store_conf, int* num_stores);
+  void configureSyslog(StoreConf& config);
+  void configureShmIngest(StoreConf& config);
+  void configureIngestWal(StoreConf& config);
+  void replayIngestWal(const std::vector<wal_segment_ptr_t>& segments);
+  void configureStoreScheduler(StoreConf& config);
   void stopStores();
+  store_priority_t categoryPriority(const std::string& category);
   bool throttleRequest(const std::vector<scribe::thrift::LogEntry>&  messages);
   boost::shared_ptr<store_list_t>
     createNewCategory(const std::string& category);
   void addMessage(const scribe::thrift::LogEntry& entry,
-                  const boost::shared_ptr<store_list_t>& store_list);
+                  const boost::shared_ptr<store_list_t>& store_list,
+                  const wal_segment_ptr_t& wal_segment);
 };
 
 extern boost::shared_ptr<scribeHandler> g_Handler;
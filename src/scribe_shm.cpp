@@ -0,0 +1,82 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_ring.h"
+#include "scribe_shm.h"
+
+struct scribe_shm {
+  struct scribe_shm_header* header;
+  size_t mapSize;
+};
+
+scribe_shm_t* scribe_shm_open(const char* path) {
+  int fd = open(path, O_RDWR);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct scribe_shm_header)) {
+    close(fd);
+    return NULL;
+  }
+
+  void* addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    return NULL;
+  }
+
+  struct scribe_shm_header* header = (struct scribe_shm_header*)addr;
+  if (header->magic != SCRIBE_SHM_MAGIC ||
+      header->version != SCRIBE_SHM_VERSION ||
+      header->dataOffset + header->capacity > (uint64_t)st.st_size) {
+    munmap(addr, st.st_size);
+    return NULL;
+  }
+
+  scribe_shm_t* shm = (scribe_shm_t*)malloc(sizeof(scribe_shm_t));
+  if (!shm) {
+    munmap(addr, st.st_size);
+    return NULL;
+  }
+  shm->header = header;
+  shm->mapSize = st.st_size;
+  return shm;
+}
+
+int scribe_shm_log(scribe_shm_t* shm,
+                   const char* category, size_t category_length,
+                   const char* message, size_t message_length) {
+  if (!shm || category_length == 0) {
+    return -1;
+  }
+  return scribe_shm_append(shm->header, category, category_length,
+                           message, message_length);
+}
+
+void scribe_shm_close(scribe_shm_t* shm) {
+  if (shm) {
+    munmap(shm->header, shm->mapSize);
+    free(shm);
+  }
+}
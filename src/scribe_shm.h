@@ -0,0 +1,75 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_SHM_H
+#define SCRIBE_SHM_H
+
+#include <stddef.h>
+
+/*
+ * Client for the shared-memory ingest channel of a scribed running on the
+ * same host (see shm_ingest_path in the scribed config).
+ *
+ * Logging a message is a reservation and a memcpy into the ring, with no
+ * syscall unless scribed is idle and has to be woken up. If the ring is
+ * full or scribed isn't running, scribe_shm_log fails immediately and the
+ * caller can fall back to sending the message over Thrift.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct scribe_shm scribe_shm_t;
+
+// Maps the ring created by scribed. Returns NULL if it doesn't exist.
+scribe_shm_t* scribe_shm_open(const char* path);
+
+// Returns 0 on success, -1 if the message could not be queued.
+int scribe_shm_log(scribe_shm_t* shm,
+                   const char* category, size_t category_length,
+                   const char* message, size_t message_length);
+
+void scribe_shm_close(scribe_shm_t* shm);
+
+#ifdef __cplusplus
+}
+
+#include <string>
+
+class ScribeShmClient {
+ public:
+  ScribeShmClient(const std::string& path) : shm(scribe_shm_open(path.c_str())) {}
+  ~ScribeShmClient() { if (shm) scribe_shm_close(shm); }
+
+  bool isOpen() { return shm != NULL; }
+  bool log(const std::string& category, const std::string& message) {
+    return shm && 0 == scribe_shm_log(shm, category.data(), category.size(),
+                                      message.data(), message.size());
+  }
+
+ private:
+  scribe_shm_t* shm;
+
+  // disallow copy, assignment, and empty construction
+  ScribeShmClient();
+  ScribeShmClient(const ScribeShmClient& rhs);
+  ScribeShmClient& operator=(const ScribeShmClient& rhs);
+};
+#endif
+
+#endif // SCRIBE_SHM_H
@@ -0,0 +1,346 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <fcntl.h>
+#include <grp.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "scribe_server.h"
+#include "shm_ingest.h"
+#include "thread_placement.h"
+
+using namespace std;
+using namespace scribe::thrift;
+
+#define DEFAULT_SHM_RING_SIZE        67108864
+#define DEFAULT_SHM_BATCH_SIZE       1024
+#define DEFAULT_SHM_POLL_INTERVAL_MS 100
+#define DEFAULT_SHM_RING_MODE        0660
+#define SHM_MIN_RING_SIZE            65536
+#define SHM_DATA_OFFSET              4096
+#define SHM_BUSY_WAIT_US             1000
+// A producer that holds a reservation this long is assumed to have died
+#define SHM_STALL_TIMEOUT_MS         10000
+
+static StatCounter statShmCorrupt("shm corrupt");
+static StatCounter statShmReceived("shm received");
+static StatCounter statShmAbandoned("shm abandoned");
+
+static uint64_t nowMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void* shmThreadStatic(void *this_ptr) {
+  ShmIngest *ingest_ptr = (ShmIngest*)this_ptr;
+  ThreadPlacement::placeCurrentThread(THREAD_IO);
+  ingest_ptr->threadMember();
+  return NULL;
+}
+
+ShmIngest::ShmIngest(const string& ring_path)
+  : path(ring_path),
+    header(NULL),
+    mapSize(0),
+    running(false),
+    stopping(false),
+    ringSize(DEFAULT_SHM_RING_SIZE),
+    batchSize(DEFAULT_SHM_BATCH_SIZE),
+    pollInterval(DEFAULT_SHM_POLL_INTERVAL_MS),
+    ringMode(DEFAULT_SHM_RING_MODE),
+    stalledPos((uint64_t)-1),
+    stalledHead(0),
+    stalledSince(0) {
+}
+
+ShmIngest::~ShmIngest() {
+  stop();
+  if (header) {
+    munmap(header, mapSize);
+    header = NULL;
+  }
+}
+
+void ShmIngest::configure(StoreConf& config) {
+  if (!running) {
+    config.getUnsigned("shm_ingest_size", ringSize);
+
+    string tmp;
+    if (config.getString("shm_ingest_mode", tmp)) {
+      char* end;
+      unsigned long mode = strtoul(tmp.c_str(), &end, 8);
+      if (*end || mode > 0777) {
+        LOG_OPER("Bad config - shm_ingest_mode <%s> isn't an octal mode",
+                 tmp.c_str());
+      } else {
+        ringMode = mode;
+      }
+    }
+    config.getString("shm_ingest_group", ringGroup);
+  }
+  config.getUnsigned("shm_batch_size", batchSize);
+  config.getUnsigned("shm_poll_interval_ms", pollInterval);
+
+  if (batchSize == 0) {
+    batchSize = DEFAULT_SHM_BATCH_SIZE;
+  }
+  if (pollInterval == 0) {
+    pollInterval = DEFAULT_SHM_POLL_INTERVAL_MS;
+  }
+}
+
+bool ShmIngest::openRing() {
+  uint64_t capacity = SHM_MIN_RING_SIZE;
+  while (capacity < ringSize) {
+    capacity <<= 1;
+  }
+
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, ringMode);
+  if (fd < 0) {
+    LOG_OPER("shm: failed to open <%s>: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+
+  // Anyone who can write the ring can log anything, so it gets exactly the
+  // configured access, whatever the umask or an older scribed left
+  gid_t gid = (gid_t)-1;
+  if (!ringGroup.empty()) {
+    struct group* group = getgrnam(ringGroup.c_str());
+    if (!group) {
+      LOG_OPER("shm: unknown shm_ingest_group <%s>", ringGroup.c_str());
+      close(fd);
+      return false;
+    }
+    gid = group->gr_gid;
+  }
+  if ((gid != (gid_t)-1 && fchown(fd, (uid_t)-1, gid) != 0) ||
+      fchmod(fd, ringMode) != 0) {
+    LOG_OPER("shm: failed to set the owner or mode of <%s>: %s", path.c_str(),
+             strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  size_t total = SHM_DATA_OFFSET + capacity;
+  struct stat st;
+  bool reuse = (fstat(fd, &st) == 0 && (size_t)st.st_size == total);
+
+  if (!reuse && (ftruncate(fd, 0) != 0 || ftruncate(fd, total) != 0)) {
+    LOG_OPER("shm: failed to size <%s> to %lu bytes: %s", path.c_str(),
+             (unsigned long)total, strerror(errno));
+    close(fd);
+    return false;
+  }
+
+  void* addr = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    LOG_OPER("shm: failed to map <%s>: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  header = (scribe_shm_header*)addr;
+  mapSize = total;
+
+  if (reuse && header->magic == SCRIBE_SHM_MAGIC &&
+      header->version == SCRIBE_SHM_VERSION &&
+      header->capacity == capacity &&
+      header->head >= header->tail &&
+      header->head - header->tail <= capacity) {
+    // left over from a previous scribed, producers may still be attached
+    LOG_OPER("shm: resuming ring <%s> with <%lu> bytes pending", path.c_str(),
+             (unsigned long)(header->head - header->tail));
+  } else {
+    memset(addr, 0, total);
+    header->version = SCRIBE_SHM_VERSION;
+    header->dataOffset = SHM_DATA_OFFSET;
+    header->capacity = capacity;
+    __sync_synchronize();
+    header->magic = SCRIBE_SHM_MAGIC;
+  }
+  header->consumerSleeping = 0;
+  return true;
+}
+
+bool ShmIngest::start() {
+  if (running) {
+    return true;
+  }
+
+  if (!header && !openRing()) {
+    return false;
+  }
+
+  stopping = false;
+  if (pthread_create(&drainThread, NULL, shmThreadStatic, (void*) this) != 0) {
+    LOG_OPER("shm: failed to create drain thread");
+    return false;
+  }
+  running = true;
+
+  LOG_OPER("Reading shared memory ring <%s> of <%lu> bytes", path.c_str(),
+           (unsigned long)header->capacity);
+  return true;
+}
+
+void ShmIngest::stop() {
+  if (running) {
+    stopping = true;
+    scribe_shm_wake(header);
+    pthread_join(drainThread, NULL);
+    running = false;
+  }
+}
+
+void ShmIngest::threadMember() {
+  LOG_OPER("shm thread starting");
+
+  while (!stopping) {
+    long consumed = drain();
+    if (consumed < 0) {
+      // Log() asked us to try later, leave the records in the ring
+      usleep(pollInterval * 1000);
+    } else if (consumed == 0) {
+      waitForWork();
+    }
+  }
+
+  LOG_OPER("shm thread exiting");
+}
+
+// Returns the number of records consumed, or -1 if Log() refused them.
+long ShmIngest::drain() {
+  uint64_t tail = header->tail;
+  uint64_t head = header->head;
+  uint64_t pos = tail;
+  long records = 0;
+
+  vector<LogEntry> entries;
+  while (pos < head && entries.size() < batchSize) {
+    scribe_shm_record* rec = scribe_shm_record_at(header, pos);
+    if (!(rec->flags & SCRIBE_SHM_COMMITTED)) {
+      break;
+    }
+    if (!scribe_shm_record_valid(header, pos, head)) {
+      // Its length can't be trusted, so where the next record starts isn't
+      // known yet. checkStall skips it once that's safe.
+      if (pos != stalledPos) {
+        LOG_OPER("shm: corrupt record at position %lu", (unsigned long)pos);
+        statShmCorrupt.increment();
+      }
+      break;
+    }
+
+    if (!(rec->flags & SCRIBE_SHM_PADDING)) {
+      const char* payload = (const char*)(rec + 1);
+      entries.push_back(LogEntry());
+      entries.back().category.assign(payload, rec->categoryLength);
+      entries.back().message.assign(payload + rec->categoryLength,
+                                    rec->messageLength);
+    }
+    pos += rec->length;
+    ++records;
+  }
+
+  if (pos == tail) {
+    checkStall(nowMs());
+    return 0;
+  }
+  stalledPos = (uint64_t)-1;
+
+  if (!entries.empty()) {
+    if (g_Handler->Log(entries) != OK) {
+      return -1;
+    }
+    statShmReceived.increment(entries.size());
+  }
+
+  release(pos);
+  return records;
+}
+
+// Zeroes the consumed part of the ring and hands it back to producers.
+// Zeroing first means stale flags can never look like a committed record.
+void ShmIngest::release(uint64_t new_tail) {
+  uint64_t pos = header->tail;
+  uint64_t capacity = header->capacity;
+  char* data = scribe_shm_data(header);
+
+  while (pos < new_tail) {
+    uint64_t offset = pos & (capacity - 1);
+    uint64_t length = min(new_tail - pos, capacity - offset);
+    memset(data + offset, 0, length);
+    pos += length;
+  }
+
+  __sync_synchronize();
+  header->tail = new_tail;
+}
+
+// Called when the oldest record is uncommitted or corrupt. If it stays that
+// way for too long its producer probably died while writing it. Every
+// reservation made before the stall started is as old by then, so the ring
+// is resynced at the next good record among them, and nothing a live
+// producer could still be writing is released.
+void ShmIngest::checkStall(uint64_t now_ms) {
+  uint64_t tail = header->tail;
+  uint64_t head = header->head;
+  if (head == tail) {
+    stalledPos = (uint64_t)-1;
+    return;
+  }
+
+  if (stalledPos != tail) {
+    stalledPos = tail;
+    stalledHead = head;
+    stalledSince = now_ms;
+    return;
+  }
+  if (now_ms - stalledSince < SHM_STALL_TIMEOUT_MS) {
+    return;
+  }
+
+  uint64_t next = scribe_shm_next_record(header, tail, stalledHead);
+  LOG_OPER("shm: skipping <%lu> bytes at position %lu that were never "
+           "committed or are corrupt", (unsigned long)(next - tail),
+           (unsigned long)tail);
+  release(next);
+  statShmAbandoned.increment();
+  stalledPos = (uint64_t)-1;
+}
+
+void ShmIngest::waitForWork() {
+  if (header->head != header->tail) {
+    // a producer is in the middle of writing a record
+    usleep(SHM_BUSY_WAIT_US);
+    return;
+  }
+
+  uint32_t seq = header->wakeSeq;
+  header->consumerSleeping = 1;
+  __sync_synchronize();
+
+  // producers check consumerSleeping after publishing, so re-check
+  if (header->head == header->tail && !stopping) {
+    struct timespec timeout;
+    timeout.tv_sec = pollInterval / 1000;
+    timeout.tv_nsec = (pollInterval % 1000) * 1000000;
+    syscall(SYS_futex, &header->wakeSeq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+  }
+  header->consumerSleeping = 0;
+}
@@ -0,0 +1,91 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_SHM_INGEST_H
+#define SCRIBE_SHM_INGEST_H
+
+#include "common.h"
+#include "conf.h"
+#include "shm_ring.h"
+
+/*
+ * This class owns the shared-memory ingest ring (see shm_ring.h) and a
+ * thread that drains it into the same Log() path used by Thrift clients.
+ *
+ * Records are only removed from the ring once Log() has accepted them, so
+ * when scribed is throttling, producers see a full ring instead of losing
+ * messages. The ring file outlives scribed, so messages written while it
+ * restarts are picked up when it comes back.
+ *
+ * Global config:
+ *   shm_ingest_path=/dev/shm/scribe
+ *   shm_ingest_size=67108864        rounded up to a power of two
+ *   shm_batch_size=1024             max records per Log() call
+ *   shm_poll_interval_ms=100        max sleep while idle
+ *   shm_ingest_mode=0660            file mode of the ring, in octal
+ *   shm_ingest_group=scribe         group of the ring, default unchanged
+ *
+ * Anyone who can write the ring can log any category, so producers should
+ * be given access through the group rather than a wider mode.
+ */
+class ShmIngest {
+ public:
+  ShmIngest(const std::string& path);
+  virtual ~ShmIngest();
+
+  void configure(StoreConf& config);
+  bool start();
+  void stop();
+  const std::string& getPath() { return path; }
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void threadMember();
+
+ private:
+  bool openRing();
+  long drain();
+  void release(uint64_t new_tail);
+  void checkStall(uint64_t now_ms);
+  void waitForWork();
+
+  std::string path;
+  scribe_shm_header* header;
+  size_t mapSize;
+  pthread_t drainThread;
+  bool running;
+  volatile bool stopping;
+
+  // configuration
+  unsigned long ringSize;
+  unsigned long batchSize;
+  unsigned long pollInterval; // in milliseconds
+  unsigned long ringMode;
+  std::string ringGroup;
+
+  // state for detecting producers that died holding a reservation
+  uint64_t stalledPos;
+  uint64_t stalledHead;    // head when the stall was first seen
+  uint64_t stalledSince;   // in milliseconds
+
+  // disallow copy, assignment, and empty construction
+  ShmIngest();
+  ShmIngest(const ShmIngest& rhs);
+  ShmIngest& operator=(const ShmIngest& rhs);
+};
+
+#endif // SCRIBE_SHM_INGEST_H
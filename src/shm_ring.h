@@ -0,0 +1,226 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_SHM_RING_H
+#define SCRIBE_SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+ * Layout of the shared-memory ingest ring. This header is shared by scribed
+ * (the single consumer) and libscribe (the producers), so it must not depend
+ * on Thrift or anything else in scribed.
+ *
+ * The ring is a power-of-two byte buffer addressed by monotonically
+ * increasing 64-bit positions. Producers reserve space with a CAS on head,
+ * copy their record in, and then publish it by setting SCRIBE_SHM_COMMITTED
+ * in the record flags. The consumer reads committed records from tail,
+ * zeroes the space it consumed, and then advances tail.
+ *
+ * A record never wraps. If it doesn't fit before the end of the buffer the
+ * producer reserves the remainder as a padding record as part of the same
+ * reservation.
+ *
+ * The consumer sets consumerSleeping before it blocks on wakeSeq with a
+ * futex, so producers only make a syscall when scribed is idle.
+ *
+ * Each record header carries a check of its position and lengths. When the
+ * oldest record is corrupt, or its producer died before committing it, the
+ * consumer can't trust its length, so it waits until every reservation
+ * around it is old enough to be finished or abandoned and then skips to the
+ * next record whose check holds. Space another producer may still be
+ * writing is never handed back.
+ */
+
+#define SCRIBE_SHM_MAGIC        0x315253454249524bULL
+#define SCRIBE_SHM_VERSION      2
+#define SCRIBE_SHM_ALIGN        16
+#define SCRIBE_SHM_COMMITTED    0x1
+#define SCRIBE_SHM_PADDING      0x2
+
+struct scribe_shm_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t dataOffset;     // offset of the ring from the start of the mapping
+  uint64_t capacity;       // size of the ring in bytes, a power of two
+  char     pad0[40];
+
+  // written by producers
+  volatile uint64_t head;
+  char     pad1[56];
+
+  // written by the consumer
+  volatile uint64_t tail;
+  char     pad2[56];
+
+  volatile uint32_t consumerSleeping;
+  volatile uint32_t wakeSeq;
+  char     pad3[56];
+};
+
+struct scribe_shm_record {
+  volatile uint32_t length;     // whole record including header, aligned
+  volatile uint16_t flags;
+  uint16_t categoryLength;
+  uint32_t messageLength;
+  uint32_t check;               // scribe_shm_record_check
+  // followed by category, then message
+};
+
+static inline uint32_t scribe_shm_record_check(uint64_t pos, uint32_t length,
+                                               uint16_t category_length,
+                                               uint32_t message_length) {
+  uint64_t x = pos * 0x9e3779b97f4a7c15ULL;
+  x ^= ((uint64_t)length << 32 | message_length) * 0xc2b2ae3d27d4eb4fULL;
+  x ^= (uint64_t)category_length * 0x165667b19e3779f9ULL;
+  x ^= x >> 29;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  return (uint32_t)(x >> 32);
+}
+
+static inline uint64_t scribe_shm_record_size(size_t category_length,
+                                              size_t message_length) {
+  uint64_t size = sizeof(struct scribe_shm_record) + category_length +
+                  message_length;
+  return (size + SCRIBE_SHM_ALIGN - 1) & ~((uint64_t)SCRIBE_SHM_ALIGN - 1);
+}
+
+// Largest record a producer may write. Keeping this well under the capacity
+// means one big message can't starve everyone else of ring space.
+static inline uint64_t scribe_shm_max_record(const struct scribe_shm_header* h) {
+  return h->capacity / 4;
+}
+
+static inline char* scribe_shm_data(struct scribe_shm_header* h) {
+  return (char*)h + h->dataOffset;
+}
+
+static inline struct scribe_shm_record*
+scribe_shm_record_at(struct scribe_shm_header* h, uint64_t pos) {
+  return (struct scribe_shm_record*)
+    (scribe_shm_data(h) + (pos & (h->capacity - 1)));
+}
+
+// Whether a whole, committed record that belongs at pos is there, among
+// the reservations up to head
+static inline int scribe_shm_record_valid(struct scribe_shm_header* h,
+                                          uint64_t pos, uint64_t head) {
+  struct scribe_shm_record* rec = scribe_shm_record_at(h, pos);
+  uint16_t flags = rec->flags;
+  if (!(flags & SCRIBE_SHM_COMMITTED)) {
+    return 0;
+  }
+  __sync_synchronize();
+
+  uint32_t length = rec->length;
+  uint64_t offset = pos & (h->capacity - 1);
+  if (length < sizeof(struct scribe_shm_record) ||
+      length % SCRIBE_SHM_ALIGN || length > head - pos ||
+      offset + length > h->capacity ||
+      rec->check != scribe_shm_record_check(pos, length, rec->categoryLength,
+                                            rec->messageLength)) {
+    return 0;
+  }
+  if (flags & SCRIBE_SHM_PADDING) {
+    return rec->categoryLength == 0 && rec->messageLength == 0;
+  }
+  return scribe_shm_record_size(rec->categoryLength, rec->messageLength) ==
+         length;
+}
+
+// The first valid record after pos and before limit, or limit. Only safe
+// once every reservation before limit is finished or abandoned.
+static inline uint64_t scribe_shm_next_record(struct scribe_shm_header* h,
+                                              uint64_t pos, uint64_t limit) {
+  for (pos += SCRIBE_SHM_ALIGN; pos < limit; pos += SCRIBE_SHM_ALIGN) {
+    if (scribe_shm_record_valid(h, pos, limit)) {
+      return pos;
+    }
+  }
+  return limit;
+}
+
+static inline void scribe_shm_wake(struct scribe_shm_header* h) {
+  __sync_fetch_and_add(&h->wakeSeq, 1);
+  syscall(SYS_futex, &h->wakeSeq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Appends one record to the ring. Returns 0 on success, or -1 if the ring
+// doesn't have space or the record is too large. Never blocks.
+static inline int scribe_shm_append(struct scribe_shm_header* h,
+                                    const char* category, size_t category_length,
+                                    const char* message, size_t message_length) {
+  if (category_length > 0xffff) {
+    return -1;
+  }
+  uint64_t need = scribe_shm_record_size(category_length, message_length);
+  if (need > scribe_shm_max_record(h)) {
+    return -1;
+  }
+
+  uint64_t head, pad;
+  for (;;) {
+    head = h->head;
+    uint64_t tail = h->tail;
+    uint64_t offset = head & (h->capacity - 1);
+    pad = (offset + need > h->capacity) ? h->capacity - offset : 0;
+    if (head + pad + need - tail > h->capacity) {
+      return -1;
+    }
+    if (__sync_bool_compare_and_swap(&h->head, head, head + pad + need)) {
+      break;
+    }
+  }
+
+  if (pad) {
+    struct scribe_shm_record* filler = scribe_shm_record_at(h, head);
+    filler->length = (uint32_t)pad;
+    filler->categoryLength = 0;
+    filler->messageLength = 0;
+    filler->check = scribe_shm_record_check(head, (uint32_t)pad, 0, 0);
+    __sync_synchronize();
+    filler->flags = SCRIBE_SHM_PADDING | SCRIBE_SHM_COMMITTED;
+    head += pad;
+  }
+
+  struct scribe_shm_record* rec = scribe_shm_record_at(h, head);
+  rec->length = (uint32_t)need;
+  rec->categoryLength = (uint16_t)category_length;
+  rec->messageLength = (uint32_t)message_length;
+  rec->check = scribe_shm_record_check(head, (uint32_t)need,
+                                       (uint16_t)category_length,
+                                       (uint32_t)message_length);
+  char* payload = (char*)(rec + 1);
+  memcpy(payload, category, category_length);
+  memcpy(payload + category_length, message, message_length);
+
+  // publish
+  __sync_synchronize();
+  rec->flags = SCRIBE_SHM_COMMITTED;
+  __sync_synchronize();
+
+  if (h->consumerSleeping) {
+    scribe_shm_wake(h);
+  }
+  return 0;
+}
+
+#endif // SCRIBE_SHM_RING_H
@@ -0,0 +1,339 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "stats.h"
+
+using namespace std;
+
+namespace {
+
+// Everything shared between threads lives here. It's created on first use
+// so StatCounters defined as statics in other files can register safely
+// no matter what order they are constructed in.
+struct StatRegistry {
+  pthread_mutex_t lock;
+  pthread_key_t threadKey;
+  vector<string> names;
+  map<string, unsigned> ids;
+  set<int64_t*> blocks;                 // one per live thread
+  int64_t retired[MAX_STAT_COUNTERS];   // totals from threads that exited
+
+  StatRegistry();
+};
+
+StatRegistry& registry();
+
+void releaseSlots(void* slots);
+
+StatRegistry::StatRegistry() {
+  pthread_mutex_init(&lock, NULL);
+  pthread_key_create(&threadKey, releaseSlots);
+  memset(retired, 0, sizeof(retired));
+}
+
+StatRegistry& registry() {
+  static StatRegistry* reg = new StatRegistry();
+  return *reg;
+}
+
+void releaseSlots(void* slots) {
+  int64_t* block = static_cast<int64_t*>(slots);
+  StatRegistry& reg = registry();
+
+  pthread_mutex_lock(&reg.lock);
+  for (unsigned i = 0; i < MAX_STAT_COUNTERS; ++i) {
+    reg.retired[i] += block[i];
+  }
+  reg.blocks.erase(block);
+  pthread_mutex_unlock(&reg.lock);
+
+  delete [] block;
+}
+
+} // namespace
+
+__thread int64_t* StatCounter::localSlots = NULL;
+
+StatCounter::StatCounter(const string& name_)
+  : name(name_),
+    id(0) {
+  StatRegistry& reg = registry();
+
+  pthread_mutex_lock(&reg.lock);
+  map<string, unsigned>::iterator iter = reg.ids.find(name);
+  if (iter != reg.ids.end()) {
+    id = iter->second;
+  } else if (reg.names.size() < MAX_STAT_COUNTERS) {
+    id = reg.names.size();
+    reg.names.push_back(name);
+    reg.ids[name] = id;
+  } else {
+    // Still count it somewhere rather than dropping it on the floor
+    LOG_OPER("too many stat counters, <%s> will be counted as <%s>",
+             name.c_str(), reg.names[MAX_STAT_COUNTERS - 1].c_str());
+    id = MAX_STAT_COUNTERS - 1;
+  }
+  pthread_mutex_unlock(&reg.lock);
+}
+
+int64_t* StatCounter::createThreadSlots() {
+  StatRegistry& reg = registry();
+
+  int64_t* block = new int64_t[MAX_STAT_COUNTERS];
+  memset(block, 0, sizeof(int64_t) * MAX_STAT_COUNTERS);
+
+  pthread_mutex_lock(&reg.lock);
+  reg.blocks.insert(block);
+  pthread_mutex_unlock(&reg.lock);
+
+  // so the block gets folded into the totals when this thread exits
+  pthread_setspecific(reg.threadKey, block);
+  localSlots = block;
+  return block;
+}
+
+void StatCounter::getCounters(map<string, int64_t>& counters) {
+  StatRegistry& reg = registry();
+
+  pthread_mutex_lock(&reg.lock);
+  for (unsigned i = 0; i < reg.names.size(); ++i) {
+    int64_t total = reg.retired[i];
+    for (set<int64_t*>::iterator iter = reg.blocks.begin();
+         iter != reg.blocks.end();
+         ++iter) {
+      total += __atomic_load_n(&(*iter)[i], __ATOMIC_RELAXED);
+    }
+    // Only report counters that have been hit, same as fb303 does
+    if (total != 0) {
+      counters[reg.names[i]] += total;
+    }
+  }
+  pthread_mutex_unlock(&reg.lock);
+}
+
+namespace {
+
+typedef map<pair<string, string>, boost::shared_ptr<LatencyHistogram> >
+  histogram_map_t;
+
+struct HistogramRegistry {
+  pthread_mutex_t lock;
+  histogram_map_t histograms;
+  map<string, unsigned> categories;  // histograms per category scope
+  unsigned long maxCategories;
+
+  HistogramRegistry() : maxCategories(DEFAULT_MAX_LATENCY_CATEGORIES) {
+    pthread_mutex_init(&lock, NULL);
+  }
+};
+
+const char* const otherCategories = "scribe_other_categories";
+
+HistogramRegistry& histogramRegistry() {
+  static HistogramRegistry* reg = new HistogramRegistry();
+  return *reg;
+}
+
+struct Percentile {
+  double quantile;
+  const char* name;
+};
+
+const Percentile percentiles[] = {
+  { 0.5,   "p50" },
+  { 0.9,   "p90" },
+  { 0.99,  "p99" },
+  { 0.999, "p999" },
+};
+
+// Drops the histograms that only the registry still holds, like those of
+// categories whose stores are gone. Must hold the registry lock.
+void pruneHistograms(HistogramRegistry& reg) {
+  histogram_map_t::iterator iter = reg.histograms.begin();
+  while (iter != reg.histograms.end()) {
+    if (!iter->second.unique()) {
+      ++iter;
+      continue;
+    }
+    map<string, unsigned>::iterator category =
+      reg.categories.find(iter->first.first);
+    if (category != reg.categories.end() && --category->second == 0) {
+      reg.categories.erase(category);
+    }
+    reg.histograms.erase(iter++);
+  }
+}
+
+} // namespace
+
+uint64_t LatencyHistogram::windowMicros =
+  (uint64_t)DEFAULT_LATENCY_WINDOW_SEC * 1000000;
+
+LatencyHistogram::LatencyHistogram() {
+  memset((void*)buckets, 0, sizeof(buckets));
+  memset((void*)slotWindow, 0, sizeof(slotWindow));
+}
+
+void LatencyHistogram::configure(unsigned long window_sec,
+                                 unsigned long max_categories) {
+  windowMicros = (uint64_t)(window_sec ? window_sec
+                                       : DEFAULT_LATENCY_WINDOW_SEC) * 1000000;
+
+  HistogramRegistry& reg = histogramRegistry();
+  pthread_mutex_lock(&reg.lock);
+  reg.maxCategories = max_categories;
+  pthread_mutex_unlock(&reg.lock);
+}
+
+// Takes over a slot for a new window. Values recorded into the slot while
+// it's being cleared can be lost, which doesn't matter for percentiles.
+void LatencyHistogram::startWindow(unsigned slot, uint64_t window) {
+  uint64_t old = slotWindow[slot];
+  if (old != window &&
+      __sync_bool_compare_and_swap(&slotWindow[slot], old, window)) {
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+      buckets[slot][i] = 0;
+    }
+  }
+}
+
+boost::shared_ptr<LatencyHistogram>
+LatencyHistogram::get(const string& scope, const string& stage) {
+  HistogramRegistry& reg = histogramRegistry();
+
+  pthread_mutex_lock(&reg.lock);
+  boost::shared_ptr<LatencyHistogram>& histogram =
+    reg.histograms[make_pair(scope, stage)];
+  if (!histogram) {
+    histogram.reset(new LatencyHistogram());
+  }
+  boost::shared_ptr<LatencyHistogram> result = histogram;
+  pthread_mutex_unlock(&reg.lock);
+
+  return result;
+}
+
+boost::shared_ptr<LatencyHistogram>
+LatencyHistogram::getForCategory(const string& category, const string& stage) {
+  HistogramRegistry& reg = histogramRegistry();
+
+  pthread_mutex_lock(&reg.lock);
+  string scope = category;
+  if (reg.categories.find(category) == reg.categories.end() &&
+      reg.categories.size() >= reg.maxCategories) {
+    pruneHistograms(reg);
+    if (reg.categories.size() >= reg.maxCategories) {
+      scope = otherCategories;
+    }
+  }
+
+  boost::shared_ptr<LatencyHistogram>& histogram =
+    reg.histograms[make_pair(scope, stage)];
+  if (!histogram) {
+    histogram.reset(new LatencyHistogram());
+    if (scope == category) {
+      ++reg.categories[category];
+    }
+  }
+  boost::shared_ptr<LatencyHistogram> result = histogram;
+  pthread_mutex_unlock(&reg.lock);
+
+  return result;
+}
+
+// Middle of the range of values that land in a bucket
+uint64_t LatencyHistogram::bucketValue(unsigned bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS) {
+    return bucket;
+  }
+  unsigned shift = bucket / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t low = (uint64_t)(HISTOGRAM_SUB_BUCKETS +
+                            bucket % HISTOGRAM_SUB_BUCKETS) << shift;
+  return low + (((uint64_t)1 << shift) >> 1);
+}
+
+uint64_t LatencyHistogram::getPercentile(double q) {
+  // only the current window and the one before it
+  uint64_t window = monotonicMicros() / windowMicros;
+  bool recent[2];
+  for (unsigned slot = 0; slot < 2; ++slot) {
+    recent[slot] = slotWindow[slot] == window || slotWindow[slot] + 1 == window;
+  }
+
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total = 0;
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    counts[i] = (recent[0] ? buckets[0][i] : 0) +
+                (recent[1] ? buckets[1][i] : 0);
+    total += counts[i];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  uint64_t rank = (uint64_t)(q * total + 0.999999);
+  if (rank == 0) {
+    rank = 1;
+  }
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+    seen += counts[i];
+    if (seen >= rank) {
+      return bucketValue(i);
+    }
+  }
+  return bucketValue(HISTOGRAM_BUCKETS - 1);
+}
+
+void LatencyHistogram::getCounters(map<string, int64_t>& counters) {
+  HistogramRegistry& reg = histogramRegistry();
+
+  pthread_mutex_lock(&reg.lock);
+  pruneHistograms(reg);
+  for (histogram_map_t::iterator iter = reg.histograms.begin();
+       iter != reg.histograms.end();
+       ++iter) {
+    string prefix = iter->first.first + ":" + iter->first.second + " latency ";
+    for (unsigned i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); ++i) {
+      counters[prefix + percentiles[i].name] =
+        iter->second->getPercentile(percentiles[i].quantile);
+    }
+  }
+  pthread_mutex_unlock(&reg.lock);
+}
+
+string LatencyHistogram::getSummary(const string& scope) {
+  HistogramRegistry& reg = histogramRegistry();
+  ostringstream summary;
+
+  pthread_mutex_lock(&reg.lock);
+  for (histogram_map_t::iterator iter =
+         reg.histograms.lower_bound(make_pair(scope, string()));
+       iter != reg.histograms.end() && iter->first.first == scope;
+       ++iter) {
+    summary << (summary.tellp() > 0 ? ", " : "") << iter->first.second << " "
+            << iter->second->getPercentile(0.5) << "/"
+            << iter->second->getPercentile(0.99);
+  }
+  pthread_mutex_unlock(&reg.lock);
+
+  if (summary.tellp() > 0) {
+    return scope + " latency p50/p99 (us): " + summary.str();
+  }
+  return string();
+}
@@ -0,0 +1,214 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_STATS_H
+#define SCRIBE_STATS_H
+
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <time.h>
+#include <boost/shared_ptr.hpp>
+
+#define MAX_STAT_COUNTERS 512
+
+// Histogram buckets are split into 2^HISTOGRAM_SUB_BUCKET_BITS linear steps
+// per power of two, so any recorded value is off by at most 1/8th.
+#define HISTOGRAM_SUB_BUCKET_BITS 3
+#define HISTOGRAM_SUB_BUCKETS     (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_MAX_EXPONENT    40
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_EXPONENT - HISTOGRAM_SUB_BUCKET_BITS + 2) * HISTOGRAM_SUB_BUCKETS)
+
+#define DEFAULT_LATENCY_WINDOW_SEC      60
+#define DEFAULT_MAX_LATENCY_CATEGORIES  500
+
+/*
+ * Cheap counters for the message path.
+ *
+ * fb303's incrementCounter takes a mutex and does a map lookup on every call.
+ * A StatCounter is registered by name once, usually as a static, and then
+ * increment() only touches a slot in a block owned by the calling thread, so
+ * there is no lock and no shared cache line. The blocks are summed when
+ * someone asks for the counters through getCounters.
+ *
+ *   static StatCounter receivedGood("received good");
+ *   receivedGood.increment();
+ *
+ * Counters with the same name share a slot.
+ */
+class StatCounter {
+ public:
+  explicit StatCounter(const std::string& name);
+
+  inline void increment(int64_t amount = 1) {
+    int64_t* slot = threadSlots();
+    // Only this thread ever writes the slot, readers just need untorn values
+    __atomic_store_n(&slot[id], __atomic_load_n(&slot[id], __ATOMIC_RELAXED) +
+                     amount, __ATOMIC_RELAXED);
+  }
+
+  const std::string& getName() const { return name; }
+
+  // Adds the current value of every registered counter to counters.
+  static void getCounters(std::map<std::string, int64_t>& counters);
+
+ private:
+  static inline int64_t* threadSlots() {
+    return localSlots ? localSlots : createThreadSlots();
+  }
+  static int64_t* createThreadSlots();
+
+  static __thread int64_t* localSlots;
+
+  std::string name;
+  unsigned id;
+
+  // disallow copy, assignment, and empty construction
+  StatCounter();
+  StatCounter(const StatCounter& rhs);
+  StatCounter& operator=(const StatCounter& rhs);
+};
+
+// Microseconds on CLOCK_MONOTONIC, for timing things
+inline uint64_t monotonicMicros() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+inline uint64_t monotonicMillis() {
+  return monotonicMicros() / 1000;
+}
+
+/*
+ * Log-bucketed latency histogram, in microseconds.
+ *
+ * Histograms are looked up by scope and stage, where the scope is
+ * "scribe_overall", a category, or "store_<type>". Lookups take a lock, so
+ * callers should hold on to the result. Recording a value is one atomic add.
+ *
+ * Counts are kept for two windows of latency_window_sec, the current one and
+ * the one before, and percentiles cover both. So they reflect the last one
+ * to two windows rather than everything since startup.
+ *
+ * Every histogram is exported through getCounters as
+ * "<scope>:<stage> latency p50", and likewise for p90, p99 and p999.
+ * Histograms nobody holds any more are dropped there too.
+ */
+class LatencyHistogram {
+ public:
+  static boost::shared_ptr<LatencyHistogram> get(const std::string& scope,
+                                                 const std::string& stage);
+
+  // Like get, but once max_latency_categories categories have histograms,
+  // any others share the scope "scribe_other_categories"
+  static boost::shared_ptr<LatencyHistogram> getForCategory(
+    const std::string& category, const std::string& stage);
+
+  static void configure(unsigned long window_sec,
+                        unsigned long max_categories);
+
+  inline void record(uint64_t micros) {
+    recordAt(micros, monotonicMicros());
+  }
+
+  // Records the time since start, as returned by monotonicMicros()
+  inline void recordSince(uint64_t start) {
+    uint64_t now = monotonicMicros();
+    recordAt(now > start ? now - start : 0, now);
+  }
+
+  // Records micros at time now, as returned by monotonicMicros()
+  inline void recordAt(uint64_t micros, uint64_t now) {
+    uint64_t window = now / windowMicros;
+    unsigned slot = window & 1;
+    if (slotWindow[slot] != window) {
+      startWindow(slot, window);
+    }
+    __sync_fetch_and_add(&buckets[slot][bucketFor(micros)], 1);
+  }
+
+  // Returns the value at quantile q (0 < q <= 1), or 0 if nothing was recorded
+  uint64_t getPercentile(double q);
+
+  // Adds percentiles for every histogram to counters
+  static void getCounters(std::map<std::string, int64_t>& counters);
+
+  // One line of p50/p99 for every stage in a scope, for status details
+  static std::string getSummary(const std::string& scope);
+
+  LatencyHistogram();
+
+ private:
+  static inline unsigned bucketFor(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+      return (unsigned)value;
+    }
+    unsigned exponent = 63 - __builtin_clzll(value);
+    if (exponent > HISTOGRAM_MAX_EXPONENT) {
+      return HISTOGRAM_BUCKETS - 1;
+    }
+    unsigned shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+      (unsigned)((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+  }
+  static uint64_t bucketValue(unsigned bucket);
+  void startWindow(unsigned slot, uint64_t window);
+
+  static uint64_t windowMicros;
+
+  // counts for the windows in slotWindow, the current one and the last
+  volatile uint32_t buckets[2][HISTOGRAM_BUCKETS];
+  volatile uint64_t slotWindow[2];
+
+  // disallow copy and assignment
+  LatencyHistogram(const LatencyHistogram& rhs);
+  LatencyHistogram& operator=(const LatencyHistogram& rhs);
+};
+
+/*
+ * One pipeline stage timed for a category, for every store of the same
+ * type, and overall, e.g. "web:flush", "store_file:flush" and
+ * "scribe_overall:flush".
+ */
+class StageLatency {
+ public:
+  void init(const std::string& category, const std::string& store_type,
+            const std::string& stage) {
+    byCategory = LatencyHistogram::getForCategory(category, stage);
+    byStoreType = LatencyHistogram::get("store_" + store_type, stage);
+    overall = LatencyHistogram::get("scribe_overall", stage);
+  }
+
+  inline void recordSince(uint64_t start) {
+    if (byCategory) {
+      uint64_t now = monotonicMicros();
+      uint64_t elapsed = now > start ? now - start : 0;
+      byCategory->recordAt(elapsed, now);
+      byStoreType->recordAt(elapsed, now);
+      overall->recordAt(elapsed, now);
+    }
+  }
+
+ private:
+  boost::shared_ptr<LatencyHistogram> byCategory;
+  boost::shared_ptr<LatencyHistogram> byStoreType;
+  boost::shared_ptr<LatencyHistogram> overall;
+};
+
+#endif // SCRIBE_STATS_H
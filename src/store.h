@@ -68,6 +68,9 @@ class Store {
   virtual bool replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
                              struct tm* now);
   virtual bool empty(struct tm* now);
+  // true if deleteOldest only dropped part of the oldest file, the part the
+  // last readOldest returned, and there's more of it to read
+  virtual bool readingOldest() { return false; }
 
   // don't need to override
   virtual const std::string& getType();
@@ -36,6 +36,9 @@ using namespace boost;
 #define DEFAULT_BUFFERSTORE_AVG_RETRY_INTERVAL   300
 #define DEFAULT_BUFFERSTORE_RETRY_INTERVAL_RANGE 60
 
+static StatCounter statRetries("retries");
+static StatCounter statLost("lost");
+
 BufferStore::BufferStore(const string& category, bool multi_category,
                          const string& trigger_path)
   : Store(category, "buffer", multi_category, trigger_path),
@@ -48,6 +51,7 @@ BufferStore::BufferStore(const string& category, bool multi_category,
 
   lastWriteTime = lastOpenAttempt = time(NULL);
   retryInterval = getNewRetryInterval();
+  replayLatency.init(categoryHandled, storeType, "replay");
 
   // we can't open the client conection until we get configured
 }
@@ -243,7 +247,7 @@ void BufferStore::changeState(buffer_state_t new_state) {
     // Do not set status here as it is possible to be in this frequently.
     // Whatever caused us to enter this state should have either set status
     // or chosen not to set status.
-    g_Handler->incrementCounter("retries");
+    statRetries.increment();
     lastOpenAttempt = time(NULL);
     retryInterval = getNewRetryInterval();
     LOG_OPER("[%s] choosing new retry interval <%d> seconds", categoryHandled.c_str(),
@@ -298,10 +302,11 @@ void BufferStore::periodicCheck() {
     // Read a group of messages from the secondary store and send them to
     // the primary store. Note that the primary store could tell us to try
     // again later, so this isn't very efficient if it reads too many
-    // messages at once. (if the secondary store is a file, the number of
-    // messages read is controlled by the max file size)
+    // messages at once. (a file store reads a bounded chunk of a file at a
+    // time, and only a finished file counts towards bufferSendRate)
     unsigned sent = 0;
-    for (sent = 0; sent < bufferSendRate; ++sent) {
+    while (sent < bufferSendRate) {
+      uint64_t replay_start = monotonicMicros();
       boost::shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
       if (secondaryStore->readOldest(messages, &nowinfo)) {
         lastWriteTime = time(NULL);
@@ -310,6 +315,10 @@ void BufferStore::periodicCheck() {
         if (size) {
           if (primaryStore->handleMessages(messages)) {
             secondaryStore->deleteOldest(&nowinfo);
+            replayLatency.recordSince(replay_start);
+            if (!secondaryStore->readingOldest()) {
+              ++sent;
+            }
           } else {
 
             if (messages->size() != size) {
@@ -324,7 +333,7 @@ void BufferStore::periodicCheck() {
                 // Nothing we can do but try to remove oldest messages and report a loss
                 LOG_OPER("[%s] buffer store secondary store lost %lu messages",
                          categoryHandled.c_str(), messages->size());
-                g_Handler->incrementCounter("lost", messages->size());
+                statLost.increment(messages->size());
                 secondaryStore->deleteOldest(&nowinfo);
               }
             }
@@ -335,6 +344,9 @@ void BufferStore::periodicCheck() {
         }  else {
           // else it's valid for read to not find anything but not error
           secondaryStore->deleteOldest(&nowinfo);
+          if (!secondaryStore->readingOldest()) {
+            ++sent;
+          }
         }
       } else {
         // This is bad news. We'll stay in the sending state and keep trying to read.
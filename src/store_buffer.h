@@ -31,6 +31,7 @@
 #include "conf.h"
 #include "file.h"
 #include "conn_pool.h"
+#include "stats.h"
 
 /*
  * This store aggregates messages and sends them to another store
@@ -94,6 +95,9 @@ class BufferStore : public Store {
   time_t lastOpenAttempt;
   time_t retryInterval;
 
+  // time to move one batch from the secondary to the primary store
+  StageLatency replayLatency;
+
  private:
   // disallow copy, assignment, and empty construction
   BufferStore();
@@ -26,6 +26,16 @@
 #include "common.h"
 #include "store.h"
 #include "store_file.h"
+#include "direct_file.h"
+#include "mapped_file.h"
+#include "file_sync.h"
+#include "frame_batch.h"
+#include "file_rotate.h"
+
+#define DEFAULT_FILESTORE_REPLAY_CHUNK_SIZE      4000000
+#define DEFAULT_FILESTORE_REPLAY_CHUNK_MESSAGES  0
+#define DEFAULT_FILESTORE_FSYNC_INTERVAL_MS      1000
+#define DEFAULT_FILESTORE_FSYNC_BYTES            1048576
 
 using namespace std;
 using namespace boost;
@@ -37,10 +47,29 @@ FileStore::FileStore(const string& category, bool multi_category,
                      const string& trigger_path, bool is_buffer_file)
   : FileStoreBase(category, "file", multi_category, trigger_path),
     isBufferFile(is_buffer_file),
-    addNewlines(false) {
+    addNewlines(false),
+    directIo(false),
+    compression(COMPRESSION_NONE),
+    compressionLevel(0),
+    frameVersion(1),
+    fsyncPolicy(FSYNC_NEVER),
+    fsyncIntervalMs(DEFAULT_FILESTORE_FSYNC_INTERVAL_MS),
+    fsyncBytes(DEFAULT_FILESTORE_FSYNC_BYTES),
+    preallocateFiles(false),
+    replayChunkSize(DEFAULT_FILESTORE_REPLAY_CHUNK_SIZE),
+    replayChunkMessages(DEFAULT_FILESTORE_REPLAY_CHUNK_MESSAGES),
+    unsyncedBytes(0),
+    syncHandle(-1),
+    replayIndex(0),
+    replayDone(false) {
+  syncLatency.init(categoryHandled, storeType, "fsync");
 }
 
 FileStore::~FileStore() {
+  abandonNextFile();
+  if (syncHandle >= 0) {
+    FileSyncer::get()->remove(syncHandle);
+  }
 }
 
 void FileStore::configure(pStoreConf configuration) {
@@ -73,6 +102,86 @@ void FileStore::configure(pStoreConf configuration) {
   unsigned long inttemp = 0;
   configuration->getUnsigned("add_newlines", inttemp);
   addNewlines = inttemp ? true : false;
+
+  configuration->getUnsigned("replay_chunk_size", replayChunkSize);
+  configuration->getUnsigned("replay_chunk_messages", replayChunkMessages);
+
+  string tmp;
+  if (configuration->getString("direct_io", tmp)) {
+    directIo = (0 == tmp.compare("yes"));
+    if (directIo && fsType != "std" && fsType != "posix") {
+      LOG_OPER("[%s] Bad config - direct_io only works with local files, "
+               "not fs_type <%s>", categoryHandled.c_str(), fsType.c_str());
+      directIo = false;
+    }
+  }
+
+  if (configuration->getString("compression", tmp)) {
+    if (!parseCompression(tmp, compression)) {
+      LOG_OPER("[%s] Bad config - compression <%s> isn't supported, writing "
+               "uncompressed files", categoryHandled.c_str(), tmp.c_str());
+      compression = COMPRESSION_NONE;
+    } else if (compression != COMPRESSION_NONE && fsType != "std" &&
+               fsType != "posix" && fsType != "uring") {
+      LOG_OPER("[%s] Bad config - compression only works with local files, "
+               "not fs_type <%s>", categoryHandled.c_str(), fsType.c_str());
+      compression = COMPRESSION_NONE;
+    }
+  }
+  configuration->getUnsigned("compression_level", compressionLevel);
+
+  if (configuration->getUnsigned("frame_version", frameVersion)) {
+    if (frameVersion != 1 && frameVersion != BATCH_VERSION) {
+      LOG_OPER("[%s] Bad config - unknown frame_version <%lu>, using 1",
+               categoryHandled.c_str(), frameVersion);
+      frameVersion = 1;
+    } else if (frameVersion != 1 && !isBufferFile) {
+      LOG_OPER("[%s] Bad config - frame_version only applies to buffer files",
+               categoryHandled.c_str());
+      frameVersion = 1;
+    }
+  }
+
+  if (configuration->getString("fsync", tmp)) {
+    if (0 == tmp.compare("never")) {
+      fsyncPolicy = FSYNC_NEVER;
+    } else if (0 == tmp.compare("batch")) {
+      fsyncPolicy = FSYNC_BATCH;
+    } else if (0 == tmp.compare("interval")) {
+      fsyncPolicy = FSYNC_INTERVAL;
+    } else if (0 == tmp.compare("bytes")) {
+      fsyncPolicy = FSYNC_BYTES;
+    } else {
+      LOG_OPER("[%s] Bad config - unknown fsync <%s>, not syncing",
+               categoryHandled.c_str(), tmp.c_str());
+      fsyncPolicy = FSYNC_NEVER;
+    }
+    if (fsyncPolicy != FSYNC_NEVER && fsType != "std" &&
+        fsType != "posix" && fsType != "uring") {
+      LOG_OPER("[%s] Bad config - fsync only works with local files, "
+               "not fs_type <%s>", categoryHandled.c_str(), fsType.c_str());
+      fsyncPolicy = FSYNC_NEVER;
+    }
+  }
+  configuration->getUnsigned("fsync_interval_ms", fsyncIntervalMs);
+  configuration->getUnsigned("fsync_bytes", fsyncBytes);
+
+  if (configuration->getString("preallocate", tmp)) {
+    preallocateFiles = (0 == tmp.compare("yes"));
+    if (preallocateFiles && fsType != "std" && fsType != "posix" &&
+        fsType != "uring") {
+      LOG_OPER("[%s] Bad config - preallocate only works with local files, "
+               "not fs_type <%s>", categoryHandled.c_str(), fsType.c_str());
+      preallocateFiles = false;
+    }
+  }
+
+  // a compressed block is never a whole number of chunks
+  if (compression != COMPRESSION_NONE && chunkSize) {
+    LOG_OPER("[%s] Bad config - chunk_size is ignored with compression",
+             categoryHandled.c_str());
+    chunkSize = 0;
+  }
 }
 
 bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
@@ -86,7 +195,8 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
   }
 
   try {
-    int suffix = findNewestFile(makeBaseFilename(current_time));
+    string base_filename = makeBaseFilename(current_time);
+    int suffix = findNewestFile(base_filename);
 
     if (incrementFilename) {
       ++suffix;
@@ -115,35 +225,72 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
 
     if (writeFile) {
       if (writeMeta) {
-        writeFile->write(meta_logfile_prefix + file);
+        // framed like any message written by writeMessages, so readers
+        // and batch checksums see one more record
+        static const char newline = '\n';
+        string meta = meta_logfile_prefix + file;
+        unsigned long meta_length = meta.length() + (addNewlines ? 1 : 0);
+        string category_frame = writeFile->getFrame(categoryHandled.length() + 1);
+        string frame = writeFile->getFrame(meta_length);
+        write_segments_t segments;
+        if (writeCategory) {
+          addSegment(segments, category_frame.data(), category_frame.length());
+          addSegment(segments, categoryHandled.data(), categoryHandled.length());
+          addSegment(segments, &newline, 1);
+        }
+        addSegment(segments, frame.data(), frame.length());
+        addSegment(segments, meta.data(), meta.length());
+        if (addNewlines) {
+          addSegment(segments, &newline, 1);
+        }
+
+        unsigned long written;
+        unsigned long file_bytes;
+        writeBatch(writeFile, segments, writeCategory ? 2 : 1, written,
+                   file_bytes);
       }
-      writeFile->close();
+      closeWriteFile();
     }
 
-    writeFile = FileInterface::createFileInterface(fsType, file, isBufferFile);
-    if (!writeFile) {
-      LOG_OPER("[%s] Failed to create file <%s> of type <%s> for writing",
-               categoryHandled.c_str(), file.c_str(), fsType.c_str());
-      setStatus("file open error");
-      return false;
+    // the next file may have been opened already
+    shared_ptr<FileInterface> preopened;
+    if (nextFile && nextFile->getFilename() == file) {
+      preopened = nextFile->take();
+      nextFile.reset();
     }
+    abandonNextFile();
 
-    success = writeFile->createDirectory(baseFilePath);
+    if (preopened) {
+      writeFile = preopened;
+      success = true;
+    } else {
+      writeFile = createWriteFile(file);
+      if (!writeFile) {
+        LOG_OPER("[%s] Failed to create file <%s> of type <%s> for writing",
+                 categoryHandled.c_str(), file.c_str(), fsType.c_str());
+        setStatus("file open error");
+        return false;
+      }
 
-    // If we created a subdirectory, we need to create two directories
-    if (success && !subDirectory.empty()) {
-      success = writeFile->createDirectory(filePath);
-    }
+      success = writeFile->createDirectory(baseFilePath);
 
-    if (!success) {
-      LOG_OPER("[%s] Failed to create directory for file <%s>",
-               categoryHandled.c_str(), file.c_str());
-      setStatus("File open error");
-      return false;
-    }
+      // If we created a subdirectory, we need to create two directories
+      if (success && !subDirectory.empty()) {
+        success = writeFile->createDirectory(filePath);
+      }
 
-    success = writeFile->openWrite();
+      if (!success) {
+        LOG_OPER("[%s] Failed to create directory for file <%s>",
+                 categoryHandled.c_str(), file.c_str());
+        setStatus("File open error");
+        return false;
+      }
 
+      success = writeFile->openWrite();
+      if (success && preallocateFiles && maxSize) {
+        writeFile->preallocate(maxSize);
+      }
+    }
 
     if (!success) {
       LOG_OPER("[%s] Failed to open file <%s> for writing",
@@ -154,12 +301,13 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
 
       /* just make a best effort here, and don't error if it fails */
       if (createSymlink && !isBufferFile) {
-        string symlinkName = makeFullSymlink();
-        boost::shared_ptr<FileInterface> tmp =
-          FileInterface::createFileInterface(fsType, symlinkName, isBufferFile);
-        tmp->deleteFile();
-        string symtarget = makeFullFilename(suffix, current_time, false);
-        writeFile->createSymlink(symtarget, symlinkName);
+        shared_ptr<RotationTask> task(new SymlinkTask(fsType,
+          makeFullFilename(suffix, current_time, false), makeFullSymlink()));
+        if (asyncRotate) {
+          FileRotator::get()->add(task);
+        } else {
+          task->run();
+        }
       }
       // else it confuses the filename code on reads
 
@@ -169,7 +317,18 @@ bool FileStore::openInternal(bool incrementFilename, struct tm* current_time) {
       currentSize = writeFile->fileSize();
       currentFilename = file;
       eventsWritten = 0;
+      unsyncedBytes = 0;
+      indexOpenedFile(base_filename, suffix);
       setStatus("");
+
+      if (asyncRotate) {
+        preopenNextFile(makeFullFilename(suffix + 1, current_time));
+      }
+
+      if (fsyncPolicy == FSYNC_INTERVAL) {
+        syncHandle = FileSyncer::get()->add(file, fsyncIntervalMs,
+                                            syncLatency);
+      }
     }
 
   } catch(std::exception const& e) {
@@ -188,15 +347,107 @@ bool FileStore::isOpen() {
 }
 
 void FileStore::close() {
+  abandonNextFile();
   if (writeFile) {
-    writeFile->close();
+    closeWriteFile();
+  }
+}
+
+shared_ptr<FileInterface> FileStore::createWriteFile(const string& filename) {
+  if (directIo) {
+    // staged a chunk at a time, so chunk padding lines up with the writes
+    return shared_ptr<FileInterface>(
+      new DirectFile(filename, isBufferFile, chunkSize));
+  }
+  return FileInterface::createFileInterface(fsType, filename, isBufferFile);
+}
+
+void FileStore::preopenNextFile(const string& filename) {
+  shared_ptr<FileInterface> file =
+    createWriteFile(PreopenedFile::hiddenName(filename));
+  if (!file) {
+    return;
+  }
+  nextFile = shared_ptr<PreopenedFile>(new PreopenedFile(file, filename,
+    preallocateFiles ? maxSize : 0));
+  FileRotator::get()->add(nextFile);
+}
+
+void FileStore::abandonNextFile() {
+  if (nextFile) {
+    nextFile->abandon();
+    nextFile.reset();
   }
 }
 
 void FileStore::flush() {
   if (writeFile) {
     writeFile->flush();
+    applySyncPolicy(true);
+  }
+}
+
+bool FileStore::syncFile(shared_ptr<FileInterface> file) {
+  uint64_t start = monotonicMicros();
+  if (!file->sync()) {
+    LOG_OPER("[%s] Failed to sync file to disk", categoryHandled.c_str());
+    setStatus("File sync error");
+    return false;
+  }
+  syncLatency.recordSince(start);
+  return true;
+}
+
+// Called after writing to writeFile, and again with end_of_batch once the
+// batch has been flushed
+void FileStore::applySyncPolicy(bool end_of_batch) {
+  if (!unsyncedBytes || !writeFile->isOpen()) {
+    return;
+  }
+
+  switch (fsyncPolicy) {
+    case FSYNC_NEVER:
+      return;
+    case FSYNC_BATCH:
+      if (!end_of_batch) {
+        return;
+      }
+      break;
+    case FSYNC_BYTES:
+      if (unsyncedBytes < fsyncBytes) {
+        return;
+      }
+      break;
+    case FSYNC_INTERVAL:
+      if (!end_of_batch) {
+        return;
+      }
+      // without the sync thread, sync every batch instead
+      if (syncHandle >= 0) {
+        FileSyncer::get()->dirty(syncHandle);
+        unsyncedBytes = 0;
+        return;
+      }
+      break;
   }
+
+  syncFile(writeFile);
+  unsyncedBytes = 0;
+}
+
+void FileStore::closeWriteFile() {
+  bool dirty = unsyncedBytes > 0;
+  if (syncHandle >= 0) {
+    FileSyncer::get()->remove(syncHandle);
+    syncHandle = -1;
+    // the sync thread may not have got to the last writes
+    dirty = true;
+  }
+  if (fsyncPolicy != FSYNC_NEVER && dirty && writeFile->isOpen()) {
+    syncFile(writeFile);
+  }
+  unsyncedBytes = 0;
+  writeFile->close();
 }
 
 shared_ptr<Store> FileStore::copy(const std::string &category) {
@@ -204,6 +455,16 @@ shared_ptr<Store> FileStore::copy(const std::string &category) {
   shared_ptr<Store> copied = shared_ptr<Store>(store);
 
   store->addNewlines = addNewlines;
+  store->directIo = directIo;
+  store->compression = compression;
+  store->compressionLevel = compressionLevel;
+  store->frameVersion = frameVersion;
+  store->fsyncPolicy = fsyncPolicy;
+  store->fsyncIntervalMs = fsyncIntervalMs;
+  store->fsyncBytes = fsyncBytes;
+  store->preallocateFiles = preallocateFiles;
+  store->replayChunkSize = replayChunkSize;
+  store->replayChunkMessages = replayChunkMessages;
   store->copyCommon(this);
   return copied;
 }
@@ -222,12 +483,17 @@ bool FileStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
 // writes messages to either the specified file or the the current writeFile
 bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
                               boost::shared_ptr<FileInterface> file) {
-  // Data is written to a buffer first, then sent to disk in one call to write.
-  // This costs an extra copy of the data, but dramatically improves latency with
-  // network based files. (nfs, etc)
-  string        write_buffer;
+  // Messages are gathered into a list of segments pointing at the frames and
+  // the message data, then sent to disk in one call to writeSegments. Files
+  // that can do scatter writes use them directly; the rest copy the segments
+  // into one buffer, which still dramatically improves latency with network
+  // based files. (nfs, etc)
+  write_segments_t segments;
+  deque<string> frames;  // deque so the strings don't move as it grows
+  vector<unsigned long> message_ends; // where each buffered message ends
+  static const char newline = '\n';
   bool          success = true;
-  unsigned long current_size_buffered = 0; // size of data in write_buffer
+  unsigned long current_size_buffered = 0; // size of data in segments
   unsigned long num_buffered = 0;
   unsigned long num_written = 0;
   boost::shared_ptr<FileInterface> write_file;
@@ -240,6 +506,11 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
     write_file = writeFile;
   }
 
+  // padding points into this, so it has to be big enough before we start
+  if (zeroPadding.size() < chunkSize) {
+    zeroPadding.assign(chunkSize, 0);
+  }
+
   try {
     for (logentry_vector_t::iterator iter = messages->begin();
          iter != messages->end();
@@ -249,7 +520,8 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       // the frame, then bytesToPad wants the length of the frame and the message.
       unsigned long length = 0;
       unsigned long message_length = (*iter)->message.length();
-      string frame, category_frame;
+      unsigned long category_length = 0;
+      const string* category_frame = NULL;
 
       if (addNewlines) {
         ++message_length;
@@ -259,15 +531,17 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
 
       if (writeCategory) {
         //add space for category+newline and category frame
-        unsigned long category_length = (*iter)->category.length() + 1;
+        category_length = (*iter)->category.length() + 1;
         length += category_length;
 
-        category_frame = write_file->getFrame(category_length);
-        length += category_frame.length();
+        frames.push_back(write_file->getFrame(category_length));
+        category_frame = &frames.back();
+        length += category_frame->length();
       }
 
       // frame is a header that the underlying file class can add to each message
-      frame = write_file->getFrame(message_length);
+      frames.push_back(write_file->getFrame(message_length));
+      const string& frame = frames.back();
 
       length += frame.length();
 
@@ -277,40 +551,68 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
       length += padding;
 
       if (padding) {
-        write_buffer += string(padding, 0);
+        addSegment(segments, zeroPadding.data(), padding);
       }
 
       if (writeCategory) {
-        write_buffer += category_frame;
-        write_buffer += (*iter)->category + "\n";
+        addSegment(segments, category_frame->data(), category_frame->length());
+        addSegment(segments, (*iter)->category.data(), category_length - 1);
+        addSegment(segments, &newline, 1);
       }
 
-      write_buffer += frame;
-      write_buffer += (*iter)->message;
+      addSegment(segments, frame.data(), frame.length());
+      addSegment(segments, (*iter)->message.data(), (*iter)->message.length());
 
       if (addNewlines) {
-        write_buffer += "\n";
+        addSegment(segments, &newline, 1);
       }
 
       current_size_buffered += length;
       num_buffered++;
+      message_ends.push_back(current_size_buffered);
 
       // Write buffer if processing last message or if larger than allowed
       if ((currentSize + current_size_buffered > max_write_size && maxSize != 0) ||
           messages->end() == iter + 1 ) {
-        if (!write_file->write(write_buffer)) {
-          LOG_OPER("[%s] File store failed to write (%lu) messages to file",
-                   categoryHandled.c_str(), messages->size());
+        unsigned long written = 0;
+        unsigned long file_bytes = 0;
+        unsigned long records = writeCategory ? 2 * num_buffered
+                                              : num_buffered;
+        bool written_ok = writeBatch(write_file, segments, records, written,
+                                     file_bytes);
+        if (!file) {
+          unsyncedBytes += file_bytes;
+        }
+        if (!written_ok) {
+          // count the messages that made it all the way to the file
+          unsigned long num_complete = 0;
+          while (num_complete < message_ends.size() &&
+                 message_ends[num_complete] <= written) {
+            ++num_complete;
+          }
+          num_written += num_complete;
+          currentSize += file_bytes;
+
+          LOG_OPER("[%s] File store failed to write (%lu) messages to file, "
+                   "(%lu) bytes written",
+                   categoryHandled.c_str(), messages->size() - num_written,
+                   written);
           setStatus("File write error");
           success = false;
           break;
         }
 
         num_written += num_buffered;
-        currentSize += current_size_buffered;
+        currentSize += file_bytes;
         num_buffered = 0;
         current_size_buffered = 0;
-        write_buffer = "";
+        segments.clear();
+        frames.clear();
+        message_ends.clear();
+
+        if (!file) {
+          applySyncPolicy(false);
+        }
       }
 
       // rotate file if large enough and not writing to a separate file
@@ -339,15 +641,101 @@ bool FileStore::writeMessages(boost::shared_ptr<logentry_vector_t> messages,
   return success;
 }
 
+// Writes one batch of records messages. Compressed or in a checksummed
+// batch, it can't be read unless it's whole, so nothing was written unless
+// all of it was. file_bytes is how much the file grew.
+bool FileStore::writeBatch(shared_ptr<FileInterface> file,
+                           const write_segments_t& segments,
+                           unsigned long records, unsigned long& written,
+                           unsigned long& file_bytes) {
+  if (compression == COMPRESSION_NONE && frameVersion == 1) {
+    bool success = file->writeSegments(segments, written);
+    file_bytes = written;
+    return success;
+  }
+
+  written = 0;
+  file_bytes = 0;
+  unsigned long length = 0;
+  for (write_segments_t::const_iterator iter = segments.begin();
+       iter != segments.end();
+       ++iter) {
+    length += iter->iov_len;
+  }
+
+  write_segments_t block;
+  if (compression != COMPRESSION_NONE) {
+    uncompressed.clear();
+    for (write_segments_t::const_iterator iter = segments.begin();
+         iter != segments.end();
+         ++iter) {
+      uncompressed.append((const char*)iter->iov_base, iter->iov_len);
+    }
+
+    compressed.clear();
+    if (!compressBlock(compression, compressionLevel, uncompressed.data(),
+                       uncompressed.length(), compressed)) {
+      return false;
+    }
+    addSegment(block, compressed.data(), compressed.length());
+  } else {
+    block = segments;
+  }
+
+  if (frameVersion == BATCH_VERSION) {
+    unsigned char flags = compression != COMPRESSION_NONE ? BATCH_COMPRESSED
+                                                          : 0;
+    if (!makeBatchHeader(block, records, flags, batchHeader)) {
+      LOG_OPER("[%s] Batch of <%lu> bytes is too big for a batch header",
+               categoryHandled.c_str(), length);
+      return false;
+    }
+    struct iovec header;
+    header.iov_base = (void*)batchHeader.data();
+    header.iov_len = batchHeader.length();
+    block.insert(block.begin(), header);
+  }
+
+  if (!file->writeSegments(block, file_bytes)) {
+    return false;
+  }
+  written = length;
+  return true;
+}
+
+void FileStore::addSegment(write_segments_t& segments, const char* data,
+                           unsigned long length) {
+  if (length) {
+    struct iovec segment;
+    segment.iov_base = (void*)data;
+    segment.iov_len = length;
+    segments.push_back(segment);
+  }
+}
+
 void FileStore::deleteOldest(struct tm* now) {
 
-  int index = findOldestFile(makeBaseFilename(now));
+  if (replayFile) {
+    if (!replayDone) {
+      // only the chunk that was read is gone
+      saveCheckpoint(replayEnd, replayIndex + replayEnds.size());
+      replayFile->release(replayOffset.offset);
+      return;
+    }
+    // the checkpoint goes first, a file without one is just sent again
+    unlink(checkpointName(replayFilename).c_str());
+    resetReplay();
+  }
+
+  string base_filename = makeBaseFilename(now);
+  int index = findOldestFile(base_filename);
   if (index < 0) {
     return;
   }
   shared_ptr<FileInterface> deletefile = FileInterface::createFileInterface(fsType,
                                             makeFullFilename(index, now));
   deletefile->deleteFile();
+  unindexFile(base_filename, index);
 }
 
 // Replace the messages in the oldest file at this timestamp with the input messages
@@ -362,6 +750,17 @@ bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
 
   string filename = makeFullFilename(index, now);
 
+  // Only part of the last chunk read was sent, so move the checkpoint to
+  // just after that part. The messages left are the end of the chunk.
+  if (replayFile && replayFilename == filename &&
+      messages->size() <= replayEnds.size()) {
+    unsigned long sent = replayEnds.size() - messages->size();
+    file_position_t position = sent ? replayEnds[sent - 1] : replayOffset;
+    saveCheckpoint(position, replayIndex + sent);
+    replayDone = false;
+    return true;
+  }
+
   // Need to close and reopen store in case we already have this file open
   close();
 
@@ -372,6 +771,9 @@ bool FileStore::replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
   bool success;
   if (infile->openTruncate()) {
     success = writeMessages(messages, infile);
+    if (success && fsyncPolicy != FSYNC_NEVER) {
+      success = syncFile(infile);
+    }
 
   } else {
     LOG_OPER("[%s] Failed to open file <%s> for writing and truncate",
@@ -393,10 +795,94 @@ bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages
   if (index < 0) {
     // This isn't an error. It's legit to call readOldest when there aren't any
     // files left, in which case the call succeeds but returns messages empty.
+    resetReplay();
     return true;
   }
   std::string filename = makeFullFilename(index, now);
 
+  if (0 == fsType.compare("hdfs")) {
+    return readWholeFile(filename, messages);
+  }
+
+  if (!replayFile || replayFilename != filename) {
+    resetReplay();
+    shared_ptr<MappedFile> file(new MappedFile(filename, isBufferFile));
+    if (!file->open()) {
+      LOG_OPER("[%s] Failed to open file <%s> for reading", categoryHandled.c_str(), filename.c_str());
+      return false;
+    }
+    replayFile = file;
+    replayFilename = filename;
+    loadCheckpoint();
+  }
+
+  // Records are found in the mapping and only copied into messages, so
+  // reading a chunk never costs more memory than the chunk itself
+  file_position_t position = replayOffset;
+  unsigned long bytes = 0;
+  replayEnds.clear();
+  replayDone = false;
+  while ((!replayChunkSize || bytes < replayChunkSize) &&
+         (!replayChunkMessages || messages->size() < replayChunkMessages)) {
+    const char* data;
+    unsigned long length;
+    file_position_t next;
+    if (!replayFile->record(position, data, length, next)) {
+      // the file may still be written to while it's being sent
+      if (replayFile->remap()) {
+        continue;
+      }
+      replayDone = true;
+      break;
+    }
+
+    if (length) {
+      logentry_ptr_t entry = logentry_ptr_t(new LogEntry);
+
+      // check whether a category is stored with the message
+      if (writeCategory) {
+        // get category without trailing \n
+        entry->category.assign(data, length - 1);
+        bytes += length;
+
+        if (!replayFile->record(next, data, length, next)) {
+          if (replayFile->remap()) {
+            continue;
+          }
+          LOG_OPER("[%s] category not stored with message <%s>",
+                   categoryHandled.c_str(), entry->category.c_str());
+          replayDone = true;
+          break;
+        }
+      } else {
+        entry->category = categoryHandled;
+      }
+
+      entry->message.assign(data, length);
+      bytes += length;
+
+      messages->push_back(entry);
+      replayEnds.push_back(next);
+    }
+    position = next;
+  }
+  replayEnd = position;
+
+  if (replayDone) {
+    LOG_OPER("[%s] successfully read <%lu> entries from file <%s>",
+          categoryHandled.c_str(), replayIndex + messages->size(),
+          filename.c_str());
+  }
+  return true;
+}
+
+bool FileStore::readingOldest() {
+  return replayFile && !replayDone;
+}
+
+bool FileStore::readWholeFile(const std::string& filename,
+                              boost::shared_ptr<logentry_vector_t> messages) {
+
   shared_ptr<FileInterface> infile = FileInterface::createFileInterface(fsType, filename, isBufferFile);
 
   if (!infile->openRead()) {
@@ -434,23 +920,89 @@ bool FileStore::readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages
   return true;
 }
 
-bool FileStore::empty(struct tm* now) {
+void FileStore::resetReplay() {
+  replayFile.reset();
+  replayFilename.clear();
+  replayOffset = file_position_t();
+  replayIndex = 0;
+  replayEnd = file_position_t();
+  replayEnds.clear();
+  replayDone = false;
+}
 
-  std::vector<std::string> files = FileInterface::list(filePath, fsType);
+// beside the file it's for, named so it's never taken for one of the
+// store's files
+string FileStore::checkpointName(const string& filename) {
+  string::size_type slash = filename.rfind('/');
+  if (slash == string::npos) {
+    return "." + filename + ".checkpoint";
+  }
+  return filename.substr(0, slash + 1) + "." + filename.substr(slash + 1) +
+         ".checkpoint";
+}
 
-  std::string base_filename = makeBaseFilename(now);
-  for (std::vector<std::string>::iterator iter = files.begin();
-       iter != files.end();
-       ++iter) {
-    int suffix =  getFileSuffix(*iter, base_filename);
-    if (-1 != suffix) {
-      std::string fullname = makeFullFilename(suffix, now);
-      shared_ptr<FileInterface> file = FileInterface::createFileInterface(fsType, fullname);
-      if (file->fileSize()) {
-        return false;
-      }
-    } // else it doesn't match the filename for this store
+// Starts replayFile where the last run stopped, if it has a checkpoint
+void FileStore::loadCheckpoint() {
+  string name = checkpointName(replayFilename);
+  ifstream checkpoint(name.c_str());
+  if (!checkpoint.is_open()) {
+    return;
   }
-  return true;
+
+  file_position_t position;
+  unsigned long index = 0;
+  checkpoint >> position.offset >> index;
+  if (!checkpoint.fail()) {
+    // only there if the file is compressed
+    checkpoint >> position.skip;
+    checkpoint.clear();
+  }
+  if (checkpoint.fail() || position.offset > replayFile->size()) {
+    LOG_OPER("[%s] Ignoring bad checkpoint <%s>, sending all of <%s>",
+             categoryHandled.c_str(), name.c_str(), replayFilename.c_str());
+    return;
+  }
+
+  LOG_OPER("[%s] Resuming <%s> at message <%lu>, offset <%lu>",
+           categoryHandled.c_str(), replayFilename.c_str(), index,
+           position.offset);
+  replayOffset = position;
+  replayIndex = index;
+  replayFile->release(replayOffset.offset);
+}
+
+// Records that everything before position, index messages, has been sent.
+// Written to the side and renamed so a crash leaves the old or the new one.
+// If it can't be written we still carry on from position, but a restart
+// will send some of the file again.
+void FileStore::saveCheckpoint(const file_position_t& position,
+                               unsigned long index) {
+  replayOffset = position;
+  replayIndex = index;
+
+  string name = checkpointName(replayFilename);
+  string tmp_name = name + ".tmp";
+  {
+    ofstream checkpoint(tmp_name.c_str(), ios_base::out | ios_base::trunc);
+    checkpoint << position.offset << ' ' << index;
+    if (position.skip) {
+      checkpoint << ' ' << position.skip;
+    }
+    checkpoint << '\n';
+    checkpoint.close();
+    if (checkpoint.fail()) {
+      LOG_OPER("[%s] Failed to write checkpoint <%s>",
+               categoryHandled.c_str(), tmp_name.c_str());
+      return;
+    }
+  }
+  if (0 != rename(tmp_name.c_str(), name.c_str())) {
+    LOG_OPER("[%s] Failed to rename <%s> to <%s>: %s", categoryHandled.c_str(),
+             tmp_name.c_str(), name.c_str(), strerror(errno));
+  }
+}
+
+bool FileStore::empty(struct tm* now) {
+  return indexedFilesEmpty(makeBaseFilename(now));
 }
 
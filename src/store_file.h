@@ -32,6 +32,18 @@
 #include "file.h"
 #include "conn_pool.h"
 #include "store_filebase.h"
+#include "mapped_file.h"
+#include "compression.h"
+#include "stats.h"
+#include "file_rotate.h"
+
+// When a file store waits for what it wrote to be on disk
+enum fsync_policy_t {
+  FSYNC_NEVER,     // leave it to the page cache
+  FSYNC_BATCH,     // after every batch
+  FSYNC_INTERVAL,  // every fsync_interval_ms, from the shared sync thread
+  FSYNC_BYTES      // once fsync_bytes have been written since the last sync
+};
 
 /*
  * This file-based store uses an instance of a FileInterface class that
@@ -52,27 +64,89 @@ class FileStore : public FileStoreBase {
   void close();
   void flush();
 
-  // Each read does its own open and close and gets the whole file.
-  // This is separate from the write file, and not really a consistent interface.
+  // Reads are separate from the write file. Local files are mapped and read
+  // a chunk at a time (replay_chunk_size bytes or replay_chunk_messages
+  // messages), and deleteOldest drops just the chunk that was read until
+  // the file runs out. How far a file has been sent is kept in a checkpoint
+  // file beside it, so replaceOldest only has to move the checkpoint, and
+  // a restart carries on where it left off. Other files are read whole.
   bool readOldest(/*out*/ boost::shared_ptr<logentry_vector_t> messages,
                   struct tm* now);
   virtual bool replaceOldest(boost::shared_ptr<logentry_vector_t> messages,
                              struct tm* now);
   void deleteOldest(struct tm* now);
+  bool readingOldest();
   bool empty(struct tm* now);
 
+  // fsync=interval syncs from a thread shared by every file store, and
+  // syncs files on the same filesystem together (see file_sync.h). Any
+  // fsync policy also syncs a file before closing it.
+  //
+  // With async_rotate=yes the next file is opened by the rotation thread
+  // (see file_rotate.h) while this one is written, so rotating is mostly a
+  // rename, and the symlink and scribe_stats are updated there too. With
+  // preallocate=yes each new file gets max_size bytes reserved up front.
+
  protected:
   // Implement FileStoreBase virtual function
   bool openInternal(bool incrementFilename, struct tm* current_time);
   bool writeMessages(boost::shared_ptr<logentry_vector_t> messages,
                      boost::shared_ptr<FileInterface> write_file =
                      boost::shared_ptr<FileInterface>());
+  static void addSegment(write_segments_t& segments, const char* data,
+                         unsigned long length);
+  bool writeBatch(boost::shared_ptr<FileInterface> file,
+                  const write_segments_t& segments, unsigned long records,
+                  unsigned long& written, unsigned long& file_bytes);
+  bool readWholeFile(const std::string& filename,
+                     boost::shared_ptr<logentry_vector_t> messages);
+  void resetReplay();
+  std::string checkpointName(const std::string& filename);
+  void loadCheckpoint();
+  void saveCheckpoint(const file_position_t& position, unsigned long index);
+  bool syncFile(boost::shared_ptr<FileInterface> file);
+  boost::shared_ptr<FileInterface> createWriteFile(const std::string& filename);
+  void preopenNextFile(const std::string& filename);
+  void abandonNextFile();
+  void applySyncPolicy(bool end_of_batch);
+  void closeWriteFile();
 
   bool isBufferFile;
   bool addNewlines;
+  bool directIo;
+  compression_t compression;
+  unsigned long compressionLevel;
+  unsigned long frameVersion;  // of buffer files, see frame_batch.h
+  fsync_policy_t fsyncPolicy;
+  unsigned long fsyncIntervalMs;
+  unsigned long fsyncBytes;
+  bool preallocateFiles;
+  unsigned long replayChunkSize;      // bytes per readOldest, 0 for no limit
+  unsigned long replayChunkMessages;  // messages per readOldest, 0 for no limit
 
   // State
   boost::shared_ptr<FileInterface> writeFile;
+  unsigned long unsyncedBytes;  // written to writeFile since it was synced
+  int syncHandle;               // writeFile's FileSyncer handle, -1 for none
+  StageLatency syncLatency;
+  boost::shared_ptr<PreopenedFile> nextFile;  // being opened in the background
+
+  // chunk_size bytes of zeros for padding to point at
+  std::string zeroPadding;
+
+  // the batch being written, its compressed block, and its header
+  std::string uncompressed;
+  std::string compressed;
+  std::string batchHeader;
+
+  // the oldest file while it's being read in chunks
+  boost::shared_ptr<MappedFile> replayFile;
+  std::string replayFilename;
+  file_position_t replayOffset; // everything before this has been sent
+  unsigned long replayIndex;    // messages sent from the file so far
+  file_position_t replayEnd;    // end of what the last readOldest returned
+  std::vector<file_position_t> replayEnds;  // and where each message ended
+  bool replayDone;              // and that was the end of the file
 
  private:
   // disallow copy, assignment, and empty construction
@@ -23,9 +23,13 @@
 // @author Anthony Giardullo
 // @author Jan Oravec
 
+#include <limits.h>
+#include <sys/inotify.h>
+
 #include "common.h"
 #include "store.h"
 #include "store_filebase.h"
+#include "file_rotate.h"
 
 using namespace std;
 using namespace boost;
@@ -36,6 +40,10 @@ using namespace boost::filesystem;
 #define DEFAULT_FILESTORE_ROLL_HOUR              1
 #define DEFAULT_FILESTORE_ROLL_MINUTE            15
 
+// size of an indexed file that hasn't been looked at yet
+#define FILE_SIZE_UNKNOWN ((unsigned long)-1)
+#define INOTIFY_BUFFER_SIZE 65536
+
 FileStoreBase::FileStoreBase(const string& category, const string &type,
                              bool multi_category, const string& trigger_path)
   : Store(category, type, multi_category, trigger_path),
@@ -44,6 +52,7 @@ FileStoreBase::FileStoreBase(const string& category, const string &type,
     filePath("/tmp"),
     baseFileName(category),
     baseSymlinkName(""),
+    shardSuffix(""),
     maxSize(DEFAULT_FILESTORE_MAX_SIZE),
     maxWriteSize(DEFAULT_FILESTORE_MAX_WRITE_SIZE),
     rollPeriod(ROLL_NEVER),
@@ -56,12 +65,18 @@ FileStoreBase::FileStoreBase(const string& category, const string &type,
     writeCategory(false),
     createSymlink(true),
     writeStats(false),
+    watchDirectory(false),
+    asyncRotate(false),
     currentSize(0),
     lastRollTime(0),
-    eventsWritten(0) {
+    eventsWritten(0),
+    openSuffix(-1),
+    watchFd(-1),
+    watchDescriptor(-1) {
 }
 
 FileStoreBase::~FileStoreBase() {
+  stopWatch();
 }
 
 void FileStoreBase::configure(pStoreConf configuration) {
@@ -163,11 +178,33 @@ void FileStoreBase::configure(pStoreConf configuration) {
 
   configuration->getString("fs_type", fsType);
 
+  if (configuration->getString("watch_directory", tmp)) {
+    watchDirectory = (0 == tmp.compare("yes"));
+    if (watchDirectory && fsType != "std" && fsType != "posix" &&
+        fsType != "uring") {
+      LOG_OPER("[%s] Bad config - watch_directory only works with local "
+               "files, not fs_type <%s>", categoryHandled.c_str(),
+               fsType.c_str());
+      watchDirectory = false;
+    }
+  }
+  clearIndex();
+
+  if (configuration->getString("async_rotate", tmp)) {
+    asyncRotate = (0 == tmp.compare("yes"));
+  }
+
   configuration->getUnsigned("max_size", maxSize);
   configuration->getUnsigned("max_write_size", maxWriteSize);
   configuration->getUnsigned("rotate_hour", rollHour);
   configuration->getUnsigned("rotate_minute", rollMinute);
   configuration->getUnsigned("chunk_size", chunkSize);
+
+  // set by StoreQueue on every store of a category with num_shards, so
+  // each shard writes its own sequence of files
+  if (configuration->getString("shard", tmp)) {
+    shardSuffix = "-shard" + tmp;
+  }
 }
 
 void FileStoreBase::copyCommon(const FileStoreBase *base) {
@@ -184,7 +221,10 @@ void FileStoreBase::copyCommon(const FileStoreBase *base) {
   writeCategory = base->writeCategory;
   createSymlink = base->createSymlink;
   baseSymlinkName = base->baseSymlinkName;
+  shardSuffix = base->shardSuffix;
   writeStats = base->writeStats;
+  watchDirectory = base->watchDirectory;
+  asyncRotate = base->asyncRotate;
 
   /*
    * append the category name to the base file path and change the
@@ -201,6 +241,7 @@ void FileStoreBase::copyCommon(const FileStoreBase *base) {
 }
 
 bool FileStoreBase::open() {
+  clearIndex();
   return openInternal(false, NULL);
 }
 
@@ -267,9 +308,9 @@ string FileStoreBase::makeFullFilename(int suffix, struct tm* creation_time,
 string FileStoreBase::makeBaseSymlink() {
   ostringstream base;
   if (!baseSymlinkName.empty()) {
-    base << baseSymlinkName << "_current";
+    base << baseSymlinkName << shardSuffix << "_current";
   } else {
-    base << baseFileName << "_current";
+    base << baseFileName << shardSuffix << "_current";
   }
   return base.str();
 }
@@ -283,7 +324,7 @@ string FileStoreBase::makeFullSymlink() {
 string FileStoreBase::makeBaseFilename(struct tm* creation_time) {
   ostringstream filename;
 
-  filename << baseFileName;
+  filename << baseFileName << shardSuffix;
   if (rollPeriod != ROLL_NEVER) {
     filename << '-' << creation_time->tm_year + 1900  << '-'
              << setw(2) << setfill('0') << creation_time->tm_mon + 1 << '-'
@@ -295,56 +336,219 @@ string FileStoreBase::makeBaseFilename(struct tm* creation_time) {
 
 // returns the suffix of the newest file matching base_filename
 int FileStoreBase::findNewestFile(const string& base_filename) {
+  file_sizes_t& files = indexedFiles(base_filename);
+  return files.empty() ? -1 : files.rbegin()->first;
+}
 
-  std::vector<std::string> files = FileInterface::list(filePath, fsType);
+int FileStoreBase::findOldestFile(const string& base_filename) {
+  file_sizes_t& files = indexedFiles(base_filename);
+  return files.empty() ? -1 : files.begin()->first;
+}
 
-  int max_suffix = -1;
-  std::string retval;
-  for (std::vector<std::string>::iterator iter = files.begin();
-       iter != files.end();
-       ++iter) {
+// Only names that end in digits have a suffix, so the symlink (_current)
+// and files beside ours (_00001.checkpoint) don't count
+int FileStoreBase::getFileSuffix(const string& filename, const string& base_filename) {
+  string::size_type suffix_pos = filename.rfind('_');
+  if (string::npos == suffix_pos ||
+      suffix_pos + 1 == filename.length() ||
+      0 != filename.compare(0, suffix_pos, base_filename) ||
+      suffix_pos != base_filename.length()) {
+    return -1;
+  }
+
+  const char* digits = filename.c_str() + suffix_pos + 1;
+  char* end;
+  errno = 0;
+  long suffix = strtol(digits, &end, 10);
+  if (*end != '\0' || !isdigit(*digits) || errno != 0 || suffix > INT_MAX) {
+    return -1;
+  }
+  return (int)suffix;
+}
 
+FileStoreBase::file_sizes_t&
+FileStoreBase::indexedFiles(const string& base_filename) {
+  readWatchEvents();
+
+  map<string, file_sizes_t>::iterator found = fileIndex.find(base_filename);
+  if (found != fileIndex.end()) {
+    return found->second;
+  }
+
+  // Watch before listing, so nothing can change in between unseen
+  startWatch();
+
+  file_sizes_t& files = fileIndex[base_filename];
+  vector<string> names = FileInterface::list(filePath, fsType);
+  for (vector<string>::iterator iter = names.begin();
+       iter != names.end();
+       ++iter) {
     int suffix = getFileSuffix(*iter, base_filename);
-    if (suffix > max_suffix) {
-      max_suffix = suffix;
+    if (suffix >= 0) {
+      files[suffix] = FILE_SIZE_UNKNOWN;
     }
   }
-  return max_suffix;
+  return files;
 }
 
-int FileStoreBase::findOldestFile(const string& base_filename) {
+void FileStoreBase::indexOpenedFile(const string& base_filename, int suffix) {
+  // the directory may only just have been created
+  if (watchDirectory && watchDescriptor < 0 && startWatch()) {
+    clearIndex();
+  }
 
-  std::vector<std::string> files = FileInterface::list(filePath, fsType);
+  // the last file has to be looked at again to know its size
+  map<string, file_sizes_t>::iterator previous =
+    fileIndex.find(openBaseFilename);
+  if (previous != fileIndex.end() &&
+      previous->second.find(openSuffix) != previous->second.end()) {
+    previous->second[openSuffix] = FILE_SIZE_UNKNOWN;
+  }
+
+  indexedFiles(base_filename)[suffix] = currentSize;
+  openBaseFilename = base_filename;
+  openSuffix = suffix;
+}
 
-  int min_suffix = -1;
-  std::string retval;
-  for (std::vector<std::string>::iterator iter = files.begin();
+void FileStoreBase::unindexFile(const string& base_filename, int suffix) {
+  map<string, file_sizes_t>::iterator found = fileIndex.find(base_filename);
+  if (found != fileIndex.end()) {
+    found->second.erase(suffix);
+  }
+}
+
+bool FileStoreBase::indexedFilesEmpty(const string& base_filename) {
+  file_sizes_t& files = indexedFiles(base_filename);
+  for (file_sizes_t::iterator iter = files.begin();
        iter != files.end();
        ++iter) {
+    if (base_filename == openBaseFilename && iter->first == openSuffix) {
+      if (currentSize) {
+        return false;
+      }
+      continue;
+    }
 
-    int suffix = getFileSuffix(*iter, base_filename);
-    if (suffix >= 0 &&
-        (min_suffix == -1 || suffix < min_suffix)) {
-      min_suffix = suffix;
+    if (iter->second == FILE_SIZE_UNKNOWN) {
+      shared_ptr<FileInterface> file = FileInterface::createFileInterface(
+        fsType, indexedFilename(base_filename, iter->first));
+      iter->second = file->fileSize();
+    }
+    if (iter->second) {
+      return false;
     }
   }
-  return min_suffix;
+  return true;
 }
 
-int FileStoreBase::getFileSuffix(const string& filename, const string& base_filename) {
-  int suffix = -1;
-  string::size_type suffix_pos = filename.rfind('_');
+void FileStoreBase::clearIndex() {
+  fileIndex.clear();
+}
+
+string FileStoreBase::indexedFilename(const string& base_filename,
+                                      int suffix) {
+  ostringstream filename;
+  filename << filePath << '/' << base_filename << '_'
+           << setw(5) << setfill('0') << suffix;
+  return filename.str();
+}
+
+// Returns true if the watch was started by this call
+bool FileStoreBase::startWatch() {
+  if (!watchDirectory || watchDescriptor >= 0) {
+    return false;
+  }
+
+  if (watchFd < 0) {
+    watchFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watchFd < 0) {
+      LOG_OPER("[%s] Failed to watch <%s>, only this store's own changes "
+               "will be seen: %s", categoryHandled.c_str(), filePath.c_str(),
+               strerror(errno));
+      watchDirectory = false;
+      return false;
+    }
+  }
+
+  watchDescriptor = inotify_add_watch(watchFd, filePath.c_str(),
+                                      IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                      IN_MOVED_TO | IN_CLOSE_WRITE |
+                                      IN_DELETE_SELF | IN_MOVE_SELF);
+  // a directory that doesn't exist yet is watched once it's created
+  if (watchDescriptor < 0 && errno != ENOENT) {
+    LOG_OPER("[%s] Failed to watch <%s>: %s", categoryHandled.c_str(),
+             filePath.c_str(), strerror(errno));
+  }
+  return watchDescriptor >= 0;
+}
+
+void FileStoreBase::stopWatch() {
+  if (watchFd >= 0) {
+    ::close(watchFd);
+    watchFd = -1;
+    watchDescriptor = -1;
+  }
+}
+
+void FileStoreBase::readWatchEvents() {
+  if (watchDescriptor < 0) {
+    return;
+  }
 
-  bool retVal = (0 == filename.substr(0, suffix_pos).compare(base_filename));
+  char buffer[INOTIFY_BUFFER_SIZE]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  while (true) {
+    ssize_t length = read(watchFd, buffer, sizeof(buffer));
+    if (length <= 0) {
+      if (length < 0 && errno != EAGAIN && errno != EINTR) {
+        LOG_OPER("[%s] Failed to read changes to <%s>: %s",
+                 categoryHandled.c_str(), filePath.c_str(), strerror(errno));
+      }
+      return;
+    }
 
-  if (string::npos != suffix_pos &&
-      filename.length() > suffix_pos &&
-      retVal) {
-    stringstream stream;
-    stream << filename.substr(suffix_pos + 1);
-    stream >> suffix;
+    for (char* next = buffer; next < buffer + length; ) {
+      struct inotify_event* event = (struct inotify_event*)next;
+      next += sizeof(struct inotify_event) + event->len;
+      applyWatchEvent(event->mask, event->len ? event->name : "");
+    }
+  }
+}
+
+// The store's own changes come back as events too, but applying them again
+// leaves the index the same
+void FileStoreBase::applyWatchEvent(unsigned mask, const string& name) {
+  if (mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+    if (watchDescriptor < 0) {
+      return;
+    }
+    // lost track, start over from the directory
+    LOG_OPER("[%s] Lost track of changes to <%s>, listing it again",
+             categoryHandled.c_str(), filePath.c_str());
+    if (mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+      inotify_rm_watch(watchFd, watchDescriptor);
+      watchDescriptor = -1;
+    }
+    clearIndex();
+    return;
+  }
+
+  for (map<string, file_sizes_t>::iterator iter = fileIndex.begin();
+       iter != fileIndex.end();
+       ++iter) {
+    int suffix = getFileSuffix(name, iter->first);
+    if (suffix < 0) {
+      continue;
+    }
+    if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+      iter->second.erase(suffix);
+    } else if (mask & (IN_CREATE | IN_MOVED_TO)) {
+      iter->second.insert(make_pair(suffix, FILE_SIZE_UNKNOWN));
+    } else if ((mask & IN_CLOSE_WRITE) &&
+               iter->second.find(suffix) != iter->second.end()) {
+      iter->second[suffix] = FILE_SIZE_UNKNOWN;
+    }
   }
-  return suffix;
 }
 
 void FileStoreBase::printStats() {
@@ -355,16 +559,6 @@ void FileStoreBase::printStats() {
   string filename(filePath);
   filename += "/scribe_stats";
 
-  boost::shared_ptr<FileInterface> stats_file = FileInterface::createFileInterface(fsType, filename);
-  if (!stats_file ||
-      !stats_file->createDirectory(filePath) ||
-      !stats_file->openWrite()) {
-    LOG_OPER("[%s] Failed to open stats file <%s> of type <%s> for writing",
-             categoryHandled.c_str(), filename.c_str(), fsType.c_str());
-    // This isn't enough of a problem to change our status
-    return;
-  }
-
   time_t rawtime = time(NULL);
   struct tm timeinfo;
   localtime_r(&rawtime, &timeinfo);
@@ -379,8 +573,14 @@ void FileStoreBase::printStats() {
   msg << " wrote <" << currentSize << "> bytes in <" << eventsWritten
       << "> events to file <" << currentFilename << ">" << endl;
 
-  stats_file->write(msg.str());
-  stats_file->close();
+  // Failing isn't enough of a problem to change our status
+  shared_ptr<RotationTask> task(
+    new AppendTask(fsType, filename, filePath, msg.str()));
+  if (asyncRotate) {
+    FileRotator::get()->add(task);
+  } else {
+    task->run();
+  }
 }
 
 // Returns the number of bytes to pad to align to the specified chunk size
@@ -82,12 +82,27 @@ class FileStoreBase : public Store {
                      const std::string& base_filename);
   void setHostNameSubDir();
 
+  // The store's files are listed once per base filename and then kept in
+  // an index as the store creates and deletes them, so finding the oldest
+  // or newest file doesn't read the directory. open() starts the index
+  // over. With watch_directory=yes, files other processes create or delete
+  // are picked up through inotify before every lookup.
+  typedef std::map<int, unsigned long> file_sizes_t;  // by suffix
+  file_sizes_t& indexedFiles(const std::string& base_filename);
+  // The store is now writing this file
+  void indexOpenedFile(const std::string& base_filename, int suffix);
+  void unindexFile(const std::string& base_filename, int suffix);
+  // true if every indexed file is empty
+  bool indexedFilesEmpty(const std::string& base_filename);
+  void clearIndex();
+
   // Configuration
   std::string baseFilePath;
   std::string subDirectory;
   std::string filePath;
   std::string baseFileName;
   std::string baseSymlinkName;
+  std::string shardSuffix;     // "-shard<N>" if the category is sharded
   unsigned long maxSize;
   unsigned long maxWriteSize;
   roll_period_t rollPeriod;
@@ -100,6 +115,8 @@ class FileStoreBase : public Store {
   bool writeCategory;
   bool createSymlink;
   bool writeStats;
+  bool watchDirectory;
+  bool asyncRotate;            // leave the slow parts to the rotation thread
 
   // State
   unsigned long currentSize;
@@ -112,6 +129,18 @@ class FileStoreBase : public Store {
                                // necessarily the number of lines in the file
 
  private:
+  std::string indexedFilename(const std::string& base_filename, int suffix);
+  bool startWatch();
+  void stopWatch();
+  void readWatchEvents();
+  void applyWatchEvent(unsigned mask, const std::string& name);
+
+  std::map<std::string, file_sizes_t> fileIndex;  // by base filename
+  std::string openBaseFilename;  // the file being written, sized by
+  int openSuffix;                // currentSize rather than the index
+  int watchFd;                   // inotify, -1 when not watching
+  int watchDescriptor;
+
   // disallow copy, assignment, and empty construction
   FileStoreBase(FileStoreBase& rhs);
   FileStoreBase& operator=(FileStoreBase& rhs);
@@ -0,0 +1,273 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <algorithm>
+
+#include "common.h"
+#include "store_journal.h"
+
+using namespace std;
+using namespace boost;
+using namespace scribe::thrift;
+
+#define JOURNAL_FIRST_SEQUENCE (1UL << 30)
+#define JOURNAL_LENGTH_SIZE    4
+
+StoreJournal::StoreJournal(const string& path_, const string& category_,
+                           unsigned long segment_size)
+  : path(path_),
+    category(category_),
+    segmentSize(segment_size),
+    size(0) {
+}
+
+StoreJournal::~StoreJournal() {
+  close();
+}
+
+string StoreJournal::segmentName(unsigned long sequence) {
+  ostringstream name;
+  name << path << '/' << category << ".journal." << sequence;
+  return name.str();
+}
+
+bool StoreJournal::open() {
+  close();
+  segments.clear();
+  segmentSizes.clear();
+  size = 0;
+
+  shared_ptr<FileInterface> dir = FileInterface::createFileInterface("std", path);
+  if (!dir || !dir->createDirectory(path)) {
+    LOG_OPER("[%s] Failed to create journal directory <%s>",
+             category.c_str(), path.c_str());
+    return false;
+  }
+
+  // pick up segments left over from the last run
+  string prefix = category + ".journal.";
+  vector<string> files = FileInterface::list(path, "std");
+  vector<unsigned long> found;
+  for (vector<string>::iterator iter = files.begin();
+       iter != files.end();
+       ++iter) {
+    if (iter->compare(0, prefix.size(), prefix) == 0 &&
+        iter->size() > prefix.size() &&
+        iter->find_first_not_of("0123456789", prefix.size()) == string::npos) {
+      found.push_back(strtoul(iter->c_str() + prefix.size(), NULL, 10));
+    }
+  }
+  sort(found.begin(), found.end());
+
+  for (vector<unsigned long>::iterator iter = found.begin();
+       iter != found.end();
+       ++iter) {
+    shared_ptr<FileInterface> file =
+      FileInterface::createFileInterface("std", segmentName(*iter), true);
+    unsigned long segment_size = file->fileSize();
+    segments.push_back(*iter);
+    segmentSizes.push_back(segment_size);
+    size += segment_size;
+  }
+
+  if (!segments.empty()) {
+    LOG_OPER("[%s] Found <%lu> journal segments with <%lu> bytes to replay",
+             category.c_str(), (unsigned long)segments.size(), size);
+  }
+  return true;
+}
+
+void StoreJournal::close() {
+  if (writeFile) {
+    writeFile->close();
+    writeFile.reset();
+  }
+}
+
+// Writes every message as one framed record, in a single write call
+bool StoreJournal::writeSegment(shared_ptr<FileInterface> file,
+                                shared_ptr<logentry_vector_t> messages,
+                                unsigned long& bytes) {
+  string buffer;
+  for (logentry_vector_t::iterator iter = messages->begin();
+       iter != messages->end();
+       ++iter) {
+    unsigned category_length = (*iter)->category.size();
+    unsigned record_length = JOURNAL_LENGTH_SIZE + category_length +
+                             (*iter)->message.size();
+    buffer += file->getFrame(record_length);
+    for (int i = 0; i < JOURNAL_LENGTH_SIZE; ++i) {
+      buffer += (char)((category_length >> (8 * i)) & 0xFF);
+    }
+    buffer += (*iter)->category;
+    buffer += (*iter)->message;
+  }
+
+  if (!file->write(buffer)) {
+    LOG_OPER("[%s] Failed to write <%lu> messages to journal",
+             category.c_str(), (unsigned long)messages->size());
+    return false;
+  }
+  file->flush();
+  bytes = buffer.size();
+  return true;
+}
+
+bool StoreJournal::append(shared_ptr<logentry_vector_t> messages) {
+  if (writeFile && segmentSizes.back() >= segmentSize) {
+    close();
+  }
+
+  if (!writeFile) {
+    unsigned long sequence =
+      segments.empty() ? JOURNAL_FIRST_SEQUENCE : segments.back() + 1;
+    writeFile = FileInterface::createFileInterface("std", segmentName(sequence),
+                                                   true);
+    if (!writeFile || !writeFile->openWrite()) {
+      LOG_OPER("[%s] Failed to open journal segment <%s>",
+               category.c_str(), segmentName(sequence).c_str());
+      writeFile.reset();
+      return false;
+    }
+    segments.push_back(sequence);
+    segmentSizes.push_back(0);
+  }
+
+  unsigned long bytes = 0;
+  if (!writeSegment(writeFile, messages, bytes)) {
+    // don't append after a partial write
+    close();
+    return false;
+  }
+  segmentSizes.back() += bytes;
+  size += bytes;
+  return true;
+}
+
+bool StoreJournal::prepend(shared_ptr<logentry_vector_t> messages) {
+  unsigned long sequence =
+    segments.empty() ? JOURNAL_FIRST_SEQUENCE : segments.front() - 1;
+  shared_ptr<FileInterface> file =
+    FileInterface::createFileInterface("std", segmentName(sequence), true);
+  // a new file, openTruncate doesn't work with fstreams in append mode
+  file->deleteFile();
+  if (!file->openWrite()) {
+    LOG_OPER("[%s] Failed to open journal segment <%s>",
+             category.c_str(), segmentName(sequence).c_str());
+    return false;
+  }
+
+  unsigned long bytes = 0;
+  bool success = writeSegment(file, messages, bytes);
+  file->close();
+  if (!success) {
+    file->deleteFile();
+    return false;
+  }
+
+  segments.push_front(sequence);
+  segmentSizes.push_front(bytes);
+  size += bytes;
+  return true;
+}
+
+bool StoreJournal::readOldest(shared_ptr<logentry_vector_t> messages) {
+  if (segments.empty()) {
+    return false;
+  }
+
+  // the oldest segment is finished once we start reading it
+  if (segments.size() == 1) {
+    close();
+  }
+
+  shared_ptr<FileInterface> file =
+    FileInterface::createFileInterface("std", segmentName(segments.front()),
+                                       true);
+  if (!file || !file->openRead()) {
+    LOG_OPER("[%s] Failed to open journal segment <%s> for reading",
+             category.c_str(), segmentName(segments.front()).c_str());
+    return false;
+  }
+
+  string record;
+  while (file->readNext(record)) {
+    if (record.size() < JOURNAL_LENGTH_SIZE) {
+      break;
+    }
+    unsigned category_length = 0;
+    for (int i = 0; i < JOURNAL_LENGTH_SIZE; ++i) {
+      category_length |= (unsigned char)record[i] << (8 * i);
+    }
+    if (JOURNAL_LENGTH_SIZE + category_length > record.size()) {
+      break;
+    }
+
+    logentry_ptr_t entry(new LogEntry);
+    entry->category = record.substr(JOURNAL_LENGTH_SIZE, category_length);
+    entry->message = record.substr(JOURNAL_LENGTH_SIZE + category_length);
+    messages->push_back(entry);
+  }
+  file->close();
+  return true;
+}
+
+void StoreJournal::deleteOldest() {
+  if (segments.empty()) {
+    return;
+  }
+
+  shared_ptr<FileInterface> file =
+    FileInterface::createFileInterface("std", segmentName(segments.front()),
+                                       true);
+  file->deleteFile();
+
+  size -= segmentSizes.front();
+  segments.pop_front();
+  segmentSizes.pop_front();
+}
+
+// Rewrites the oldest segment with only the given messages. The new copy
+// is renamed over the old one, so a crash leaves one or the other.
+bool StoreJournal::replaceOldest(shared_ptr<logentry_vector_t> messages) {
+  if (segments.empty()) {
+    return false;
+  }
+
+  string name = segmentName(segments.front());
+  string temp_name = name + ".tmp";
+  shared_ptr<FileInterface> file =
+    FileInterface::createFileInterface("std", temp_name, true);
+  file->deleteFile();
+  if (!file->openWrite()) {
+    LOG_OPER("[%s] Failed to open journal segment <%s>",
+             category.c_str(), temp_name.c_str());
+    return false;
+  }
+
+  unsigned long bytes = 0;
+  bool success = writeSegment(file, messages, bytes);
+  file->close();
+  if (!success || !file->rename(name)) {
+    file->deleteFile();
+    return false;
+  }
+
+  size = size - segmentSizes.front() + bytes;
+  segmentSizes.front() = bytes;
+  return true;
+}
@@ -0,0 +1,92 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_STORE_JOURNAL_H
+#define SCRIBE_STORE_JOURNAL_H
+
+#include <deque>
+#include <string>
+
+#include "common.h"
+#include "file.h"
+
+/*
+ * Overflow journal for a StoreQueue. When the queue holds more than
+ * journal_watermark bytes because its store is failing, further messages
+ * are appended here instead, and read back in order once the store
+ * recovers. It works the same for every store type.
+ *
+ * The journal is a directory of segment files named
+ * <category>.journal.<sequence>, each holding at most about segment_size
+ * bytes. Every message is one framed record of the category length, the
+ * category, and the message. Segments are read back whole, oldest first,
+ * so a segment is the unit of replay. Segments left over from a previous
+ * run are found by open() and replayed like any others.
+ *
+ * Only the store thread uses a journal, so there is no locking.
+ */
+class StoreJournal {
+ public:
+  StoreJournal(const std::string& path, const std::string& category,
+               unsigned long segment_size);
+  virtual ~StoreJournal();
+
+  bool open();
+  void close();
+
+  // Adds messages after everything already in the journal
+  bool append(boost::shared_ptr<logentry_vector_t> messages);
+
+  // Adds messages before everything already in the journal, for messages
+  // that were older than the journal but still in memory at shutdown
+  bool prepend(boost::shared_ptr<logentry_vector_t> messages);
+
+  // Reads the oldest segment. It stays in the journal until deleteOldest,
+  // or until replaceOldest swaps in the messages the store didn't take.
+  bool readOldest(boost::shared_ptr<logentry_vector_t> messages);
+  void deleteOldest();
+  bool replaceOldest(boost::shared_ptr<logentry_vector_t> messages);
+
+  bool empty() { return segments.empty(); }
+  unsigned long getSize() { return size; } // in bytes, on disk
+
+ private:
+  std::string segmentName(unsigned long sequence);
+  bool writeSegment(boost::shared_ptr<FileInterface> file,
+                    boost::shared_ptr<logentry_vector_t> messages,
+                    unsigned long& bytes);
+
+  std::string path;
+  std::string category;
+  unsigned long segmentSize;
+
+  // Sequence numbers of the segments on disk, oldest first. A fresh journal
+  // starts numbering in the middle of the range so prepend has room.
+  std::deque<unsigned long> segments;
+  std::deque<unsigned long> segmentSizes;
+  unsigned long size;
+
+  // the newest segment, while we are still appending to it
+  boost::shared_ptr<FileInterface> writeFile;
+
+  // disallow copy, assignment, and empty construction
+  StoreJournal();
+  StoreJournal(const StoreJournal& rhs);
+  StoreJournal& operator=(const StoreJournal& rhs);
+};
+
+#endif // SCRIBE_STORE_JOURNAL_H
@@ -31,6 +31,8 @@
 using namespace std;
 using namespace boost;
 
+static StatCounter statIgnored("ignored");
+
 NullStore::NullStore(const std::string& category, bool multi_category,
                      const string& trigger_path)
   : Store(category, "null", multi_category, trigger_path)
@@ -60,7 +62,7 @@ void NullStore::close() {
 }
 
 bool NullStore::handleMessages(boost::shared_ptr<logentry_vector_t> messages) {
-  g_Handler->incrementCounter("ignored", messages->size());
+  statIgnored.increment(messages->size());
   return true;
 }
 
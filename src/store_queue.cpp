@@ -20,35 +20,109 @@
 // @author Jason Sobel
 // @author Anthony Giardullo
 
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/futex.h>
+
 #include "common.h"
 #include "scribe_server.h"
+#include "store_journal.h"
+#include "store_scheduler.h"
+#include "thread_placement.h"
 
 using namespace std;
 using namespace boost;
 using namespace scribe::thrift;
 
 #define DEFAULT_TARGET_WRITE_SIZE  16384
-#define DEFAULT_MAX_WRITE_INTERVAL 10
+#define DEFAULT_MAX_WRITE_INTERVAL 10 // in seconds
+#define DEFAULT_MIN_WRITE_SIZE     4096
+#define DEFAULT_MAX_WRITE_SIZE     4194304
+#define DEFAULT_TARGET_WRITE_LATENCY 100 // in milliseconds
+#define DEFAULT_MIN_RETRY_BACKOFF  1000  // in milliseconds
+#define DEFAULT_MAX_RETRY_BACKOFF  60000 // in milliseconds
+#define DEFAULT_JOURNAL_WATERMARK  67108864 // in bytes
+#define DEFAULT_JOURNAL_SEGMENT_SIZE 16777216 // in bytes
+#define DEFAULT_SHARD_KEY_DELIMITER '\t'
+#define LOW_PRIORITY_NICE          10
+
+static StatCounter statRequeue("requeue");
+static StatCounter statLost("lost");
+static StatCounter statRetry("batch retries");
+static StatCounter statSpilled("spilled");
+static StatCounter statJournaled("journaled");
+static StatCounter statReplayed("journal replayed");
+
+static void futexWait(volatile int* addr, int value, uint64_t timeout_ms) {
+  struct timespec timeout;
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+  syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, &timeout, NULL, 0);
+}
+
+static void futexWake(volatile int* addr) {
+  syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+const char* priorityName(store_priority_t priority) {
+  switch (priority) {
+  case PRIORITY_LOW:
+    return "low";
+  case PRIORITY_HIGH:
+    return "high";
+  default:
+    return "normal";
+  }
+}
 
 void* threadStatic(void *this_ptr) {
   StoreQueue *queue_ptr = (StoreQueue*)this_ptr;
+  ThreadPlacement::placeCurrentThread(THREAD_STORE);
   queue_ptr->threadMember();
   return NULL;
 }
 
 StoreQueue::StoreQueue(const string& type, const string& category,
                        unsigned check_period, bool is_model, bool multi_category, const string& trigger_path)
-  : msgQueueSize(0),
-    hasWork(false),
+  : msgQueue(NULL),
+    msgQueueSize(0),
+    msgQueueCount(0),
+    oldestQueued(0),
+    failedBytes(0),
+    failedCount(0),
+    holdQueue(false),
+    nextRetry(0),
+    retryBackoff(0),
+    scheduler(g_StoreScheduler.get()),
+    taskState(TASK_IDLE),
+    hasWork(0),
     stopping(false),
+    storeOpen(false),
+    lastPeriodicCheck(0),
+    lastHandleMessages(monotonicMillis()),
     isModel(is_model),
     multiCategory(multi_category),
     triggerPath(trigger_path),
     categoryHandled(category),
     checkPeriod(check_period),
     targetWriteSize(DEFAULT_TARGET_WRITE_SIZE),
-    maxWriteInterval(DEFAULT_MAX_WRITE_INTERVAL),
-    mustSucceed(true) {
+    maxWriteInterval(DEFAULT_MAX_WRITE_INTERVAL * 1000),
+    adaptiveWriteSize(false),
+    minWriteSize(DEFAULT_MIN_WRITE_SIZE),
+    maxWriteSize(DEFAULT_MAX_WRITE_SIZE),
+    targetWriteLatency(DEFAULT_TARGET_WRITE_LATENCY),
+    mustSucceed(true),
+    priority(PRIORITY_NORMAL),
+    minRetryBackoff(DEFAULT_MIN_RETRY_BACKOFF),
+    maxRetryBackoff(DEFAULT_MAX_RETRY_BACKOFF),
+    maxFailedBatches(0),
+    maxFailedBytes(0),
+    journalWatermark(DEFAULT_JOURNAL_WATERMARK),
+    journalSegmentSize(DEFAULT_JOURNAL_SEGMENT_SIZE),
+    writeSize(DEFAULT_TARGET_WRITE_SIZE),
+    shardByKey(false),
+    shardKeyDelimiter(DEFAULT_SHARD_KEY_DELIMITER),
+    nextShard(0) {
     
   store = Store::createStore(type, category, false, multiCategory, triggerPath);
   if (!store) {
@@ -59,71 +133,165 @@ StoreQueue::StoreQueue(const string& type, const string& category,
 
 StoreQueue::StoreQueue(const shared_ptr<StoreQueue> example,
                        const std::string &category)
-  : msgQueueSize(0),
-    hasWork(false),
+  : msgQueue(NULL),
+    msgQueueSize(0),
+    msgQueueCount(0),
+    oldestQueued(0),
+    failedBytes(0),
+    failedCount(0),
+    holdQueue(false),
+    nextRetry(0),
+    retryBackoff(0),
+    scheduler(g_StoreScheduler.get()),
+    taskState(TASK_IDLE),
+    hasWork(0),
     stopping(false),
+    storeOpen(false),
+    lastPeriodicCheck(0),
+    lastHandleMessages(monotonicMillis()),
     isModel(false),
     multiCategory(example->multiCategory),
     categoryHandled(category),
     checkPeriod(example->checkPeriod),
     targetWriteSize(example->targetWriteSize),
     maxWriteInterval(example->maxWriteInterval),
-    mustSucceed(example->mustSucceed) {
+    adaptiveWriteSize(example->adaptiveWriteSize),
+    minWriteSize(example->minWriteSize),
+    maxWriteSize(example->maxWriteSize),
+    targetWriteLatency(example->targetWriteLatency),
+    mustSucceed(example->mustSucceed),
+    priority(example->priority),
+    minRetryBackoff(example->minRetryBackoff),
+    maxRetryBackoff(example->maxRetryBackoff),
+    maxFailedBatches(example->maxFailedBatches),
+    maxFailedBytes(example->maxFailedBytes),
+    journalPath(example->journalPath),
+    journalWatermark(example->journalWatermark),
+    journalSegmentSize(example->journalSegmentSize),
+    writeSize(example->writeSize),
+    shardByKey(example->shardByKey),
+    shardKeyDelimiter(example->shardKeyDelimiter),
+    nextShard(0),
+    shardName(example->shardName) {
 
   store = example->copyStore(category);
   if (!store) {
     throw std::runtime_error("createStore failed copying model store");
   }
+  if (example->spillStore) {
+    spillStore = example->spillStore->copy(category);
+  }
+  if (!journalPath.empty()) {
+    journal.reset(new StoreJournal(journalPath, category + shardName,
+                                   journalSegmentSize));
+  }
+  if (adaptiveWriteSize) {
+    writeSizeCounter = categoryHandled + ":write size";
+  }
   storeInitCommon();
+
+  for (vector<shared_ptr<StoreQueue> >::const_iterator iter =
+         example->shards.begin();
+       iter != example->shards.end();
+       ++iter) {
+    shards.push_back(shared_ptr<StoreQueue>(new StoreQueue(*iter, category)));
+  }
 }
 
 
 StoreQueue::~StoreQueue() {
+  while (msgQueue) {
+    QueuedMessage* next = msgQueue->next;
+    delete msgQueue;
+    msgQueue = next;
+  }
+
   if (!isModel) {
     pthread_mutex_destroy(&cmdMutex);
-    pthread_mutex_destroy(&msgMutex);
-    pthread_mutex_destroy(&hasWorkMutex);
-    pthread_cond_destroy(&hasWorkCond);
+    pthread_mutex_destroy(&stoppedMutex);
+    pthread_cond_destroy(&stoppedCond);
   }
 }
 
 // WARNING: the number could change after you check this, so don't
 // expect it to be exact. Use for hueristics ONLY.
 unsigned long StoreQueue::getSize() {
-  unsigned long retval;
-  pthread_mutex_lock(&msgMutex);
-  retval = msgQueueSize;
-  pthread_mutex_unlock(&msgMutex);
-  return retval;
+  unsigned long size = msgQueueSize + failedBytes;
+  for (vector<shared_ptr<StoreQueue> >::iterator iter = shards.begin();
+       iter != shards.end();
+       ++iter) {
+    size = max(size, (*iter)->getSize());
+  }
+  return size;
+}
+
+unsigned long StoreQueue::getTotalSize() {
+  unsigned long size = msgQueueSize + failedBytes;
+  for (vector<shared_ptr<StoreQueue> >::iterator iter = shards.begin();
+       iter != shards.end();
+       ++iter) {
+    size += (*iter)->getTotalSize();
+  }
+  return size;
+}
+
+unsigned long StoreQueue::getTotalCount() {
+  unsigned long count = msgQueueCount + failedCount;
+  for (vector<shared_ptr<StoreQueue> >::iterator iter = shards.begin();
+       iter != shards.end();
+       ++iter) {
+    count += (*iter)->getTotalCount();
+  }
+  return count;
 }
 
+// Called from any number of threads at once. Never takes a lock unless the
+// store thread needs waking up.
 void StoreQueue::addMessage(boost::shared_ptr<LogEntry> entry) {
   if (isModel) {
     LOG_OPER("ERROR: called addMessage on model store");
   } else {
-    bool waitForWork = false;
-
-    pthread_mutex_lock(&msgMutex);
-    msgQueue->push_back(entry);
-    msgQueueSize += entry->message.size();
-
-    waitForWork = (msgQueueSize >= targetWriteSize) ? true : false;
-    pthread_mutex_unlock(&msgMutex);
-
-    // Wake up store thread if we have enough messages
-    if (waitForWork == true) {
-      // signal that there is work to do if not already signaled
-      pthread_mutex_lock(&hasWorkMutex);
-      if (!hasWork) {
-        hasWork = true;
-        pthread_cond_signal(&hasWorkCond);
+    if (!shards.empty()) {
+      unsigned long shard = shardFor(entry);
+      if (shard > 0) {
+        shards[shard - 1]->addMessage(entry);
+        return;
+      }
+    }
+
+    QueuedMessage* node = new QueuedMessage;
+    node->entry = entry;
+
+    // Count the bytes before the message is visible, so the store thread
+    // never subtracts more than has been added
+    unsigned long new_size =
+      __sync_add_and_fetch(&msgQueueSize, entry->message.size());
+    __sync_add_and_fetch(&msgQueueCount, 1);
+
+    QueuedMessage* head;
+    do {
+      head = msgQueue;
+      node->next = head;
+      if (!head) {
+        oldestQueued = monotonicMicros();
       }
-      pthread_mutex_unlock(&hasWorkMutex);
+    } while (!__sync_bool_compare_and_swap(&msgQueue, head, node));
+
+    // Wake up store thread if we have enough messages, or if the queue was
+    // empty so it knows when max_write_interval will be up. Messages held
+    // behind failed batches don't need writing until the next retry.
+    if ((!head || (new_size >= writeSize && !holdQueue)) && !hasWork) {
+      signalWork();
     }
   }
 }
 
 void StoreQueue::configureAndOpen(pStoreConf configuration) {
+  // done here rather than in configureInline so the scheduler and
+  // throttling see it before any messages arrive
+  configurePriority(configuration);
+  configuration = configureShards(configuration);
+
   // model store has to handle this inline since it has no queue
   if (isModel) {
     configureInline(configuration);
@@ -133,13 +301,7 @@ void StoreQueue::configureAndOpen(pStoreConf configuration) {
     cmdQueue.push(cmd);
     pthread_mutex_unlock(&cmdMutex);
 
-    // signal that there is work to do if not already signaled
-    pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
-    }
-    pthread_mutex_unlock(&hasWorkMutex);
+    signalWork();
   }
 }
 
@@ -153,15 +315,24 @@ void StoreQueue::stop() {
     stopping = true;
     pthread_mutex_unlock(&cmdMutex);
 
-    // signal that there is work to do if not already signaled
-    pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
+    signalWork();
+
+    if (scheduler) {
+      pthread_mutex_lock(&stoppedMutex);
+      while (taskState != TASK_STOPPED) {
+        pthread_cond_wait(&stoppedCond, &stoppedMutex);
+      }
+      pthread_mutex_unlock(&stoppedMutex);
+      scheduler->remove(this);
+    } else {
+      pthread_join(storeThread, NULL);
     }
-    pthread_mutex_unlock(&hasWorkMutex);
 
-    pthread_join(storeThread, NULL);
+    for (vector<shared_ptr<StoreQueue> >::iterator iter = shards.begin();
+         iter != shards.end();
+         ++iter) {
+      (*iter)->stop();
+    }
   }
 }
 
@@ -174,16 +345,159 @@ void StoreQueue::open() {
     cmdQueue.push(cmd);
     pthread_mutex_unlock(&cmdMutex);
 
-    // signal that there is work to do if not already signaled
-    pthread_mutex_lock(&hasWorkMutex);
-    if (!hasWork) {
-      hasWork = true;
-      pthread_cond_signal(&hasWorkCond);
+    signalWork();
+
+    for (vector<shared_ptr<StoreQueue> >::iterator iter = shards.begin();
+         iter != shards.end();
+         ++iter) {
+      (*iter)->open();
     }
-    pthread_mutex_unlock(&hasWorkMutex);
   }
 }
 
+void StoreQueue::configurePriority(pStoreConf configuration) {
+  string tmp;
+  if (!configuration->getString("priority", tmp)) {
+    return;
+  }
+
+  if (tmp == "high") {
+    priority = PRIORITY_HIGH;
+  } else if (tmp == "normal") {
+    priority = PRIORITY_NORMAL;
+  } else if (tmp == "low") {
+    priority = PRIORITY_LOW;
+  } else {
+    LOG_OPER("[%s] Bad config - unknown priority <%s>, using normal",
+             categoryHandled.c_str(), tmp.c_str());
+    priority = PRIORITY_NORMAL;
+  }
+}
+
+// With num_shards=N, creates N-1 more StoreQueues for this category, each
+// with its own store and thread, and returns the configuration for this
+// queue as shard 0. Every store of shard i is configured with shard=i so
+// file stores can keep the shards' files apart.
+pStoreConf StoreQueue::configureShards(pStoreConf configuration) {
+  unsigned long num_shards = 1;
+  configuration->getUnsigned("num_shards", num_shards);
+  if (num_shards <= 1) {
+    return configuration;
+  }
+
+  if (!shards.empty()) {
+    LOG_OPER("[%s] Already has <%lu> shards, ignoring num_shards=<%lu>",
+             categoryHandled.c_str(), (unsigned long)shards.size() + 1,
+             num_shards);
+    return makeShardConf(configuration, 0);
+  }
+
+  string tmp;
+  if (configuration->getString("shard_by", tmp)) {
+    if (tmp == "key") {
+      shardByKey = true;
+    } else if (tmp != "round_robin") {
+      LOG_OPER("[%s] Bad config - unknown shard_by <%s>, using round_robin",
+               categoryHandled.c_str(), tmp.c_str());
+    }
+  }
+  if (configuration->getString("shard_key_delimiter", tmp) && !tmp.empty()) {
+    shardKeyDelimiter = tmp[0];
+  }
+
+  for (unsigned long i = 1; i < num_shards; ++i) {
+    shared_ptr<StoreQueue> shard(new StoreQueue(store->getType(),
+                                                categoryHandled, checkPeriod,
+                                                isModel, multiCategory,
+                                                triggerPath));
+    shard->configureAndOpen(makeShardConf(configuration, i));
+    shards.push_back(shard);
+  }
+
+  LOG_OPER("[%s] Spreading messages over <%lu> shards by %s",
+           categoryHandled.c_str(), num_shards,
+           shardByKey ? "key" : "round robin");
+  return makeShardConf(configuration, 0);
+}
+
+pStoreConf StoreQueue::makeShardConf(pStoreConf configuration,
+                                     unsigned long shard) {
+  pStoreConf shard_conf = configuration->copy();
+  ostringstream name;
+  name << shard;
+  shard_conf->setStringRecursive("shard", name.str());
+  shard_conf->setString("num_shards", "1");
+  return shard_conf;
+}
+
+// Messages with the same key always go to the same shard, so they stay in
+// order. The key is the start of the message up to shard_key_delimiter.
+unsigned long StoreQueue::shardFor(logentry_ptr_t entry) {
+  unsigned long num_shards = shards.size() + 1;
+  if (!shardByKey) {
+    return __sync_fetch_and_add(&nextShard, 1) % num_shards;
+  }
+
+  // FNV-1a
+  const string& message = entry->message;
+  uint32_t hash = 2166136261U;
+  for (string::const_iterator iter = message.begin();
+       iter != message.end() && *iter != shardKeyDelimiter;
+       ++iter) {
+    hash ^= (unsigned char)*iter;
+    hash *= 16777619U;
+  }
+  return hash % num_shards;
+}
+
+void StoreQueue::signalWork() {
+  if (scheduler) {
+    scheduler->schedule(this);
+    return;
+  }
+
+  // signal that there is work to do if not already signaled
+  if (__sync_bool_compare_and_swap(&hasWork, 0, 1)) {
+    futexWake(&hasWork);
+  }
+}
+
+// Called by the scheduler once CMD_STOP has been processed
+void StoreQueue::taskStopped() {
+  pthread_mutex_lock(&stoppedMutex);
+  taskState = TASK_STOPPED;
+  pthread_cond_broadcast(&stoppedCond);
+  pthread_mutex_unlock(&stoppedMutex);
+}
+
+// Takes every queued message, oldest first. Only the store thread calls this.
+shared_ptr<logentry_vector_t> StoreQueue::takeMessages() {
+  // oldestQueued only changes when a message is pushed onto an empty queue
+  queueLatency.recordSince(oldestQueued);
+  QueuedMessage* node =
+    __sync_lock_test_and_set(&msgQueue, (QueuedMessage*)NULL);
+
+  unsigned long count = 0;
+  for (QueuedMessage* iter = node; iter; iter = iter->next) {
+    ++count;
+  }
+  shared_ptr<logentry_vector_t> messages(new logentry_vector_t(count));
+
+  // the list is newest first
+  unsigned long size = 0;
+  while (node) {
+    QueuedMessage* next = node->next;
+    size += node->entry->message.size();
+    (*messages)[--count] = node->entry;
+    delete node;
+    node = next;
+  }
+
+  __sync_sub_and_fetch(&msgQueueSize, size);
+  __sync_sub_and_fetch(&msgQueueCount, messages->size());
+  return messages;
+}
+
 shared_ptr<Store> StoreQueue::copyStore(const std::string &category) {
   return store->copy(category);
 }
@@ -194,7 +508,13 @@ std::string StoreQueue::getCategoryHandled() {
 
 
 std::string StoreQueue::getStatus() {
-  return store->getStatus();
+  string status = store->getStatus();
+  for (vector<shared_ptr<StoreQueue> >::iterator iter = shards.begin();
+       status.empty() && iter != shards.end();
+       ++iter) {
+    status = (*iter)->getStatus();
+  }
+  return status;
 }
 
 std::string StoreQueue::getBaseType() {
@@ -214,155 +534,504 @@ void StoreQueue::threadMember() {
     return;
   }
 
-  // init time of last periodic check to time of 0
-  time_t last_periodic_check = 0;
+  uint64_t next_run;
+  while (processWork(next_run)) {
+    // wait until there's some work to do or we timeout
+    uint64_t now = monotonicMillis();
+    if (next_run > now) {
+      futexWait(&hasWork, 0, next_run - now);
+    }
+    __sync_lock_test_and_set(&hasWork, 0);
+  }
+}
 
-  time_t last_handle_messages;
-  time(&last_handle_messages);
+// Does everything that is due: queued commands, the periodic check, and
+// writing out messages. Returns false once the queue has been stopped and the
+// store closed, otherwise sets next_run to the monotonicMillis() time this
+// needs to be called again if nothing else happens first.
+//
+// A queue with no messages only needs to run for the periodic check. When a
+// message arrives in an empty queue we get signalled, and from then on we run
+// again as soon as max_write_interval is up for the oldest message.
+bool StoreQueue::processWork(uint64_t& next_run) {
+  bool stop = false;
 
-  // initialize absolute timestamp
-  struct timespec abs_timeout;
-  memset(&abs_timeout, 0, sizeof(struct timespec));
+  // handle commands
+  //
+  pthread_mutex_lock(&cmdMutex);
+  while (!cmdQueue.empty()) {
+    StoreCommand cmd = cmdQueue.front();
+    cmdQueue.pop();
 
-  bool stop = false;
-  bool open = false;
-  while (!stop) {
+    switch (cmd.command) {
+    case CMD_CONFIGURE:
+      configureInline(cmd.configuration);
+      openInline();
+      storeOpen = true;
+      break;
+    case CMD_OPEN:
+      openInline();
+      storeOpen = true;
+      break;
+    case CMD_STOP:
+      stop = true;
+      break;
+    default:
+      LOG_OPER("LOGIC ERROR: unknown command to store queue");
+      break;
+    }
+  }
 
-    // handle commands
-    //
-    pthread_mutex_lock(&cmdMutex);
-    while (!cmdQueue.empty()) {
-      StoreCommand cmd = cmdQueue.front();
-      cmdQueue.pop();
-
-      switch (cmd.command) {
-      case CMD_CONFIGURE:
-        configureInline(cmd.configuration);
-        openInline();
-        open = true;
-        break;
-      case CMD_OPEN:
-        openInline();
-        open = true;
-        break;
-      case CMD_STOP:
-        stop = true;
-        break;
-      default:
-        LOG_OPER("LOGIC ERROR: unknown command to store queue");
-        break;
-      }
+  // handle periodic tasks
+  //
+  uint64_t now = monotonicMillis();
+  uint64_t check_period = (uint64_t)checkPeriod * 1000;
+  if (!stop && storeOpen &&
+      (lastPeriodicCheck == 0 || now - lastPeriodicCheck >= check_period)) {
+    store->periodicCheck();
+    if (spillStore) {
+      spillStore->periodicCheck();
     }
+    lastPeriodicCheck = now;
+  }
 
-    // handle periodic tasks
-    //
-    time_t this_loop;
-    time(&this_loop);
-    if (!stop && open && this_loop - last_periodic_check > checkPeriod) {
-      store->periodicCheck();
-      last_periodic_check = this_loop;
+  pthread_mutex_unlock(&cmdMutex);
+
+  // retry failed batches, then replay the journal, once we've backed off
+  // long enough. The journal is left for next time when stopping.
+  bool backlog = !failedBatches.empty() || (journal && !journal->empty());
+  if (backlog && (stop || now >= nextRetry)) {
+    retryFailedBatches(now);
+    if (!stop && failedBatches.empty() && journal && !journal->empty()) {
+      replayJournal(now);
     }
+    backlog = !failedBatches.empty() || (journal && !journal->empty());
+  }
 
-    pthread_mutex_lock(&msgMutex);
-    pthread_mutex_unlock(&cmdMutex);
+  // Queued messages can't be written ahead of the backlog. They wait in
+  // msgQueue, where they count towards max_queue_size, unless there is too
+  // much in memory and we have a journal, or we are already retaining all
+  // the failed batches we are allowed to and have somewhere to spill.
+  bool journal_queued = backlog && journal &&
+                        msgQueueSize + failedBytes >= journalWatermark;
+  bool spill_queued = !journal && !failedBatches.empty() && spillStore &&
+                      failedBatchesFull();
+  holdQueue = backlog && !journal_queued && !spill_queued;
 
-    boost::shared_ptr<logentry_vector_t> messages;
-
-    // handle messages if stopping, enough time has passed, or queue is large
-    //
-    if (stop ||
-        (this_loop - last_handle_messages > maxWriteInterval) ||
-        msgQueueSize >= targetWriteSize) {
-
-      if (failedMessages) {
-        // process any messages we were not able to process last time
-        messages = failedMessages;
-        failedMessages = boost::shared_ptr<logentry_vector_t>();
-      } else if (msgQueueSize > 0) {
-        // process message in queue
-        messages = msgQueue;
-        msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
-        msgQueueSize = 0;
+  // handle messages if stopping, enough time has passed, or queue is large
+  //
+  shared_ptr<logentry_vector_t> messages;
+  if (msgQueue &&
+      (stop ||
+       (!holdQueue &&
+        (now >= oldestQueued / 1000 + maxWriteInterval ||
+         msgQueueSize >= writeSize)))) {
+    messages = takeMessages();
+
+    // reset timer
+    lastHandleMessages = now;
+  }
+
+  if (messages) {
+    if (journal && (journal_queued || (stop && backlog))) {
+      journalMessages(messages);
+    } else if (spill_queued) {
+      spillMessages(messages);
+    } else if (backlog) {
+      // stopping while still backing off, keep them in order behind the
+      // failed batches
+      processFailedMessages(messages);
+    } else {
+      handleMessages(messages);
+
+      uint64_t start = monotonicMicros();
+      store->flush();
+      flushLatency.recordSince(start);
+    }
+  }
+
+  if (stop) {
+    // anything the store still can't take has to go somewhere else now,
+    // preferably in front of the journal so it's replayed first next time
+    while (journal && !failedBatches.empty() &&
+           journal->prepend(failedBatches.back())) {
+      statJournaled.increment(failedBatches.back()->size());
+      failedBatches.pop_back();
+    }
+    while (!failedBatches.empty()) {
+      shared_ptr<logentry_vector_t> batch = failedBatches.front();
+      failedBatches.pop_front();
+      if (spillStore) {
+        spillMessages(batch);
+      } else {
+        LOG_OPER("[%s] WARNING: Lost %lu messages at shutdown!",
+                 categoryHandled.c_str(), batch->size());
+        statLost.increment(batch->size());
+        IngestWal::keepSegments(*batch);
       }
+    }
+    failedBytes = 0;
+    failedCount = 0;
+    updateRetryCounters();
 
-      // reset timer
-      last_handle_messages = this_loop;
+    store->close();
+    if (spillStore) {
+      spillStore->close();
     }
+    if (journal) {
+      journal->close();
+    }
+    return false;
+  }
+
+  // when we need to handle messages or do a periodic check. While the
+  // journal is replaying and the store is fine, nextRetry has passed.
+  next_run = (storeOpen ? lastPeriodicCheck : now) + check_period;
+  if (backlog) {
+    next_run = min(next_run, nextRetry);
+  }
+  if (msgQueue && !holdQueue) {
+    next_run = min(next_run, oldestQueued / 1000 + maxWriteInterval);
+  }
+  return true;
+}
 
-    pthread_mutex_unlock(&msgMutex);
+// Passes messages to the store. With adaptive_write_size they are split
+// into batches of about writeSize bytes, so a backlog doesn't turn into one
+// huge slow write.
+void StoreQueue::handleMessages(shared_ptr<logentry_vector_t> messages) {
+  // Tracked by index: the store may erase from or swap out a batch it
+  // fails, and without adaptive_write_size that batch is messages itself
+  unsigned long next = 0;
+  unsigned long total = messages->size();
 
-    if (messages) {
-      if (!store->handleMessages(messages)) {
-        // Store could not handle these messages
-        processFailedMessages(messages);
+  while (next < total) {
+    shared_ptr<logentry_vector_t> batch;
+    unsigned long batch_size = 0;
+
+    if (!adaptiveWriteSize) {
+      batch = messages;
+      next = total;
+    } else {
+      batch = shared_ptr<logentry_vector_t>(new logentry_vector_t);
+      while (next < total && (batch->empty() || batch_size < writeSize)) {
+        batch_size += (*messages)[next]->message.size();
+        batch->push_back((*messages)[next]);
+        ++next;
       }
-      store->flush();
     }
 
-    if (!stop) {
-      // set timeout to when we need to handle messages or do a periodic check
-      abs_timeout.tv_sec = min(last_periodic_check + checkPeriod,
-                               last_handle_messages + maxWriteInterval);
+    uint64_t start = monotonicMicros();
+    bool success = store->handleMessages(batch);
+    handleLatency.recordSince(start);
 
-      // must wait until after this time
-      abs_timeout.tv_sec++;
+    if (adaptiveWriteSize) {
+      adaptWriteSize(batch_size, monotonicMicros() - start, success);
+    }
 
-      // wait until there's some work to do or we timeout
-      pthread_mutex_lock(&hasWorkMutex);
-      if (!hasWork) {
-	pthread_cond_timedwait(&hasWorkCond, &hasWorkMutex, &abs_timeout);
+    if (!success) {
+      // Store could not handle these messages, or the ones after them
+      if (batch != messages) {
+        batch->insert(batch->end(), messages->begin() + next,
+                      messages->end());
       }
-      hasWork = false;
-      pthread_mutex_unlock(&hasWorkMutex);
+      processFailedMessages(batch);
+      break;
     }
+  }
+}
+
+// AIMD: while the store keeps up, a batch that filled the current size grows
+// it by minWriteSize. A slow or failed write halves it. Latency is in
+// microseconds.
+void StoreQueue::adaptWriteSize(unsigned long batch_size, uint64_t latency,
+                                bool success) {
+  unsigned long new_size = writeSize;
 
-  } // while (!stop)
+  if (!success || latency > (uint64_t)targetWriteLatency * 1000) {
+    new_size = max(writeSize / 2, minWriteSize);
+  } else if (batch_size >= writeSize) {
+    new_size = min(writeSize + minWriteSize, maxWriteSize);
+  }
 
-  store->close();
+  if (new_size != writeSize) {
+    writeSize = new_size;
+    if (g_Handler) {
+      g_Handler->setCounter(writeSizeCounter, writeSize);
+    }
+  }
+}
+
+static unsigned long batchBytes(shared_ptr<logentry_vector_t> messages) {
+  unsigned long size = 0;
+  for (logentry_vector_t::iterator iter = messages->begin();
+       iter != messages->end();
+       ++iter) {
+    size += (*iter)->message.size();
+  }
+  return size;
 }
 
 void StoreQueue::processFailedMessages(shared_ptr<logentry_vector_t> messages) {
   // If the store was not able to process these messages, we will either
-  // requeue them or give up depending on the value of mustSucceed
+  // requeue them or give up depending on the value of mustSucceed. If we
+  // can't keep any more of them they go to the spill store if there is one.
 
-  if (mustSucceed) {
+  if (mustSucceed && !failedBatchesFull()) {
     // Save failed messages
-    failedMessages = messages;
+    failedBatches.push_back(messages);
+    failedBytes += batchBytes(messages);
+    failedCount += messages->size();
+    if (failedBatches.size() == 1) {
+      backOff(monotonicMillis());
+    }
 
     LOG_OPER("[%s] WARNING: Re-queueing %lu messages!",
              categoryHandled.c_str(), messages->size());
-    g_Handler->incrementCounter("requeue", messages->size());
+    statRequeue.increment(messages->size());
+    updateRetryCounters();
+  } else if (spillStore) {
+    spillMessages(messages);
   } else {
     // record messages as being lost
     LOG_OPER("[%s] WARNING: Lost %lu messages!",
              categoryHandled.c_str(), messages->size());
-    g_Handler->incrementCounter("lost", messages->size());
+    statLost.increment(messages->size());
+    IngestWal::keepSegments(*messages);
+  }
+}
+
+// Stops at the first batch the store still can't take and backs off again
+void StoreQueue::retryFailedBatches(uint64_t now) {
+  bool handled = false;
+
+  while (!failedBatches.empty()) {
+    shared_ptr<logentry_vector_t> batch = failedBatches.front();
+    unsigned long size = batchBytes(batch);
+    unsigned long count = batch->size();
+
+    statRetry.increment();
+    uint64_t start = monotonicMicros();
+    bool success = store->handleMessages(batch);
+    handleLatency.recordSince(start);
+
+    if (!success) {
+      // the store may have handled some of the batch
+      failedBytes = failedBytes - size + batchBytes(batch);
+      failedCount = failedCount - count + batch->size();
+      backOff(now);
+      break;
+    }
+
+    failedBatches.pop_front();
+    failedBytes -= size;
+    failedCount -= count;
+    handled = true;
+  }
+
+  if (handled) {
+    uint64_t start = monotonicMicros();
+    store->flush();
+    flushLatency.recordSince(start);
+
+    if (failedBatches.empty()) {
+      retryBackoff = 0;
+    }
+  }
+  updateRetryCounters();
+}
+
+// Replays the oldest journal segment. The segment is only deleted once the
+// store has taken all of it; if the store took part of it, the segment is
+// rewritten with what's left, and we back off.
+void StoreQueue::replayJournal(uint64_t now) {
+  shared_ptr<logentry_vector_t> messages(new logentry_vector_t);
+  if (!journal->readOldest(messages)) {
+    backOff(now);
+    updateRetryCounters();
+    return;
+  }
+
+  unsigned long count = messages->size();
+  uint64_t start = monotonicMicros();
+  bool success = messages->empty() || store->handleMessages(messages);
+  handleLatency.recordSince(start);
+
+  if (success) {
+    journal->deleteOldest();
+    statReplayed.increment(count);
+    retryBackoff = 0;
+
+    start = monotonicMicros();
+    store->flush();
+    flushLatency.recordSince(start);
+  } else {
+    unsigned long handled = count - messages->size();
+    statReplayed.increment(handled);
+    if (handled && !journal->replaceOldest(messages)) {
+      // the whole segment is still there, so the handled messages will be
+      // sent again
+      LOG_OPER("[%s] Failed to rewrite journal segment after <%lu> of <%lu> "
+               "messages were replayed", categoryHandled.c_str(), handled,
+               count);
+    }
+    backOff(now);
+  }
+  updateRetryCounters();
+}
+
+void StoreQueue::journalMessages(shared_ptr<logentry_vector_t> messages) {
+  if (journal->append(messages)) {
+    statJournaled.increment(messages->size());
+    updateRetryCounters();
+  } else {
+    processFailedMessages(messages);
+  }
+}
+
+// Doubles the backoff, and picks the next retry at random from the second
+// half of it so queues that failed together don't all retry together.
+void StoreQueue::backOff(uint64_t now) {
+  retryBackoff = retryBackoff ? min(retryBackoff * 2, maxRetryBackoff)
+                              : minRetryBackoff;
+  unsigned long half = retryBackoff / 2;
+  nextRetry = now + retryBackoff - half + (half ? rand() % (half + 1) : 0);
+}
+
+bool StoreQueue::failedBatchesFull() {
+  return (maxFailedBatches && failedBatches.size() >= maxFailedBatches) ||
+         (maxFailedBytes && failedBytes >= maxFailedBytes);
+}
+
+void StoreQueue::spillMessages(shared_ptr<logentry_vector_t> messages) {
+  unsigned long count = messages->size();
+  if (spillStore->handleMessages(messages)) {
+    spillStore->flush();
+    statSpilled.increment(count);
+  } else {
+    LOG_OPER("[%s] WARNING: Lost %lu messages! Spill store failed",
+             categoryHandled.c_str(), messages->size());
+    statSpilled.increment(count - messages->size());
+    statLost.increment(messages->size());
+    IngestWal::keepSegments(*messages);
+  }
+}
+
+void StoreQueue::updateRetryCounters() {
+  if (g_Handler) {
+    g_Handler->setCounter(failedBatchesCounter, failedBatches.size());
+    g_Handler->setCounter(failedBytesCounter, failedBytes);
+    g_Handler->setCounter(retryBackoffCounter, retryBackoff);
+    if (journal) {
+      g_Handler->setCounter(journalBytesCounter, journal->getSize());
+    }
   }
 }
 
 void StoreQueue::storeInitCommon() {
   // model store doesn't need this stuff
   if (!isModel) {
-    msgQueue = boost::shared_ptr<logentry_vector_t>(new logentry_vector_t);
     pthread_mutex_init(&cmdMutex, NULL);
-    pthread_mutex_init(&msgMutex, NULL);
-    pthread_mutex_init(&hasWorkMutex, NULL);
-    pthread_cond_init(&hasWorkCond, NULL);
+    pthread_mutex_init(&stoppedMutex, NULL);
+    pthread_cond_init(&stoppedCond, NULL);
+
+    queueLatency.init(categoryHandled, store->getType(), "queue");
+    handleLatency.init(categoryHandled, store->getType(), "handle");
+    flushLatency.init(categoryHandled, store->getType(), "flush");
 
-    pthread_create(&storeThread, NULL, threadStatic, (void*) this);
+    failedBatchesCounter = categoryHandled + ":failed batches";
+    failedBytesCounter = categoryHandled + ":failed bytes";
+    retryBackoffCounter = categoryHandled + ":retry backoff ms";
+    journalBytesCounter = categoryHandled + ":journal bytes";
+
+    if (!scheduler) {
+      pthread_create(&storeThread, NULL, threadStatic, (void*) this);
+    }
   }
 }
 
 void StoreQueue::configureInline(pStoreConf configuration) {
   // Constructor defaults are fine if these don't exist
   configuration->getUnsigned("target_write_size", (unsigned long&) targetWriteSize);
-  configuration->getUnsigned("max_write_interval", (unsigned long&) maxWriteInterval);
+  unsigned long max_write_interval;
+  if (configuration->getUnsigned("max_write_interval", max_write_interval)) {
+    maxWriteInterval = max_write_interval * 1000;
+  }
+  configuration->getUnsigned("max_write_interval_ms", maxWriteInterval);
 
   string tmp;
   if (configuration->getString("must_succeed", tmp) && tmp == "no") {
     mustSucceed = false;
   }
 
+  if (configuration->getString("adaptive_write_size", tmp)) {
+    adaptiveWriteSize = (tmp == "yes");
+  }
+  configuration->getUnsigned("min_write_size", minWriteSize);
+  configuration->getUnsigned("max_write_size", maxWriteSize);
+  configuration->getUnsigned("target_write_latency_ms", targetWriteLatency);
+  if (minWriteSize == 0 || minWriteSize > maxWriteSize) {
+    LOG_OPER("[%s] Bad config - min_write_size must be positive and less than max_write_size, using <%lu> and <%lu>",
+             categoryHandled.c_str(), (unsigned long)DEFAULT_MIN_WRITE_SIZE,
+             (unsigned long)DEFAULT_MAX_WRITE_SIZE);
+    minWriteSize = DEFAULT_MIN_WRITE_SIZE;
+    maxWriteSize = DEFAULT_MAX_WRITE_SIZE;
+  }
+
+  // start adapting from the configured size
+  writeSize = targetWriteSize;
+  if (adaptiveWriteSize) {
+    writeSize = min(max(targetWriteSize, minWriteSize), maxWriteSize);
+    writeSizeCounter = categoryHandled + ":write size";
+    if (g_Handler) {
+      g_Handler->setCounter(writeSizeCounter, writeSize);
+    }
+  }
+
+  configuration->getUnsigned("retry_backoff_min_ms", minRetryBackoff);
+  configuration->getUnsigned("retry_backoff_max_ms", maxRetryBackoff);
+  configuration->getUnsigned("max_failed_batches", maxFailedBatches);
+  configuration->getUnsigned("max_failed_bytes", maxFailedBytes);
+  if (minRetryBackoff == 0 || minRetryBackoff > maxRetryBackoff) {
+    LOG_OPER("[%s] Bad config - retry_backoff_min_ms must be positive and less than retry_backoff_max_ms, using <%lu> and <%lu>",
+             categoryHandled.c_str(), (unsigned long)DEFAULT_MIN_RETRY_BACKOFF,
+             (unsigned long)DEFAULT_MAX_RETRY_BACKOFF);
+    minRetryBackoff = DEFAULT_MIN_RETRY_BACKOFF;
+    maxRetryBackoff = DEFAULT_MAX_RETRY_BACKOFF;
+  }
+
+  if (configuration->getString("shard", tmp)) {
+    shardName = "-shard" + tmp;
+  }
+
+  configuration->getUnsigned("journal_watermark", journalWatermark);
+  configuration->getUnsigned("journal_segment_size", journalSegmentSize);
+  if (configuration->getString("journal_path", journalPath) &&
+      !journalPath.empty()) {
+    journal.reset(new StoreJournal(journalPath, categoryHandled + shardName,
+                                   journalSegmentSize));
+  }
+
+  pStoreConf spill_conf;
+  if (configuration->getStore("spill", spill_conf)) {
+    if (spillStore && spillStore->isOpen()) {
+      spillStore->close();
+    }
+    spillStore.reset();
+
+    string type;
+    if (!spill_conf->getString("type", type)) {
+      LOG_OPER("[%s] Bad config - spill store doesn't have a type",
+               categoryHandled.c_str());
+    } else {
+      spillStore = Store::createStore(type, categoryHandled, false,
+                                      multiCategory);
+      if (spillStore) {
+        spillStore->configure(spill_conf);
+      }
+    }
+  }
+
   store->configure(configuration);
 }
 
@@ -370,7 +1039,25 @@ void StoreQueue::openInline() {
   if (store->isOpen()) {
     store->close();
   }
+  if (spillStore && spillStore->isOpen()) {
+    spillStore->close();
+  }
   if (!isModel) {
+    // Without a scheduler, the best we can do for priority is to let the
+    // kernel prefer other store threads over low priority ones. Raising
+    // the others would need CAP_SYS_NICE.
+    if (!scheduler && priority == PRIORITY_LOW) {
+      setpriority(PRIO_PROCESS, syscall(SYS_gettid), LOW_PRIORITY_NICE);
+    }
+
     store->open();
+    if (spillStore) {
+      spillStore->open();
+    }
+    if (journal && !journal->open()) {
+      LOG_OPER("[%s] Failed to open journal in <%s>, not journaling",
+               categoryHandled.c_str(), journalPath.c_str());
+      journal.reset();
+    }
   }
 }
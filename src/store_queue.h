@@ -24,17 +24,37 @@
 #define SCRIBE_STORE_QUEUE_H
 
 #include <string>
+#include <deque>
 #include <queue>
 #include <vector>
 #include <pthread.h>
 
 #include "src/gen-cpp/scribe.h"
 #include "store.h"
+#include "stats.h"
+
+class StoreJournal;
+class StoreScheduler;
+
+// Set with priority=high|normal|low on a store. When scribed is overloaded,
+// requests for lower priority categories are turned away first, and when
+// StoreQueues share worker threads, higher priority queues run first.
+enum store_priority_t {
+  PRIORITY_LOW,
+  PRIORITY_NORMAL,
+  PRIORITY_HIGH,
+  NUM_PRIORITIES
+};
+
+const char* priorityName(store_priority_t priority);
 
 /*
  * This class implements a queue and a thread for dispatching
  * events to a store. It creates a store object of the requested
  * type, which can in turn create and manage other store objects.
+ *
+ * If num_store_threads is configured, there is no thread per queue.
+ * Instead the queue is run on the shared StoreScheduler.
  */
 class StoreQueue {
  public:
@@ -54,20 +74,52 @@ class StoreQueue {
   std::string getBaseType();
   std::string getCategoryHandled();
   bool isModelStore() { return isModel;}
+  store_priority_t getPriority() { return priority; }
 
   // this needs to be public for the thread creation to get to it,
   // but no one else should ever call it.
   void threadMember();
 
+  // the scheduler needs to be able to run queues and track their state
+  friend class StoreScheduler;
+
   // WARNING: don't expect this to be exact, because it could change after you check.
   //          This is only for hueristics to decide when we're overloaded.
-  unsigned long getSize();
+  unsigned long getSize();       // of the fullest shard, for max_queue_size
+  unsigned long getTotalSize();  // of all shards together
+  unsigned long getTotalCount(); // messages queued in all shards
 
  private:
   void storeInitCommon();
+  void configurePriority(pStoreConf configuration);
+  pStoreConf configureShards(pStoreConf configuration);
+  pStoreConf makeShardConf(pStoreConf configuration, unsigned long shard);
+  unsigned long shardFor(logentry_ptr_t entry);
   void configureInline(pStoreConf configuration);
   void openInline();
   void processFailedMessages(boost::shared_ptr<logentry_vector_t> messages);
+  void retryFailedBatches(uint64_t now);
+  void backOff(uint64_t now);
+  bool failedBatchesFull();
+  void spillMessages(boost::shared_ptr<logentry_vector_t> messages);
+  void replayJournal(uint64_t now);
+  void journalMessages(boost::shared_ptr<logentry_vector_t> messages);
+  void updateRetryCounters();
+  boost::shared_ptr<logentry_vector_t> takeMessages();
+  void signalWork();
+  bool processWork(/*out*/ uint64_t& next_run);
+  void handleMessages(boost::shared_ptr<logentry_vector_t> messages);
+  void adaptWriteSize(unsigned long batch_size, uint64_t latency, bool success);
+  void taskStopped();
+
+  // state of this queue on the StoreScheduler
+  enum task_state_t {
+    TASK_IDLE,       // waiting for messages or a timer
+    TASK_SCHEDULED,  // in a worker's deque
+    TASK_RUNNING,    // being run by a worker
+    TASK_RERUN,      // being run, and must be scheduled again after
+    TASK_STOPPED     // processed CMD_STOP, must never be scheduled again
+  };
 
   // implementation of queues and thread
   enum store_command_t {
@@ -87,26 +139,60 @@ class StoreQueue {
 
   typedef std::queue<StoreCommand> cmd_queue_t;
 
+  // A message waiting in the queue. Queued messages form a singly linked
+  // list, newest first, that producers push onto with a CAS and the store
+  // thread takes all at once by swapping the head out.
+  struct QueuedMessage {
+    logentry_ptr_t entry;
+    QueuedMessage* next;
+  };
+
   // messages and commands are in different queues to allow bulk
   // handling of messages. This means that order of commands with
   // respect to messages is not preserved.
   cmd_queue_t cmdQueue;
-  boost::shared_ptr<logentry_vector_t> msgQueue;
-  boost::shared_ptr<logentry_vector_t> failedMessages;
-  unsigned long msgQueueSize;   // in bytes
-  pthread_t storeThread;
+  QueuedMessage* volatile msgQueue;
+  volatile unsigned long msgQueueSize; // in bytes, updated atomically
+  volatile unsigned long msgQueueCount; // in messages, updated atomically
+  volatile uint64_t oldestQueued;      // monotonicMicros() when the first
+                                       // message was pushed onto msgQueue
+
+  // Batches the store failed to handle, oldest first. They are retried in
+  // order with jittered exponential backoff, and while there are any, new
+  // messages are held in msgQueue behind them.
+  std::deque<boost::shared_ptr<logentry_vector_t> > failedBatches;
+  volatile unsigned long failedBytes; // only written by the store thread
+  volatile unsigned long failedCount; // messages, same as failedBytes
+  volatile bool holdQueue;      // queued messages wait for failedBatches
+  uint64_t nextRetry;           // monotonicMillis()
+  unsigned long retryBackoff;   // in milliseconds, 0 if the last write worked
+
+  // fb303 counter names for the above, built once
+  std::string failedBatchesCounter;
+  std::string failedBytesCounter;
+  std::string retryBackoffCounter;
+  std::string journalBytesCounter;
+
+  pthread_t storeThread;         // unless we have a scheduler
+  StoreScheduler* scheduler;    // NULL if we have our own thread
+  volatile int taskState;       // a task_state_t, changed atomically
 
   // Mutexes
   pthread_mutex_t cmdMutex;     // Must be held to read/modify cmdQueue
-  pthread_mutex_t msgMutex;     // Must be held to read/modify msgQueue
-  pthread_mutex_t hasWorkMutex; // Must be held to read/modify hasWork
+  pthread_mutex_t stoppedMutex; // Must be held to set taskState to TASK_STOPPED
   // If acquiring multiple mutexes, always acquire in this order:
-  // {cmdMutex, msgMutex, hasWorkMutex}
+  // {cmdMutex, stoppedMutex}
 
-  bool hasWork;  // whether there are messages or commands queued
-  pthread_cond_t hasWorkCond; // cond variable to wait on for hasWork
+  // Whether there are messages or commands queued. Set to 1 with a CAS, and
+  // the store thread waits for it with a futex, so waking the thread is one
+  // syscall and only happens when it might be asleep.
+  volatile int hasWork;
+  pthread_cond_t stoppedCond;   // to wait for TASK_STOPPED
 
   bool stopping;
+  bool storeOpen;
+  uint64_t lastPeriodicCheck;   // monotonicMillis()
+  uint64_t lastHandleMessages;  // monotonicMillis()
   bool isModel;
   bool multiCategory; // Whether multiple categories are handled
 
@@ -114,12 +200,51 @@ class StoreQueue {
   std::string   categoryHandled;  // what category this store is handling
   time_t        checkPeriod;      // how often to call periodicCheck in seconds
   unsigned long targetWriteSize;  // in bytes
-  time_t        maxWriteInterval; // in seconds
+  unsigned long maxWriteInterval; // in milliseconds
+  bool          adaptiveWriteSize; // adjust writeSize from store latency
+  unsigned long minWriteSize;     // in bytes, bounds for writeSize
+  unsigned long maxWriteSize;     // in bytes
+  unsigned long targetWriteLatency; // in milliseconds
   bool          mustSucceed;      // Always retry even if secondary fails
+  store_priority_t priority;
+  unsigned long minRetryBackoff;  // in milliseconds
+  unsigned long maxRetryBackoff;  // in milliseconds
+  unsigned long maxFailedBatches; // 0 for no limit
+  unsigned long maxFailedBytes;   // 0 for no limit
+  std::string   journalPath;      // empty for no journal
+  unsigned long journalWatermark; // in bytes
+  unsigned long journalSegmentSize; // in bytes
   std::string   triggerPath;      // Run external script
 
+  // The batch size actually used. Same as targetWriteSize unless
+  // adaptiveWriteSize is set.
+  volatile unsigned long writeSize;
+  std::string writeSizeCounter;
+
   // Store that will handle messages. This can contain other stores.
   boost::shared_ptr<Store> store;
+
+  // Optional store for failed batches we can't retain, and for queued
+  // messages while the retained batches are at their limit
+  boost::shared_ptr<Store> spillStore;
+
+  // Optional overflow journal on local disk, for queued messages that would
+  // take us over journalWatermark while the store is failing
+  boost::shared_ptr<StoreJournal> journal;
+
+  // With num_shards, this queue is shard 0 of its category and owns the
+  // other shards. addMessage spreads messages over all of them.
+  std::vector<boost::shared_ptr<StoreQueue> > shards;
+  bool shardByKey;              // otherwise round robin
+  char shardKeyDelimiter;       // the key is the message up to this
+  volatile unsigned long nextShard;
+  std::string shardName;        // "-shard<N>" on every shard of a category
+
+  // how long the oldest message in a batch waited, and how long the store
+  // took with the batch
+  StageLatency queueLatency;
+  StageLatency handleLatency;
+  StageLatency flushLatency;
 };
 
 #endif //!defined SCRIBE_STORE_QUEUE_H
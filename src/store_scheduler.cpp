@@ -0,0 +1,311 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include "common.h"
+#include "store_queue.h"
+#include "store_scheduler.h"
+#include "stats.h"
+#include "thread_placement.h"
+
+using namespace std;
+
+boost::shared_ptr<StoreScheduler> g_StoreScheduler;
+
+namespace {
+
+struct WorkerArg {
+  StoreScheduler* scheduler;
+  unsigned worker;
+};
+
+void* workerThreadStatic(void *arg_ptr) {
+  WorkerArg* arg = (WorkerArg*)arg_ptr;
+  StoreScheduler* scheduler = arg->scheduler;
+  unsigned worker = arg->worker;
+  delete arg;
+
+  ThreadPlacement::placeCurrentThread(THREAD_STORE);
+  scheduler->workerMember(worker);
+  return NULL;
+}
+
+void* timerThreadStatic(void *this_ptr) {
+  StoreScheduler *scheduler_ptr = (StoreScheduler*)this_ptr;
+  ThreadPlacement::placeCurrentThread(THREAD_STORE);
+  scheduler_ptr->timerMember();
+  return NULL;
+}
+
+} // namespace
+
+StoreScheduler::StoreScheduler(unsigned long num_threads)
+  : numThreads(num_threads ? num_threads : 1),
+    running(false),
+    stopping(false),
+    nextWorker(0),
+    pendingTasks(0),
+    idleWorkers(0) {
+  pthread_mutex_init(&idleMutex, NULL);
+  pthread_cond_init(&idleCond, NULL);
+  pthread_mutex_init(&timerMutex, NULL);
+
+  pthread_condattr_t cond_attr;
+  pthread_condattr_init(&cond_attr);
+  pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timerCond, &cond_attr);
+  pthread_condattr_destroy(&cond_attr);
+
+  for (unsigned long i = 0; i < numThreads; ++i) {
+    Worker* worker = new Worker;
+    pthread_mutex_init(&worker->lock, NULL);
+    workers.push_back(worker);
+  }
+}
+
+StoreScheduler::~StoreScheduler() {
+  stop();
+
+  for (unsigned long i = 0; i < workers.size(); ++i) {
+    pthread_mutex_destroy(&workers[i]->lock);
+    delete workers[i];
+  }
+  pthread_mutex_destroy(&idleMutex);
+  pthread_cond_destroy(&idleCond);
+  pthread_mutex_destroy(&timerMutex);
+  pthread_cond_destroy(&timerCond);
+}
+
+bool StoreScheduler::start() {
+  if (running) {
+    return true;
+  }
+  stopping = false;
+
+  for (unsigned long i = 0; i < numThreads; ++i) {
+    WorkerArg* arg = new WorkerArg;
+    arg->scheduler = this;
+    arg->worker = i;
+    if (pthread_create(&workers[i]->thread, NULL, workerThreadStatic,
+                       (void*)arg) != 0) {
+      LOG_OPER("failed to create store worker thread: %s", strerror(errno));
+      delete arg;
+      stopThreads(i, false);
+      return false;
+    }
+  }
+
+  if (pthread_create(&timerThread, NULL, timerThreadStatic, (void*)this) != 0) {
+    LOG_OPER("failed to create store timer thread: %s", strerror(errno));
+    stopThreads(numThreads, false);
+    return false;
+  }
+
+  running = true;
+  LOG_OPER("running stores on <%lu> worker threads", numThreads);
+  return true;
+}
+
+// All StoreQueues should have been stopped first
+void StoreScheduler::stop() {
+  if (running) {
+    stopThreads(numThreads, true);
+    running = false;
+  }
+}
+
+void StoreScheduler::stopThreads(unsigned long num_workers, bool timer) {
+  pthread_mutex_lock(&idleMutex);
+  stopping = true;
+  pthread_cond_broadcast(&idleCond);
+  pthread_mutex_unlock(&idleMutex);
+
+  pthread_mutex_lock(&timerMutex);
+  pthread_cond_signal(&timerCond);
+  pthread_mutex_unlock(&timerMutex);
+
+  for (unsigned long i = 0; i < num_workers; ++i) {
+    pthread_join(workers[i]->thread, NULL);
+  }
+  if (timer) {
+    pthread_join(timerThread, NULL);
+  }
+}
+
+void StoreScheduler::schedule(StoreQueue* queue) {
+  for (;;) {
+    int state = queue->taskState;
+    if (state == StoreQueue::TASK_IDLE) {
+      if (__sync_bool_compare_and_swap(&queue->taskState, state,
+                                       StoreQueue::TASK_SCHEDULED)) {
+        push(__sync_fetch_and_add(&nextWorker, 1) % numThreads, queue);
+        return;
+      }
+    } else if (state == StoreQueue::TASK_RUNNING) {
+      // whoever is running it will schedule it again when it's done
+      if (__sync_bool_compare_and_swap(&queue->taskState, state,
+                                       StoreQueue::TASK_RERUN)) {
+        return;
+      }
+    } else {
+      // already scheduled, or stopped
+      return;
+    }
+  }
+}
+
+void StoreScheduler::remove(StoreQueue* queue) {
+  pthread_mutex_lock(&timerMutex);
+  map<StoreQueue*, uint64_t>::iterator iter = timerByQueue.find(queue);
+  if (iter != timerByQueue.end()) {
+    timers.erase(make_pair(iter->second, queue));
+    timerByQueue.erase(iter);
+  }
+  pthread_mutex_unlock(&timerMutex);
+}
+
+void StoreScheduler::push(unsigned worker, StoreQueue* queue) {
+  pthread_mutex_lock(&workers[worker]->lock);
+  workers[worker]->tasks[queue->getPriority()].push_back(queue);
+  pthread_mutex_unlock(&workers[worker]->lock);
+
+  // take() decrements without idleMutex, so this has to be atomic too; the
+  // lock is still needed so an idle worker can't miss the signal
+  pthread_mutex_lock(&idleMutex);
+  __sync_add_and_fetch(&pendingTasks, 1);
+  if (idleWorkers) {
+    pthread_cond_signal(&idleCond);
+  }
+  pthread_mutex_unlock(&idleMutex);
+}
+
+// Newest task from our own deque, otherwise the oldest task we can steal,
+// highest priority first
+StoreQueue* StoreScheduler::take(unsigned worker) {
+  StoreQueue* queue = NULL;
+
+  for (int priority = NUM_PRIORITIES - 1; !queue && priority >= 0; --priority) {
+    pthread_mutex_lock(&workers[worker]->lock);
+    deque<StoreQueue*>& own = workers[worker]->tasks[priority];
+    if (!own.empty()) {
+      queue = own.back();
+      own.pop_back();
+    }
+    pthread_mutex_unlock(&workers[worker]->lock);
+
+    for (unsigned long i = 1; !queue && i < numThreads; ++i) {
+      Worker* victim = workers[(worker + i) % numThreads];
+      pthread_mutex_lock(&victim->lock);
+      deque<StoreQueue*>& tasks = victim->tasks[priority];
+      if (!tasks.empty()) {
+        queue = tasks.front();
+        tasks.pop_front();
+      }
+      pthread_mutex_unlock(&victim->lock);
+    }
+  }
+
+  if (queue) {
+    __sync_sub_and_fetch(&pendingTasks, 1);
+  }
+  return queue;
+}
+
+void StoreScheduler::run(unsigned worker, StoreQueue* queue) {
+  queue->taskState = StoreQueue::TASK_RUNNING;
+  __sync_synchronize();
+
+  uint64_t next_run;
+  if (!queue->processWork(next_run)) {
+    // the queue may be destroyed as soon as this returns
+    queue->taskStopped();
+    return;
+  }
+
+  // Set the timer before the queue can be scheduled again, because once
+  // it is, it could be stopped and destroyed at any time.
+  setTimer(queue, next_run);
+
+  if (!__sync_bool_compare_and_swap(&queue->taskState,
+                                    StoreQueue::TASK_RUNNING,
+                                    StoreQueue::TASK_IDLE)) {
+    // someone scheduled it while it was running
+    queue->taskState = StoreQueue::TASK_SCHEDULED;
+    push(worker, queue);
+  }
+}
+
+void StoreScheduler::setTimer(StoreQueue* queue, uint64_t when) {
+  pthread_mutex_lock(&timerMutex);
+  map<StoreQueue*, uint64_t>::iterator iter = timerByQueue.find(queue);
+  if (iter != timerByQueue.end()) {
+    timers.erase(make_pair(iter->second, queue));
+  }
+  timerByQueue[queue] = when;
+  timers.insert(make_pair(when, queue));
+
+  if (timers.begin()->second == queue) {
+    pthread_cond_signal(&timerCond);
+  }
+  pthread_mutex_unlock(&timerMutex);
+}
+
+void StoreScheduler::workerMember(unsigned worker) {
+  while (!stopping) {
+    StoreQueue* queue = take(worker);
+    if (queue) {
+      run(worker, queue);
+      continue;
+    }
+
+    pthread_mutex_lock(&idleMutex);
+    while (!pendingTasks && !stopping) {
+      ++idleWorkers;
+      pthread_cond_wait(&idleCond, &idleMutex);
+      --idleWorkers;
+    }
+    pthread_mutex_unlock(&idleMutex);
+  }
+}
+
+void StoreScheduler::timerMember() {
+  struct timespec abs_timeout;
+  memset(&abs_timeout, 0, sizeof(struct timespec));
+
+  pthread_mutex_lock(&timerMutex);
+  while (!stopping) {
+    if (timers.empty()) {
+      pthread_cond_wait(&timerCond, &timerMutex);
+      continue;
+    }
+
+    timer_set_t::iterator first = timers.begin();
+    if (first->first > monotonicMillis()) {
+      abs_timeout.tv_sec = first->first / 1000;
+      abs_timeout.tv_nsec = (first->first % 1000) * 1000000;
+      pthread_cond_timedwait(&timerCond, &timerMutex, &abs_timeout);
+      continue;
+    }
+
+    // remove() can't return while we hold timerMutex, so the queue is
+    // still alive here
+    StoreQueue* queue = first->second;
+    timerByQueue.erase(queue);
+    timers.erase(first);
+    schedule(queue);
+  }
+  pthread_mutex_unlock(&timerMutex);
+}
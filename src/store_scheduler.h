@@ -0,0 +1,110 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_STORE_SCHEDULER_H
+#define SCRIBE_STORE_SCHEDULER_H
+
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+
+#include "store_queue.h"
+
+/*
+ * Runs StoreQueues on a fixed pool of worker threads instead of giving each
+ * one its own thread. Enabled with num_store_threads=N in the global config.
+ *
+ * A StoreQueue is scheduled when it gets a command, when its queue grows
+ * past target_write_size, or when a timer for its next max_write_interval
+ * or periodic check expires. A scheduled queue sits in one worker's deque.
+ * Workers take their own newest task first and steal the oldest task from
+ * other workers when they run out. Each worker keeps a deque per store
+ * priority, and no lower priority task is taken, from any worker, while a
+ * higher priority one is waiting.
+ *
+ * A queue is never in more than one deque and never runs on two workers at
+ * once, so messages within a category stay in order.
+ */
+class StoreScheduler {
+ public:
+  StoreScheduler(unsigned long num_threads);
+  virtual ~StoreScheduler();
+
+  bool start();
+  void stop();
+  unsigned long getNumThreads() { return numThreads; }
+
+  // Makes sure queue runs soon. Cheap if it is already scheduled.
+  void schedule(StoreQueue* queue);
+
+  // Forgets about queue. Must be called once it has stopped, before it
+  // is destroyed.
+  void remove(StoreQueue* queue);
+
+  // these need to be public for the thread creation to get to them,
+  // but no one else should ever call them.
+  void workerMember(unsigned worker);
+  void timerMember();
+
+ private:
+  struct Worker {
+    pthread_t thread;
+    pthread_mutex_t lock;  // Must be held to read/modify tasks
+    std::deque<StoreQueue*> tasks[NUM_PRIORITIES];
+  };
+
+  void push(unsigned worker, StoreQueue* queue);
+  StoreQueue* take(unsigned worker);
+  void run(unsigned worker, StoreQueue* queue);
+  void setTimer(StoreQueue* queue, uint64_t when);
+  void stopThreads(unsigned long num_workers, bool timer);
+
+  unsigned long numThreads;
+  std::vector<Worker*> workers;
+  volatile bool running;
+  volatile bool stopping;
+  unsigned nextWorker;  // round robin for tasks scheduled from other threads
+
+  // workers with nothing to do wait on idleCond
+  pthread_mutex_t idleMutex;
+  pthread_cond_t idleCond;
+  volatile unsigned long pendingTasks;
+  unsigned long idleWorkers;
+
+  // when each idle queue next needs to run, in monotonicMillis()
+  typedef std::set<std::pair<uint64_t, StoreQueue*> > timer_set_t;
+  pthread_t timerThread;
+  pthread_mutex_t timerMutex;  // Must be held to read/modify the two below
+  pthread_cond_t timerCond;    // uses CLOCK_MONOTONIC
+  timer_set_t timers;
+  std::map<StoreQueue*, uint64_t> timerByQueue;
+
+  // disallow copy, assignment, and empty construction
+  StoreScheduler();
+  StoreScheduler(const StoreScheduler& rhs);
+  StoreScheduler& operator=(const StoreScheduler& rhs);
+};
+
+// NULL unless num_store_threads is set, in which case every StoreQueue
+// created from then on runs on it
+extern boost::shared_ptr<StoreScheduler> g_StoreScheduler;
+
+#endif // SCRIBE_STORE_SCHEDULER_H
@@ -129,7 +129,8 @@ bool ThriftFileStore::openInternal(bool incrementFilename, struct tm* current_ti
     current_time = &timeinfo;
   }
 
-  int suffix = findNewestFile(makeBaseFilename(current_time));
+  string base_filename = makeBaseFilename(current_time);
+  int suffix = findNewestFile(base_filename);
 
   if (incrementFilename) {
     ++suffix;
@@ -191,6 +192,7 @@ bool ThriftFileStore::openInternal(bool incrementFilename, struct tm* current_ti
     }
     currentFilename = filename;
     eventsWritten = 0;
+    indexOpenedFile(base_filename, suffix);
     setStatus("");
   } catch (TException te) {
     LOG_OPER("[%s] Failed to open file <%s> for writing: %s\n", categoryHandled.c_str(), filename.c_str(), te.what());
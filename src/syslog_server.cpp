@@ -0,0 +1,386 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "scribe_server.h"
+#include "syslog_server.h"
+#include "thread_placement.h"
+
+using namespace std;
+using namespace scribe::thrift;
+
+#define DEFAULT_SYSLOG_BATCH_SIZE        64
+#define DEFAULT_SYSLOG_MAX_MESSAGE_SIZE  8192
+#define DEFAULT_SYSLOG_RCVBUF            4194304
+#define DEFAULT_SYSLOG_CATEGORY          "syslog"
+#define SYSLOG_POLL_INTERVAL_SEC         1
+
+#ifndef SO_RXQ_OVFL
+#define SO_RXQ_OVFL 40
+#endif
+
+static const char* facilityNames[] = {
+  "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news",
+  "uucp", "cron", "authpriv", "ftp", "ntp", "security", "console", "clock",
+  "local0", "local1", "local2", "local3", "local4", "local5", "local6", "local7"
+};
+#define NUM_FACILITIES (sizeof(facilityNames) / sizeof(facilityNames[0]))
+
+static StatCounter statSyslogKernelDrops("syslog kernel drops");
+static StatCounter statSyslogTruncated("syslog truncated");
+static StatCounter statSyslogReceived("syslog received");
+static StatCounter statSyslogDropped("syslog dropped");
+
+void* syslogThreadStatic(void *this_ptr) {
+  SyslogServer *server_ptr = (SyslogServer*)this_ptr;
+  ThreadPlacement::placeCurrentThread(THREAD_IO);
+  server_ptr->threadMember();
+  return NULL;
+}
+
+SyslogServer::SyslogServer(unsigned long listen_port)
+  : port(listen_port),
+    sock(-1),
+    running(false),
+    stopping(false),
+    batchSize(DEFAULT_SYSLOG_BATCH_SIZE),
+    maxMessageSize(DEFAULT_SYSLOG_MAX_MESSAGE_SIZE),
+    rcvBufSize(DEFAULT_SYSLOG_RCVBUF),
+    defaultCategory(DEFAULT_SYSLOG_CATEGORY),
+    lastKernelDrops(0) {
+  pthread_mutex_init(&configMutex, NULL);
+}
+
+SyslogServer::~SyslogServer() {
+  stop();
+  pthread_mutex_destroy(&configMutex);
+}
+
+void SyslogServer::configure(StoreConf& config) {
+  if (!running) {
+    config.getUnsigned("syslog_batch_size", batchSize);
+    config.getUnsigned("syslog_max_message_size", maxMessageSize);
+    config.getUnsigned("syslog_rcvbuf", rcvBufSize);
+    if (batchSize == 0) {
+      LOG_OPER("Bad config - syslog_batch_size must be positive, using <%d>",
+               DEFAULT_SYSLOG_BATCH_SIZE);
+      batchSize = DEFAULT_SYSLOG_BATCH_SIZE;
+    }
+  }
+
+  string default_category = DEFAULT_SYSLOG_CATEGORY;
+  config.getString("syslog_default_category", default_category);
+
+  // Parse key:category pairs, separated by whitespace
+  category_map_t category_map;
+  string mapping;
+  if (config.getString("syslog_category_map", mapping)) {
+    stringstream ss(mapping);
+    string pair;
+    while (ss >> pair) {
+      string::size_type colon = pair.find(':');
+      if (colon == string::npos || colon == 0 || colon == pair.size() - 1) {
+        LOG_OPER("Bad config - syslog_category_map entry <%s> is not key:category",
+                 pair.c_str());
+        continue;
+      }
+      category_map[pair.substr(0, colon)] = pair.substr(colon + 1);
+    }
+  }
+
+  pthread_mutex_lock(&configMutex);
+  defaultCategory = default_category;
+  categoryMap.swap(category_map);
+  pthread_mutex_unlock(&configMutex);
+}
+
+bool SyslogServer::openSocket() {
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    LOG_OPER("syslog: failed to create socket: %s", strerror(errno));
+    return false;
+  }
+
+  int one = 1;
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  // Ask the kernel to report how many datagrams it dropped on this socket
+  if (setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) != 0) {
+    LOG_OPER("syslog: SO_RXQ_OVFL not supported, kernel drops will not be counted");
+  }
+
+  if (rcvBufSize > 0) {
+    int size = (int)rcvBufSize;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0) {
+      LOG_OPER("syslog: failed to set receive buffer to <%lu> bytes", rcvBufSize);
+    }
+  }
+
+  // wake up periodically so that stop() doesn't have to wait for traffic
+  struct timeval timeout;
+  timeout.tv_sec = SYSLOG_POLL_INTERVAL_SEC;
+  timeout.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+    LOG_OPER("syslog: failed to bind to port %lu: %s", port, strerror(errno));
+    close(sock);
+    sock = -1;
+    return false;
+  }
+  return true;
+}
+
+bool SyslogServer::start() {
+  if (running) {
+    return true;
+  }
+
+  if (!openSocket()) {
+    return false;
+  }
+
+  // one buffer per datagram in the batch, all carved out of one allocation
+  msgHdrs.resize(batchSize);
+  iovecs.resize(batchSize);
+  recvBuffer.resize(batchSize * maxMessageSize);
+  controlBuffer.resize(batchSize * CMSG_SPACE(sizeof(uint32_t)));
+
+  stopping = false;
+  if (pthread_create(&listenThread, NULL, syslogThreadStatic, (void*) this) != 0) {
+    LOG_OPER("syslog: failed to create listener thread");
+    close(sock);
+    sock = -1;
+    return false;
+  }
+  running = true;
+
+  LOG_OPER("Listening for syslog on UDP port %lu", port);
+  return true;
+}
+
+void SyslogServer::stop() {
+  if (running) {
+    stopping = true;
+    pthread_join(listenThread, NULL);
+    running = false;
+  }
+  if (sock >= 0) {
+    close(sock);
+    sock = -1;
+  }
+}
+
+void SyslogServer::threadMember() {
+  LOG_OPER("syslog thread starting");
+
+  while (!stopping) {
+    for (unsigned i = 0; i < batchSize; ++i) {
+      iovecs[i].iov_base = &recvBuffer[i * maxMessageSize];
+      iovecs[i].iov_len = maxMessageSize;
+
+      struct msghdr* hdr = &msgHdrs[i].msg_hdr;
+      memset(hdr, 0, sizeof(struct msghdr));
+      hdr->msg_iov = &iovecs[i];
+      hdr->msg_iovlen = 1;
+      hdr->msg_control = &controlBuffer[i * CMSG_SPACE(sizeof(uint32_t))];
+      hdr->msg_controllen = CMSG_SPACE(sizeof(uint32_t));
+      msgHdrs[i].msg_len = 0;
+    }
+
+    // Block for the first datagram, then take whatever else is queued
+    int count = recvmmsg(sock, &msgHdrs[0], batchSize, MSG_WAITFORONE, NULL);
+    if (count < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        LOG_OPER("syslog: recvmmsg failed: %s", strerror(errno));
+        sleep(SYSLOG_POLL_INTERVAL_SEC);
+      }
+      continue;
+    }
+
+    if (count > 0) {
+      handleBatch(count);
+    }
+  }
+
+  LOG_OPER("syslog thread exiting");
+}
+
+void SyslogServer::handleBatch(unsigned count) {
+  vector<LogEntry> entries;
+  entries.reserve(count);
+
+  unsigned long truncated = 0;
+  uint32_t kernel_drops = lastKernelDrops;
+  bool have_drops = false;
+
+  for (unsigned i = 0; i < count; ++i) {
+    struct msghdr* hdr = &msgHdrs[i].msg_hdr;
+
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+         cmsg != NULL;
+         cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+        memcpy(&kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+        have_drops = true;
+      }
+    }
+
+    if (hdr->msg_flags & MSG_TRUNC) {
+      ++truncated;
+    }
+
+    const char* data = (const char*)iovecs[i].iov_base;
+    size_t length = msgHdrs[i].msg_len;
+    if (length > maxMessageSize) {
+      length = maxMessageSize;
+    }
+
+    // syslog senders commonly terminate with a newline or a null
+    while (length > 0 && (data[length - 1] == '\n' || data[length - 1] == '\0')) {
+      --length;
+    }
+    if (length == 0) {
+      continue;
+    }
+
+    entries.push_back(LogEntry());
+    entries.back().category = getCategory(data, length);
+    entries.back().message.assign(data, length);
+  }
+
+  // the overflow counter is cumulative for the socket, so report the delta
+  if (have_drops && kernel_drops != lastKernelDrops) {
+    statSyslogKernelDrops.increment((uint32_t)(kernel_drops - lastKernelDrops));
+    lastKernelDrops = kernel_drops;
+  }
+  if (truncated) {
+    statSyslogTruncated.increment(truncated);
+  }
+
+  if (entries.empty()) {
+    return;
+  }
+
+  statSyslogReceived.increment(entries.size());
+  if (g_Handler->Log(entries) != OK) {
+    // There is no way to ask a syslog sender to retry
+    statSyslogDropped.increment(entries.size());
+  }
+}
+
+string SyslogServer::getCategory(const char* data, size_t length) {
+  int facility = -1;
+  string app_name;
+  parseHeader(data, length, facility, app_name);
+
+  string category;
+  pthread_mutex_lock(&configMutex);
+  category_map_t::const_iterator iter = categoryMap.end();
+  if (!app_name.empty()) {
+    iter = categoryMap.find(app_name);
+  }
+  if (iter == categoryMap.end() && facility >= 0 &&
+      facility < (int)NUM_FACILITIES) {
+    iter = categoryMap.find(facilityNames[facility]);
+  }
+  category = (iter != categoryMap.end()) ? iter->second : defaultCategory;
+  pthread_mutex_unlock(&configMutex);
+
+  return category;
+}
+
+// Returns true if the datagram has a valid PRI. app_name is left empty if
+// it can't be found.
+//
+// RFC5424: <PRI>VERSION SP TIMESTAMP SP HOSTNAME SP APP-NAME SP ...
+// RFC3164: <PRI>Mmm dd hh:mm:ss SP HOSTNAME SP TAG[PID]: MSG
+bool SyslogServer::parseHeader(const char* data, size_t length,
+                               int& facility, string& app_name) {
+  const char* end = data + length;
+  const char* p = data;
+
+  if (p >= end || *p != '<') {
+    return false;
+  }
+  ++p;
+
+  int pri = 0;
+  const char* pri_start = p;
+  while (p < end && isdigit(*p) && p - pri_start < 3) {
+    pri = pri * 10 + (*p - '0');
+    ++p;
+  }
+  if (p == pri_start || p >= end || *p != '>' || pri > 191) {
+    return false;
+  }
+  ++p;
+  facility = pri >> 3;
+
+  if (p < end && isdigit(*p)) {
+    // RFC5424, skip VERSION, TIMESTAMP and HOSTNAME
+    for (int field = 0; field < 3; ++field) {
+      while (p < end && *p != ' ') {
+        ++p;
+      }
+      if (p >= end) {
+        return true;
+      }
+      ++p;
+    }
+    const char* name_start = p;
+    while (p < end && *p != ' ') {
+      ++p;
+    }
+    if (p - name_start != 1 || *name_start != '-') {
+      app_name.assign(name_start, p - name_start);
+    }
+    return true;
+  }
+
+  // RFC3164, skip the timestamp if present
+  if (end - p >= 16 && p[3] == ' ' && p[6] == ' ' && p[9] == ':' &&
+      p[12] == ':' && p[15] == ' ') {
+    p += 16;
+  }
+
+  // The hostname is optional. The tag is the first token that ends with
+  // ':' or contains '['.
+  for (int token = 0; token < 2 && p < end; ++token) {
+    const char* token_start = p;
+    while (p < end && *p != ' ' && *p != ':' && *p != '[') {
+      ++p;
+    }
+    if (p < end && (*p == ':' || *p == '[')) {
+      app_name.assign(token_start, p - token_start);
+      return true;
+    }
+    while (p < end && *p == ' ') {
+      ++p;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,99 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_SYSLOG_SERVER_H
+#define SCRIBE_SYSLOG_SERVER_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "conf.h"
+
+/*
+ * This class listens for syslog datagrams on a UDP port and feeds them
+ * into the same Log() path used by Thrift clients.
+ *
+ * Datagrams are drained in batches with recvmmsg, so a burst costs one
+ * syscall per batch rather than one per message. The category of each
+ * message is taken from the RFC5424 APP-NAME or RFC3164 TAG if it is
+ * mapped, then from the facility name, and falls back to a default.
+ *
+ * Global config:
+ *   syslog_port=514
+ *   syslog_batch_size=64           datagrams per recvmmsg call
+ *   syslog_max_message_size=8192   longer datagrams are truncated
+ *   syslog_rcvbuf=4194304          SO_RCVBUF to request, 0 for system default
+ *   syslog_default_category=syslog
+ *   syslog_category_map=local0:web sshd:auth kern:kernel
+ */
+class SyslogServer {
+ public:
+  SyslogServer(unsigned long port);
+  virtual ~SyslogServer();
+
+  // Reads the syslog_* settings. Safe to call again while running, but the
+  // port, batch size, message size and receive buffer only apply at start.
+  void configure(StoreConf& config);
+
+  bool start();
+  void stop();
+  unsigned long getPort() { return port; }
+
+  // this needs to be public for the thread creation to get to it,
+  // but no one else should ever call it.
+  void threadMember();
+
+  // Exposed for testing. Returns the category for one syslog datagram.
+  std::string getCategory(const char* data, size_t length);
+
+ private:
+  typedef std::map<std::string, std::string> category_map_t;
+
+  bool openSocket();
+  void handleBatch(unsigned count);
+  static bool parseHeader(const char* data, size_t length,
+                          /*out*/ int& facility, /*out*/ std::string& app_name);
+
+  unsigned long port;
+  int sock;
+  pthread_t listenThread;
+  bool running;
+  volatile bool stopping;
+
+  // configuration
+  unsigned long batchSize;
+  unsigned long maxMessageSize;
+  unsigned long rcvBufSize;
+  std::string defaultCategory;
+  category_map_t categoryMap;
+  pthread_mutex_t configMutex; // Must be held to read/modify the two above
+
+  // receive state, only touched by the listen thread
+  std::vector<struct mmsghdr> msgHdrs;
+  std::vector<struct iovec> iovecs;
+  std::vector<char> recvBuffer;
+  std::vector<char> controlBuffer;
+  uint32_t lastKernelDrops;
+
+  // disallow copy, assignment, and empty construction
+  SyslogServer();
+  SyslogServer(const SyslogServer& rhs);
+  SyslogServer& operator=(const SyslogServer& rhs);
+};
+
+#endif // SCRIBE_SYSLOG_SERVER_H
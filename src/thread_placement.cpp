@@ -0,0 +1,257 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <sched.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "common.h"
+#include "thread_placement.h"
+
+using namespace std;
+
+#define MAX_NUMA_NODES 1024
+
+namespace {
+
+const char* roleNames[NUM_THREAD_ROLES] = { "io", "processor", "store" };
+
+struct RolePlacement {
+  string cpuList;        // as configured, empty for none
+  cpu_set_t cpus;
+  set<int> nodes;        // NUMA nodes of the CPUs
+  unsigned long placed;  // threads placed so far
+};
+
+struct PlacementRegistry {
+  pthread_mutex_t lock;
+  cpu_set_t initialCpus;  // the process affinity before we changed anything
+  bool numaLocalMemory;
+  RolePlacement roles[NUM_THREAD_ROLES];
+
+  PlacementRegistry();
+};
+
+PlacementRegistry::PlacementRegistry()
+  : numaLocalMemory(false) {
+  pthread_mutex_init(&lock, NULL);
+  CPU_ZERO(&initialCpus);
+  if (sched_getaffinity(0, sizeof(cpu_set_t), &initialCpus) != 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      CPU_SET(cpu, &initialCpus);
+    }
+  }
+  for (int i = 0; i < NUM_THREAD_ROLES; ++i) {
+    CPU_ZERO(&roles[i].cpus);
+    roles[i].placed = 0;
+  }
+}
+
+// Created on first use, which is from the main thread while configuring,
+// so initialCpus is what the process was started with
+PlacementRegistry& registry() {
+  static PlacementRegistry* reg = new PlacementRegistry();
+  return *reg;
+}
+
+// Parses a taskset style list, e.g. "0-3,8,10-11"
+bool parseCpuList(const string& list, cpu_set_t& cpus) {
+  CPU_ZERO(&cpus);
+  stringstream ss(list);
+  string range;
+  while (getline(ss, range, ',')) {
+    char* end;
+    long first = strtol(range.c_str(), &end, 10);
+    long last = first;
+    if (end == range.c_str()) {
+      return false;
+    }
+    if (*end == '-') {
+      const char* next = end + 1;
+      last = strtol(next, &end, 10);
+      if (end == next) {
+        return false;
+      }
+    }
+    if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+      return false;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      CPU_SET(cpu, &cpus);
+    }
+  }
+  return CPU_COUNT(&cpus) > 0;
+}
+
+// The NUMA node of a cpu, from sysfs, or -1 if we can't tell
+int cpuNode(int cpu) {
+  ostringstream path;
+  path << "/sys/devices/system/cpu/cpu" << cpu;
+  DIR* dir = opendir(path.str().c_str());
+  if (!dir) {
+    return -1;
+  }
+
+  int node = -1;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, "node", 4) == 0 &&
+        isdigit((unsigned char)entry->d_name[4])) {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+}
+
+string describeNodes(const set<int>& nodes) {
+  ostringstream desc;
+  for (set<int>::const_iterator iter = nodes.begin();
+       iter != nodes.end();
+       ++iter) {
+    desc << (iter == nodes.begin() ? "" : ",");
+    if (*iter < 0) {
+      desc << "unknown";
+    } else {
+      desc << *iter;
+    }
+  }
+  return desc.str();
+}
+
+// The node a role's memory should be on, or -1 if its CPUs aren't all on
+// one known node
+int localNode(const RolePlacement& role) {
+  if (role.nodes.size() != 1 || *role.nodes.begin() < 0 ||
+      *role.nodes.begin() >= MAX_NUMA_NODES) {
+    return -1;
+  }
+  return *role.nodes.begin();
+}
+
+} // namespace
+
+__thread bool ThreadPlacement::placed = false;
+
+void ThreadPlacement::configure(StoreConf& config) {
+  PlacementRegistry& reg = registry();
+
+  pthread_mutex_lock(&reg.lock);
+  string tmp;
+  reg.numaLocalMemory = config.getString("numa_local_memory", tmp) &&
+                        tmp == "yes";
+
+  for (int i = 0; i < NUM_THREAD_ROLES; ++i) {
+    RolePlacement& role = reg.roles[i];
+    string key = string(roleNames[i]) + "_thread_cpus";
+    role.cpuList.clear();
+    role.nodes.clear();
+    CPU_ZERO(&role.cpus);
+
+    string list;
+    if (!config.getString(key, list) || list.empty()) {
+      continue;
+    }
+    if (!parseCpuList(list, role.cpus)) {
+      LOG_OPER("Bad config - invalid cpu list <%s> for %s, not pinning",
+               list.c_str(), key.c_str());
+      CPU_ZERO(&role.cpus);
+      continue;
+    }
+
+    role.cpuList = list;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &role.cpus)) {
+        role.nodes.insert(cpuNode(cpu));
+      }
+    }
+  }
+  pthread_mutex_unlock(&reg.lock);
+
+  string report = getReport();
+  if (!report.empty()) {
+    LOG_OPER("thread placement: %s", report.c_str());
+  }
+}
+
+void ThreadPlacement::placeCurrentThread(thread_role_t role) {
+  PlacementRegistry& reg = registry();
+  placed = true;
+
+  pthread_mutex_lock(&reg.lock);
+  RolePlacement& placement = reg.roles[role];
+  cpu_set_t cpus = placement.cpuList.empty() ? reg.initialCpus
+                                             : placement.cpus;
+  bool numa_local_memory = reg.numaLocalMemory;
+  int node = localNode(placement);
+  if (!placement.cpuList.empty()) {
+    ++placement.placed;
+  }
+  pthread_mutex_unlock(&reg.lock);
+
+  // Always set these, so a thread doesn't keep the placement of whoever
+  // created it
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &cpus) != 0) {
+    LOG_OPER("failed to set cpu affinity for %s thread: %s",
+             roleNames[role], strerror(errno));
+  }
+
+  if (numa_local_memory) {
+    unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    long result;
+    if (node >= 0) {
+      mask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+      // the kernel reads one bit less than maxnode
+      result = syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+                       MAX_NUMA_NODES + 1);
+    } else {
+      result = syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    }
+    if (result != 0) {
+      LOG_OPER("failed to set memory policy for %s thread: %s",
+               roleNames[role], strerror(errno));
+    }
+  }
+}
+
+string ThreadPlacement::getReport() {
+  PlacementRegistry& reg = registry();
+  ostringstream report;
+
+  pthread_mutex_lock(&reg.lock);
+  for (int i = 0; i < NUM_THREAD_ROLES; ++i) {
+    RolePlacement& role = reg.roles[i];
+    if (role.cpuList.empty()) {
+      continue;
+    }
+    report << (report.tellp() > 0 ? "; " : "") << roleNames[i]
+           << " threads on cpus " << role.cpuList
+           << " (node " << describeNodes(role.nodes);
+    if (reg.numaLocalMemory) {
+      report << (localNode(role) >= 0 ? ", local memory" :
+                                        ", memory not bound");
+    }
+    report << ", " << role.placed << " placed)";
+  }
+  pthread_mutex_unlock(&reg.lock);
+
+  return report.str();
+}
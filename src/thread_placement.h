@@ -0,0 +1,71 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_THREAD_PLACEMENT_H
+#define SCRIBE_THREAD_PLACEMENT_H
+
+#include <string>
+
+#include "conf.h"
+
+enum thread_role_t {
+  THREAD_IO,         // the Thrift event loop, syslog and shm ingest
+  THREAD_PROCESSOR,  // Thrift worker threads running Log()
+  THREAD_STORE,      // StoreQueue and StoreScheduler threads
+  NUM_THREAD_ROLES
+};
+
+/*
+ * Pins each kind of thread to a set of CPUs, from the global config:
+ *
+ *   io_thread_cpus=0
+ *   processor_thread_cpus=1-7
+ *   store_thread_cpus=8-15,24-31
+ *
+ * CPU lists use the same syntax as taskset -c. With numa_local_memory=yes,
+ * a thread whose CPUs are all on one NUMA node also prefers that node for
+ * its memory, so the message buffers it allocates are local to it.
+ *
+ * Every thread places itself when it starts, so it doesn't matter which
+ * thread created it. A role with no CPUs configured gets the affinity the
+ * process started with. Threads keep their placement across a reconfigure;
+ * only threads started afterwards see the change.
+ */
+class ThreadPlacement {
+ public:
+  static void configure(StoreConf& config);
+
+  // Applies the placement for role to the calling thread
+  static void placeCurrentThread(thread_role_t role);
+
+  // For threads that might be any kind, such as the ones calling Log().
+  // Only the first call from a thread that hasn't been placed does anything.
+  static inline void placeCurrentThreadOnce(thread_role_t role) {
+    if (!placed) {
+      placeCurrentThread(role);
+    }
+  }
+
+  // One line per role with its CPUs, NUMA nodes and how many threads have
+  // been placed there
+  static std::string getReport();
+
+ private:
+  static __thread bool placed;
+};
+
+#endif // SCRIBE_THREAD_PLACEMENT_H
@@ -0,0 +1,537 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "common.h"
+#include "uring_file.h"
+
+// Kernel headers new enough to have the syscall have the ring layout too.
+// liburing isn't needed for the little we do.
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+// Per open file: URING_BUFFER_COUNT writes of up to URING_BUFFER_SIZE bytes
+// in flight, plus one fdatasync
+#define URING_BUFFER_COUNT 4
+#define URING_BUFFER_SIZE  262144
+#define URING_QUEUE_DEPTH  8
+#define URING_SYNC_TAG     URING_BUFFER_COUNT
+
+using namespace std;
+
+struct UringRing {
+  int fd;
+  void* sqMap;
+  size_t sqMapSize;
+  void* cqMap;
+  size_t cqMapSize;
+  void* sqeMap;
+  size_t sqeMapSize;
+
+  unsigned* sqHead;
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqArray;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  void* cqes;
+
+  char* buffers;
+  bool registered;  // if not, buffers are written with plain writev
+  unsigned inFlight;
+
+  // what each buffer's write in flight covers, to resubmit short writes
+  bool busy[URING_BUFFER_COUNT];
+  unsigned long offset[URING_BUFFER_COUNT];
+  unsigned long length[URING_BUFFER_COUNT];
+  unsigned long fileOffset[URING_BUFFER_COUNT];
+  struct iovec iovecs[URING_BUFFER_COUNT];
+};
+
+namespace {
+
+#ifdef __NR_io_uring_setup
+
+void destroyRing(UringRing* ring) {
+  if (ring->buffers) {
+    munmap(ring->buffers, URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+  }
+  if (ring->sqeMap) {
+    munmap(ring->sqeMap, ring->sqeMapSize);
+  }
+  if (ring->cqMap && ring->cqMap != ring->sqMap) {
+    munmap(ring->cqMap, ring->cqMapSize);
+  }
+  if (ring->sqMap) {
+    munmap(ring->sqMap, ring->sqMapSize);
+  }
+  if (ring->fd >= 0) {
+    close(ring->fd);
+  }
+  delete ring;
+}
+
+UringRing* createRing() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int ring_fd = syscall(__NR_io_uring_setup, URING_QUEUE_DEPTH, &params);
+  if (ring_fd < 0) {
+    return NULL;
+  }
+
+  UringRing* ring = new UringRing;
+  memset(ring, 0, sizeof(UringRing));
+  ring->fd = ring_fd;
+
+  ring->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqMapSize = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->sqMapSize = ring->cqMapSize = max(ring->sqMapSize, ring->cqMapSize);
+  }
+
+  void* map = mmap(NULL, ring->sqMapSize, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (map == MAP_FAILED) {
+    destroyRing(ring);
+    return NULL;
+  }
+  ring->sqMap = map;
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqMap = ring->sqMap;
+  } else {
+    map = mmap(NULL, ring->cqMapSize, PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+    if (map == MAP_FAILED) {
+      destroyRing(ring);
+      return NULL;
+    }
+    ring->cqMap = map;
+  }
+
+  ring->sqeMapSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  map = mmap(NULL, ring->sqeMapSize, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+  if (map == MAP_FAILED) {
+    destroyRing(ring);
+    return NULL;
+  }
+  ring->sqeMap = map;
+
+  char* sq = (char*)ring->sqMap;
+  ring->sqHead = (unsigned*)(sq + params.sq_off.head);
+  ring->sqTail = (unsigned*)(sq + params.sq_off.tail);
+  ring->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned*)(sq + params.sq_off.array);
+  char* cq = (char*)ring->cqMap;
+  ring->cqHead = (unsigned*)(cq + params.cq_off.head);
+  ring->cqTail = (unsigned*)(cq + params.cq_off.tail);
+  ring->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+  ring->cqes = cq + params.cq_off.cqes;
+
+  map = mmap(NULL, URING_BUFFER_COUNT * URING_BUFFER_SIZE,
+             PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    destroyRing(ring);
+    return NULL;
+  }
+  ring->buffers = (char*)map;
+
+  for (int i = 0; i < URING_BUFFER_COUNT; ++i) {
+    ring->iovecs[i].iov_base = ring->buffers + i * URING_BUFFER_SIZE;
+    ring->iovecs[i].iov_len = URING_BUFFER_SIZE;
+  }
+  // Registering can fail on RLIMIT_MEMLOCK with older kernels. Writes still
+  // work then, they just pin the pages on every call.
+  ring->registered =
+    syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS,
+            ring->iovecs, URING_BUFFER_COUNT) == 0;
+  return ring;
+}
+
+struct io_uring_sqe* nextSqe(UringRing* ring) {
+  unsigned tail = *ring->sqTail;
+  unsigned index = tail & *ring->sqMask;
+  struct io_uring_sqe* sqe = (struct io_uring_sqe*)ring->sqeMap + index;
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sqArray[index] = index;
+  return sqe;
+}
+
+// Submits the sqe from nextSqe
+bool submitSqe(UringRing* ring) {
+  unsigned tail = *ring->sqTail;
+  __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+  while (syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0) < 0) {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+      if (__atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) != tail) {
+        // the kernel took it anyway, so it will complete like any other
+        break;
+      }
+      // Take it back, or the next submit would send it along with its own,
+      // pointing at a buffer that may have been refilled by then
+      __atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+      return false;
+    }
+  }
+  ++ring->inFlight;
+  return true;
+}
+
+#else // !__NR_io_uring_setup
+
+void destroyRing(UringRing* ring) {
+}
+
+UringRing* createRing() {
+  return NULL;
+}
+
+#endif // __NR_io_uring_setup
+
+} // namespace
+
+UringFile::UringFile(const std::string& name, bool frame)
+  : PosixFile(name, frame),
+    ring(NULL),
+    fileOffset(0),
+    fillBuffer(-1),
+    fillLength(0),
+    syncInFlight(false),
+    failed(false) {
+}
+
+UringFile::~UringFile() {
+  close();
+}
+
+bool UringFile::openWrite() {
+  // Not O_APPEND, every write has its own offset so they can complete in
+  // any order
+  return openForWrite(O_WRONLY | O_CREAT);
+}
+
+bool UringFile::openTruncate() {
+  return openForWrite(O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+bool UringFile::openForWrite(int flags) {
+  if (!open(flags)) {
+    return false;
+  }
+  off_t end = lseek(fd, 0, SEEK_END);
+  fileOffset = end > 0 ? end : 0;
+  fillBuffer = -1;
+  fillLength = 0;
+  syncInFlight = false;
+  failed = false;
+
+  ring = createRing();
+  if (!ring) {
+    static bool warned = false;
+    if (!warned) {
+      LOG_OPER("io_uring is not available, fs_type=uring files will be "
+               "written synchronously");
+      warned = true;
+    }
+  }
+  return true;
+}
+
+void UringFile::close() {
+  if (ring) {
+    submitFill();
+    waitForAll();
+    destroyRing(ring);
+    ring = NULL;
+    if (failed) {
+      LOG_OPER("Closed file <%s> after failed writes", filename.c_str());
+    }
+  }
+  PosixFile::close();
+}
+
+bool UringFile::sync() {
+  if (!ring) {
+    return PosixFile::sync();
+  }
+  submitFill();
+  waitForAll();
+  return !failed && datasync();
+}
+
+#ifdef __NR_io_uring_setup
+
+bool UringFile::writeSegments(const write_segments_t& segments,
+                              unsigned long& written) {
+  if (!ring) {
+    return PosixFile::writeSegments(segments, written);
+  }
+
+  // Nothing is reported written when a write fails, not even data that was
+  // already copied, since we can't tell how much of it reached the file.
+  // The caller then retries the whole batch.
+  written = 0;
+  reap(false);
+  if (failed) {
+    return false;
+  }
+
+  for (write_segments_t::const_iterator iter = segments.begin();
+       iter != segments.end();
+       ++iter) {
+    const char* data = (const char*)iter->iov_base;
+    unsigned long remaining = iter->iov_len;
+    while (remaining) {
+      if (fillBuffer < 0) {
+        fillBuffer = acquireBuffer();
+        fillLength = 0;
+        if (fillBuffer < 0) {
+          written = 0;
+          return false;
+        }
+      }
+
+      unsigned long bytes = min(remaining, URING_BUFFER_SIZE - fillLength);
+      memcpy(ring->buffers + fillBuffer * URING_BUFFER_SIZE + fillLength,
+             data, bytes);
+      fillLength += bytes;
+      data += bytes;
+      remaining -= bytes;
+      written += bytes;
+
+      if (fillLength == URING_BUFFER_SIZE && !submitFill()) {
+        written = 0;
+        return false;
+      }
+    }
+  }
+
+  // Nothing counts as written until it's in the file, so a failed write
+  // fails this batch rather than one the store thinks is done
+  if (!submitFill()) {
+    written = 0;
+    return false;
+  }
+  waitForWrites();
+  if (failed) {
+    written = 0;
+    return false;
+  }
+  return true;
+}
+
+void UringFile::flush() {
+  if (!ring) {
+    PosixFile::flush();
+    return;
+  }
+  submitFill();
+  submitSync();
+  reap(false);
+}
+
+// Waits for a buffer if they're all in flight
+int UringFile::acquireBuffer() {
+  while (!failed) {
+    for (int i = 0; i < URING_BUFFER_COUNT; ++i) {
+      if (!ring->busy[i]) {
+        return i;
+      }
+    }
+    reap(true);
+  }
+  return -1;
+}
+
+bool UringFile::submitFill() {
+  if (fillBuffer < 0 || fillLength == 0) {
+    return true;
+  }
+  bool success = submitWrite(fillBuffer, 0, fillLength, fileOffset);
+  fileOffset += fillLength;
+  fillBuffer = -1;
+  fillLength = 0;
+  return success;
+}
+
+bool UringFile::submitWrite(unsigned buffer, unsigned long offset,
+                            unsigned long length, unsigned long file_offset) {
+  struct io_uring_sqe* sqe = nextSqe(ring);
+  char* data = ring->buffers + buffer * URING_BUFFER_SIZE + offset;
+  if (ring->registered) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->addr = (unsigned long)data;
+    sqe->len = length;
+    sqe->buf_index = buffer;
+  } else {
+    ring->iovecs[buffer].iov_base = data;
+    ring->iovecs[buffer].iov_len = length;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->addr = (unsigned long)&ring->iovecs[buffer];
+    sqe->len = 1;
+  }
+  sqe->fd = fd;
+  sqe->off = file_offset;
+  sqe->user_data = buffer;
+
+  ring->busy[buffer] = true;
+  ring->offset[buffer] = offset;
+  ring->length[buffer] = length;
+  ring->fileOffset[buffer] = file_offset;
+
+  if (!submitSqe(ring)) {
+    LOG_OPER("Failed to submit write to file <%s>: %s",
+             filename.c_str(), strerror(errno));
+    ring->busy[buffer] = false;
+    failed = true;
+    return false;
+  }
+  return true;
+}
+
+// At most one fdatasync in flight. It drains, so it covers every write
+// submitted before it.
+bool UringFile::submitSync() {
+  if (syncInFlight || failed) {
+    return !failed;
+  }
+
+  struct io_uring_sqe* sqe = nextSqe(ring);
+  sqe->opcode = IORING_OP_FSYNC;
+  sqe->fd = fd;
+  sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+  sqe->flags = IOSQE_IO_DRAIN;
+  sqe->user_data = URING_SYNC_TAG;
+
+  if (!submitSqe(ring)) {
+    LOG_OPER("Failed to submit sync for file <%s>: %s",
+             filename.c_str(), strerror(errno));
+    failed = true;
+    return false;
+  }
+  syncInFlight = true;
+  return true;
+}
+
+// Handles every completion that's ready, after waiting for at least one
+// if wait is set. Returns false if we couldn't wait.
+bool UringFile::reap(bool wait) {
+  unsigned head = *ring->cqHead;
+  if (wait && ring->inFlight &&
+      head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+    if (syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS,
+                NULL, 0) < 0 && errno != EINTR) {
+      LOG_OPER("Failed to wait for writes to file <%s>: %s",
+               filename.c_str(), strerror(errno));
+      failed = true;
+      return false;
+    }
+  }
+
+  while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe* cqe =
+      (struct io_uring_cqe*)ring->cqes + (head & *ring->cqMask);
+    unsigned long tag = cqe->user_data;
+    int result = cqe->res;
+    ++head;
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    --ring->inFlight;
+
+    if (tag == URING_SYNC_TAG) {
+      syncInFlight = false;
+      if (result < 0) {
+        LOG_OPER("Failed to sync file <%s>: %s",
+                 filename.c_str(), strerror(-result));
+        failed = true;
+      }
+      continue;
+    }
+
+    ring->busy[tag] = false;
+    if (result < 0 || (result == 0 && ring->length[tag] > 0)) {
+      LOG_OPER("Failed to write <%lu> bytes to file <%s> at offset <%lu>: %s",
+               ring->length[tag], filename.c_str(), ring->fileOffset[tag],
+               result < 0 ? strerror(-result) : "no progress");
+      failed = true;
+    } else if ((unsigned long)result < ring->length[tag] && !failed) {
+      // short write, send the rest
+      submitWrite(tag, ring->offset[tag] + result,
+                  ring->length[tag] - result, ring->fileOffset[tag] + result);
+    }
+  }
+  return true;
+}
+
+// Even after a failed write, so the buffers aren't unmapped while the
+// kernel is still using them
+void UringFile::waitForAll() {
+  while (ring->inFlight && reap(true)) {
+  }
+}
+
+// Leaves an fdatasync from flush() in flight
+void UringFile::waitForWrites() {
+  while (ring->inFlight > (syncInFlight ? 1U : 0U) && reap(true)) {
+  }
+}
+
+#else // !__NR_io_uring_setup
+
+bool UringFile::writeSegments(const write_segments_t& segments,
+                              unsigned long& written) {
+  return PosixFile::writeSegments(segments, written);
+}
+
+void UringFile::flush() {
+  PosixFile::flush();
+}
+
+int UringFile::acquireBuffer() {
+  return -1;
+}
+
+bool UringFile::submitFill() {
+  return true;
+}
+
+bool UringFile::submitWrite(unsigned buffer, unsigned long offset,
+                            unsigned long length, unsigned long file_offset) {
+  return false;
+}
+
+bool UringFile::submitSync() {
+  return false;
+}
+
+bool UringFile::reap(bool wait) {
+  return false;
+}
+
+void UringFile::waitForAll() {
+}
+
+void UringFile::waitForWrites() {
+}
+
+#endif // __NR_io_uring_setup
@@ -0,0 +1,80 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+#ifndef SCRIBE_URING_FILE_H
+#define SCRIBE_URING_FILE_H
+
+#include "file.h"
+
+struct UringRing;
+
+/*
+ * fs_type=uring: writes go through an io_uring instead of blocking the store
+ * thread on one write at a time. Data is copied into a few registered
+ * buffers, and each full buffer is submitted as one write at its own file
+ * offset, so the writes of a large batch overlap each other. The store
+ * thread only waits for a buffer when every one is in flight.
+ *
+ * A write returns once all of its data is in the file, so a batch only
+ * counts as written after its completions are reaped. If any of them
+ * failed, nothing is reported written and the store retries the whole
+ * batch. From then on every write fails the same way until the file is
+ * reopened.
+ *
+ * flush() submits an fdatasync but doesn't wait for it, so a sync error
+ * fails the next write. sync() and close() wait for everything.
+ *
+ * Reading, and writing on kernels without io_uring, work the same as
+ * fs_type=posix.
+ */
+class UringFile : public PosixFile {
+ public:
+  UringFile(const std::string& name, bool framed);
+  virtual ~UringFile();
+
+  bool openWrite();
+  bool openTruncate();
+  void close();
+  bool writeSegments(const write_segments_t& segments, unsigned long& written);
+  void flush();
+  bool sync();
+
+ private:
+  bool openForWrite(int flags);
+  bool submitFill();
+  bool submitWrite(unsigned buffer, unsigned long offset, unsigned long length,
+                   unsigned long file_offset);
+  bool submitSync();
+  int acquireBuffer();
+  bool reap(bool wait);
+  void waitForAll();
+  void waitForWrites();
+
+  UringRing* ring;            // NULL when writing synchronously
+  unsigned long fileOffset;   // where the next submitted write goes
+  int fillBuffer;             // buffer being filled, -1 for none
+  unsigned long fillLength;
+  bool syncInFlight;
+  bool failed;                // a write failed since the last report
+
+  // disallow copy, assignment, and empty construction
+  UringFile();
+  UringFile(UringFile& rhs);
+  UringFile& operator=(UringFile& rhs);
+};
+
+#endif // SCRIBE_URING_FILE_H
@@ -0,0 +1,310 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+// Writes the same messages through each fs_type the way FileStore does,
+// one writeSegments call per batch, and reports throughput, how much CPU
+// it took, the size of the file, and how much of it ended up in the page
+// cache. The type "direct" is a file store with direct_io=yes. With -z,
+// each batch is compressed into one block like compression=<codec> does,
+// and -S syncs every batch like fsync=batch.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "common.h"
+#include "file.h"
+#include "direct_file.h"
+#include "compression.h"
+
+using namespace std;
+using boost::shared_ptr;
+
+void usage() {
+  fprintf(stderr, "usage: filebench [-t fs_types] [-n messages] [-s message_size]\n"
+                  "                 [-b batch_size] [-d directory] [-c chunk_size]\n"
+                  "                 [-z compressions] [-f] [-F] [-S]\n");
+  fprintf(stderr, "  -t  comma separated fs_types to compare (default std,posix,uring,direct)\n");
+  fprintf(stderr, "  -n  messages to write (default 1000000)\n");
+  fprintf(stderr, "  -s  bytes per message (default 200)\n");
+  fprintf(stderr, "  -b  messages per write (default 1000)\n");
+  fprintf(stderr, "  -d  directory for the test files (default /tmp)\n");
+  fprintf(stderr, "  -c  chunk_size, the staging buffer size for direct (default 1MB)\n");
+  fprintf(stderr, "  -z  comma separated compressions to try with each fs_type (default none)\n");
+  fprintf(stderr, "  -f  write framed files, like buffer files\n");
+  fprintf(stderr, "  -F  flush after every write, like a store queue does\n");
+  fprintf(stderr, "  -S  sync after every write, like fsync=batch\n");
+}
+
+double seconds(const struct timeval& tv) {
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+double cpuSeconds() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+}
+
+double wallSeconds() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return seconds(now);
+}
+
+double fileMB(const string& filename) {
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return 0;
+  }
+  return st.st_size / 1048576.0;
+}
+
+// MB of the file in the page cache
+double cachedMB(const string& filename) {
+  int fd = open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  struct stat st;
+  double cached = 0;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      long page_size = sysconf(_SC_PAGESIZE);
+      size_t pages = (st.st_size + page_size - 1) / page_size;
+      vector<unsigned char> resident(pages);
+      if (mincore(map, st.st_size, &resident[0]) == 0) {
+        for (size_t i = 0; i < pages; ++i) {
+          cached += (resident[i] & 1) ? page_size : 0;
+        }
+      }
+      munmap(map, st.st_size);
+    }
+  }
+  close(fd);
+  return cached / 1048576.0;
+}
+
+void addSegment(write_segments_t& segments, const char* data,
+                unsigned long length) {
+  if (length) {
+    struct iovec segment;
+    segment.iov_base = (void*)data;
+    segment.iov_len = length;
+    segments.push_back(segment);
+  }
+}
+
+bool runBench(const string& fs_type, compression_t compression,
+              const string& filename, const vector<string>& messages,
+              unsigned long num_messages, unsigned long batch_size,
+              unsigned long chunk_size, bool framed, bool flush,
+              bool sync) {
+  shared_ptr<FileInterface> file;
+  if (fs_type == "direct") {
+    file = shared_ptr<FileInterface>(
+      new DirectFile(filename, framed, chunk_size));
+  } else {
+    file = FileInterface::createFileInterface(fs_type, filename, framed);
+  }
+  if (!file) {
+    fprintf(stderr, "unknown fs_type <%s>\n", fs_type.c_str());
+    return false;
+  }
+  file->deleteFile();
+  if (!file->openWrite()) {
+    fprintf(stderr, "failed to open <%s>\n", filename.c_str());
+    return false;
+  }
+
+  static const char newline = '\n';
+  string uncompressed;
+  string block;
+  unsigned long bytes = 0;
+  double wall_start = wallSeconds();
+  double cpu_start = cpuSeconds();
+
+  for (unsigned long sent = 0; sent < num_messages; sent += batch_size) {
+    write_segments_t segments;
+    deque<string> frames;
+    unsigned long batch_end = min(num_messages, sent + batch_size);
+    for (unsigned long i = sent; i < batch_end; ++i) {
+      const string& message = messages[i % messages.size()];
+      frames.push_back(file->getFrame(message.size() + 1));
+      addSegment(segments, frames.back().data(), frames.back().size());
+      addSegment(segments, message.data(), message.size());
+      addSegment(segments, &newline, 1);
+      bytes += frames.back().size() + message.size() + 1;
+    }
+
+    if (compression != COMPRESSION_NONE) {
+      uncompressed.clear();
+      for (write_segments_t::iterator iter = segments.begin();
+           iter != segments.end();
+           ++iter) {
+        uncompressed.append((const char*)iter->iov_base, iter->iov_len);
+      }
+      block.clear();
+      if (!compressBlock(compression, 0, uncompressed.data(),
+                         uncompressed.length(), block)) {
+        return false;
+      }
+      segments.clear();
+      addSegment(segments, block.data(), block.length());
+    }
+
+    unsigned long written;
+    if (!file->writeSegments(segments, written)) {
+      fprintf(stderr, "write failed after %lu bytes\n", written);
+      return false;
+    }
+    if (sync) {
+      if (!file->sync()) {
+        fprintf(stderr, "sync failed\n");
+        return false;
+      }
+    } else if (flush) {
+      file->flush();
+    }
+  }
+  file->flush();
+  file->close();
+
+  double wall = wallSeconds() - wall_start;
+  double cpu = cpuSeconds() - cpu_start;
+  double mb = bytes / 1048576.0;
+  string name = fs_type;
+  if (compression != COMPRESSION_NONE) {
+    name += string("/") + compressionName(compression);
+  }
+  printf("%-11s %7.1f MB %7.3f s %7.1f MB/s %7.3f cpu s %7.1f MB/cpu s "
+         "%7.1f MB on disk %7.1f MB cached\n", name.c_str(), mb, wall,
+         mb / wall, cpu, cpu > 0 ? mb / cpu : 0, fileMB(filename),
+         cachedMB(filename));
+
+  file->deleteFile();
+  return true;
+}
+
+int main(int argc, char **argv) {
+  string fs_types = "std,posix,uring,direct";
+  string compressions = "none";
+  unsigned long num_messages = 1000000;
+  unsigned long message_size = 200;
+  unsigned long batch_size = 1000;
+  unsigned long chunk_size = 0;
+  string directory = "/tmp";
+  bool framed = false;
+  bool flush = false;
+  bool sync = false;
+
+  int next_option;
+  while ((next_option = getopt(argc, argv, "t:n:s:b:d:c:z:fFSh")) != -1) {
+    switch (next_option) {
+    case 't':
+      fs_types = optarg;
+      break;
+    case 'n':
+      num_messages = strtoul(optarg, NULL, 10);
+      break;
+    case 's':
+      message_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'b':
+      batch_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'd':
+      directory = optarg;
+      break;
+    case 'c':
+      chunk_size = strtoul(optarg, NULL, 10);
+      break;
+    case 'z':
+      compressions = optarg;
+      break;
+    case 'f':
+      framed = true;
+      break;
+    case 'F':
+      flush = true;
+      break;
+    case 'S':
+      sync = true;
+      break;
+    default:
+      usage();
+      return 1;
+    }
+  }
+  if (batch_size == 0) {
+    batch_size = 1;
+  }
+
+  // access log lines with random fields, so compression has something
+  // like real logs to work with
+  vector<string> messages;
+  static const char* paths[] = {"/", "/search", "/login", "/api/v1/items",
+                                "/api/v1/users", "/static/app.js"};
+  srand(1);
+  for (int i = 0; i < 4096; ++i) {
+    char line[256];
+    snprintf(line, sizeof(line),
+             "10.%d.%d.%d - - [19/Oct/2026:10:%02d:%02d +0000] \"GET %s?id=%d "
+             "HTTP/1.1\" %d %d %dms \"Mozilla/5.0 (X11; Linux x86_64)\" ",
+             rand() % 256, rand() % 256, rand() % 256, rand() % 60,
+             rand() % 60, paths[rand() % 6], rand(),
+             rand() % 10 ? 200 : 404, rand() % 100000, rand() % 1000);
+    string message(line);
+    while (message.size() < message_size) {
+      snprintf(line, sizeof(line), "trace=%08x%08x ", rand(), rand());
+      message += line;
+    }
+    message.resize(message_size);
+    messages.push_back(message);
+  }
+
+  printf("%lu messages of %lu bytes, %lu per write%s%s\n", num_messages,
+         message_size, batch_size, framed ? ", framed" : "",
+         sync ? ", synced" : flush ? ", flushed" : "");
+
+  vector<compression_t> codecs;
+  stringstream names(compressions);
+  string name;
+  while (getline(names, name, ',')) {
+    compression_t compression;
+    if (!parseCompression(name, compression)) {
+      fprintf(stderr, "compression <%s> isn't built in\n", name.c_str());
+      return 1;
+    }
+    codecs.push_back(compression);
+  }
+
+  stringstream types(fs_types);
+  string fs_type;
+  bool success = true;
+  while (getline(types, fs_type, ',')) {
+    for (unsigned i = 0; i < codecs.size(); ++i) {
+      string filename = directory + "/filebench." + fs_type;
+      success = runBench(fs_type, codecs[i], filename, messages,
+                         num_messages, batch_size, chunk_size, framed,
+                         flush, sync) && success;
+    }
+  }
+  return success ? 0 : 1;
+}
@@ -0,0 +1,276 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+// Checks CRC-32C against known values, then writes a buffer file of
+// version 1 frames followed by version 2 batches, some of them torn or
+// with flipped bits, and reads it back with each reader. Every record of
+// an intact batch has to come back, in order, and nothing of a bad one.
+
+#include <set>
+
+#include "common.h"
+#include "compression.h"
+#include "crc32c.h"
+#include "file.h"
+#include "frame_batch.h"
+#include "mapped_file.h"
+
+using namespace std;
+
+#define LEGACY_RECORDS    50
+#define BATCHES           40
+#define BATCH_RECORDS     100
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAILED line %d: %s\n", __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while (0)
+
+// one bit at a time, to check the fast paths against
+static uint32_t slowCrc32c(uint32_t crc, const unsigned char* data,
+                           unsigned long length) {
+  crc = ~crc;
+  while (length--) {
+    crc ^= *data++;
+    for (int i = 0; i < 8; ++i) {
+      crc = (crc & 1) ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+static void checkCrc() {
+  // from RFC 3720, appendix B.4
+  unsigned char data[32];
+  CHECK(crc32c(0, "123456789", 9) == 0xe3069283);
+  memset(data, 0, sizeof(data));
+  CHECK(crc32c(0, data, sizeof(data)) == 0x8a9136aa);
+  memset(data, 0xff, sizeof(data));
+  CHECK(crc32c(0, data, sizeof(data)) == 0x62a8ab43);
+  for (int i = 0; i < 32; ++i) {
+    data[i] = i;
+  }
+  CHECK(crc32c(0, data, sizeof(data)) == 0x46dd794e);
+  for (int i = 0; i < 32; ++i) {
+    data[i] = 31 - i;
+  }
+  CHECK(crc32c(0, data, sizeof(data)) == 0x113fdb5c);
+
+  // every length and alignment path, in one piece and in two
+  vector<unsigned char> random(1 << 18);
+  for (size_t i = 0; i < random.size(); ++i) {
+    random[i] = rand();
+  }
+  for (int i = 0; i < 500; ++i) {
+    unsigned long offset = rand() % 64;
+    unsigned long length = rand() % (i < 250 ? 2048 : random.size() - 64);
+    unsigned long cut = length ? rand() % length : 0;
+    const unsigned char* start = &random[offset];
+    uint32_t whole = crc32c(0, start, length);
+    if (whole != slowCrc32c(0, start, length) ||
+        whole != crc32c(crc32c(0, start, cut), start + cut, length - cut)) {
+      fprintf(stderr, "FAILED crc of <%lu> bytes at <%lu>\n", length, offset);
+      ++failures;
+      break;
+    }
+  }
+}
+
+static string frame(const string& record) {
+  char length[4];
+  for (int i = 0; i < 4; ++i) {
+    length[i] = (char)(record.size() >> (8 * i));
+  }
+  return string(length, 4) + record;
+}
+
+static string record(long n) {
+  ostringstream record;
+  record << n << " payload payload payload";
+  return record.str();
+}
+
+static string makeBatch(long first, long count, bool compress) {
+  string payload;
+  for (long n = first; n < first + count; ++n) {
+    payload += frame(record(n));
+  }
+  if (compress) {
+    string frames;
+    frames.swap(payload);
+    CHECK(compressBlock(COMPRESSION_ZSTD, 0, frames.data(), frames.size(),
+                        payload));
+  }
+
+  write_segments_t segments;
+  struct iovec segment;
+  segment.iov_base = (void*)payload.data();
+  segment.iov_len = payload.size();
+  segments.push_back(segment);
+  string header;
+  CHECK(makeBatchHeader(segments, count, compress ? BATCH_COMPRESSED : 0,
+                        header));
+  return header + payload;
+}
+
+// Reads the records back in order. None may be missing unless lost says so,
+// and none that are in lost may turn up.
+class RecordChecker {
+ public:
+  RecordChecker(const char* reader_, const set<long>& lost_, long end_)
+    : reader(reader_), lost(lost_), end(end_), last(0) {}
+
+  void add(const string& data) {
+    long n = atol(data.c_str());
+    if (data != record(n) || n <= last || lost.count(n)) {
+      fprintf(stderr, "FAILED %s: read <%s> after %ld\n", reader,
+              data.c_str(), last);
+      ++failures;
+      return;
+    }
+    checkGap(n);
+    last = n;
+  }
+
+  void finish() {
+    checkGap(end);
+  }
+
+ private:
+  void checkGap(long n) {
+    for (long missing = last + 1; missing < n; ++missing) {
+      if (!lost.count(missing)) {
+        fprintf(stderr, "FAILED %s: lost record %ld\n", reader, missing);
+        ++failures;
+        break;
+      }
+    }
+  }
+
+  const char* reader;
+  const set<long>& lost;
+  long end;
+  long last;
+};
+
+static void checkBatches(const string& filename) {
+  string data;
+  set<long> lost;
+  long n = 1;
+  for (; n <= LEGACY_RECORDS; ++n) {
+    data += frame(record(n));
+  }
+
+  for (int i = 0; i < BATCHES; ++i, n += BATCH_RECORDS) {
+#ifdef USE_SCRIBE_ZSTD
+    string batch = makeBatch(n, BATCH_RECORDS, i % 3 == 1);
+#else
+    string batch = makeBatch(n, BATCH_RECORDS, false);
+#endif
+    bool bad = true;
+    switch (i) {
+    case 5:   // torn, and followed by batches written after a restart
+      batch.resize(batch.size() / 2);
+      break;
+    case 15:  // a flipped bit in the payload
+      batch[batch.size() / 2] ^= 0x01;
+      break;
+    case 16:  // and in the next one, right by the end
+      batch[batch.size() - 3] ^= 0x10;
+      break;
+    case 24:  // a flipped bit in the record count
+      batch[9] ^= 0x04;
+      break;
+    case 30:  // a flipped bit in the header checksum
+      batch[21] ^= 0x80;
+      break;
+    default:
+      bad = false;
+      break;
+    }
+    if (bad) {
+      for (long m = n; m < n + BATCH_RECORDS; ++m) {
+        lost.insert(m);
+      }
+    }
+    data += batch;
+  }
+
+  // and a batch torn at the end of the file
+  string last = makeBatch(n, BATCH_RECORDS, false);
+  data += last.substr(0, last.size() - 10);
+
+  FILE* out = fopen(filename.c_str(), "w");
+  CHECK(out && fwrite(data.data(), 1, data.size(), out) == data.size());
+  if (out) {
+    fclose(out);
+  }
+
+  const char* types[] = {"std", "posix"};
+  for (int i = 0; i < 2; ++i) {
+    boost::shared_ptr<FileInterface> file =
+      FileInterface::createFileInterface(types[i], filename, true);
+    CHECK(file && file->openRead());
+    RecordChecker checker(types[i], lost, n);
+    string record;
+    while (file->readNext(record)) {
+      checker.add(record);
+    }
+    checker.finish();
+    file->close();
+  }
+
+  MappedFile mapped(filename, true);
+  CHECK(mapped.open());
+  RecordChecker checker("mapped", lost, n);
+  file_position_t position;
+  file_position_t next;
+  const char* record_data;
+  unsigned long record_length;
+  while (mapped.record(position, record_data, record_length, next)) {
+    checker.add(string(record_data, record_length));
+    position = next;
+  }
+  checker.finish();
+  mapped.close();
+}
+
+int main(int argc, char **argv) {
+  checkCrc();
+
+  char filename[] = "/tmp/framecheck.XXXXXX";
+  int fd = mkstemp(filename);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  close(fd);
+  checkBatches(filename);
+  unlink(filename);
+
+  if (failures) {
+    printf("FAILED %d checks\n", failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
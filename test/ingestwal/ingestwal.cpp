@@ -0,0 +1,188 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+// Checks that a failed IngestWal commit can't cost the commits around it.
+// A file size limit makes one commit's write stop halfway through; every
+// message committed before and after it has to be read back from the
+// segments, and none of the failed one, even with a torn record after
+// them. A segment that messages were dropped from isn't deleted.
+
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "ingest_wal.h"
+
+using namespace std;
+using namespace scribe::thrift;
+
+#define MESSAGES_PER_COMMIT 10
+#define COMMITS             20
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAILED line %d: %s\n", __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while (0)
+
+static vector<LogEntry> makeMessages(unsigned long commit) {
+  vector<LogEntry> messages;
+  for (unsigned long i = 0; i < MESSAGES_PER_COMMIT; ++i) {
+    ostringstream message;
+    message << "commit " << commit << " message " << i << " "
+            << string(100, 'x');
+    LogEntry entry;
+    entry.category = "test";
+    entry.message = message.str();
+    messages.push_back(entry);
+  }
+  return messages;
+}
+
+static void setFileLimit(rlim_t limit) {
+  struct rlimit rl;
+  getrlimit(RLIMIT_FSIZE, &rl);
+  rl.rlim_cur = limit == RLIM_INFINITY ? rl.rlim_max : limit;
+  if (setrlimit(RLIMIT_FSIZE, &rl) != 0) {
+    perror("setrlimit");
+    exit(1);
+  }
+}
+
+// A record whose category length wraps around when added to the length
+// field's size. Reading has to stop at it like at any other torn record.
+static void appendTornRecord(const string& filename) {
+  const char record[] = { 8, 0, 0, 0, (char)0xfd, (char)0xff, (char)0xff,
+                          (char)0xff, 'x', 'x', 'x', 'x' };
+  FILE* file = fopen(filename.c_str(), "a");
+  CHECK(file != NULL);
+  if (file) {
+    CHECK(fwrite(record, sizeof(record), 1, file) == 1);
+    fclose(file);
+  }
+}
+
+int main(int argc, char **argv) {
+  char dir[] = "/tmp/ingestwal.XXXXXX";
+  if (!mkdtemp(dir)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  // writes past the limit fail with EFBIG instead of killing us
+  signal(SIGXFSZ, SIG_IGN);
+
+  vector<LogEntry> committed;
+  vector<wal_segment_ptr_t> segments; // keeps the segments from being deleted
+  {
+    IngestWal wal(dir);
+    vector<wal_segment_ptr_t> leftover;
+    CHECK(wal.start(leftover));
+    CHECK(leftover.empty());
+
+    for (unsigned long commit = 0; commit < COMMITS; ++commit) {
+      vector<LogEntry> messages = makeMessages(commit);
+      wal_segment_ptr_t segment;
+
+      bool fail = commit == COMMITS / 2;
+      if (fail) {
+        // let half of this commit's records reach the disk
+        struct stat st;
+        CHECK(stat(segments.back()->getFilename().c_str(), &st) == 0);
+        setFileLimit(st.st_size + MESSAGES_PER_COMMIT * 60);
+      }
+      bool success = wal.commit(messages, segment);
+      if (fail) {
+        setFileLimit(RLIM_INFINITY);
+        CHECK(!success);
+        continue;
+      }
+
+      CHECK(success);
+      if (success) {
+        committed.insert(committed.end(), messages.begin(), messages.end());
+        segments.push_back(segment);
+      }
+    }
+    CHECK(segments.front() != segments.back());
+    wal.stop();
+  }
+
+  // what a restart would replay
+  vector<LogEntry> replayed;
+  {
+    IngestWal wal(dir);
+    vector<wal_segment_ptr_t> leftover;
+    CHECK(wal.start(leftover));
+    wal.stop();
+    CHECK(!leftover.empty());
+    if (!leftover.empty()) {
+      appendTornRecord(leftover.back()->getFilename());
+    }
+    for (vector<wal_segment_ptr_t>::iterator iter = leftover.begin();
+         iter != leftover.end();
+         ++iter) {
+      CHECK(IngestWal::readSegment(*iter, replayed));
+    }
+  }
+
+  CHECK(replayed.size() == committed.size());
+  for (size_t i = 0; i < replayed.size() && i < committed.size(); ++i) {
+    if (replayed[i].category != committed[i].category ||
+        replayed[i].message != committed[i].message) {
+      fprintf(stderr, "FAILED message %lu: <%s>\n", (unsigned long)i,
+              replayed[i].message.c_str());
+      ++failures;
+      break;
+    }
+  }
+
+  segments.clear();
+
+  // a segment some messages were dropped from stays for the next start
+  string kept_filename;
+  {
+    IngestWal wal(dir);
+    vector<wal_segment_ptr_t> leftover;
+    CHECK(wal.start(leftover));
+    CHECK(leftover.empty());
+    wal_segment_ptr_t segment;
+    CHECK(wal.commit(makeMessages(0), segment));
+    if (segment) {
+      kept_filename = segment->getFilename();
+      logentry_vector_t dropped;
+      dropped.push_back(logentry_ptr_t(new LogEntry, WalEntryDeleter(segment)));
+      IngestWal::keepSegments(dropped);
+    }
+    wal.stop();
+  }
+  struct stat st;
+  CHECK(!kept_filename.empty() && stat(kept_filename.c_str(), &st) == 0);
+  unlink(kept_filename.c_str());
+  rmdir(dir);
+
+  if (failures) {
+    printf("FAILED %d checks\n", failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,223 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+// Checks the shared-memory ring protocol in shm_ring.h without a scribed:
+// producer threads append while a consumer drains the way ShmIngest does,
+// then corrupt and abandoned records are skipped to the next good one
+// without passing over anything that's still reserved.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "shm_ring.h"
+
+#define DATA_OFFSET 4096
+#define CAPACITY    65536
+#define PRODUCERS   4
+#define PER_PRODUCER 50000
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAILED line %d: %s\n", __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while (0)
+
+static struct scribe_shm_header* newRing() {
+  void* ring = NULL;
+  if (posix_memalign(&ring, 4096, DATA_OFFSET + CAPACITY) != 0) {
+    exit(1);
+  }
+  memset(ring, 0, DATA_OFFSET + CAPACITY);
+  struct scribe_shm_header* h = (struct scribe_shm_header*)ring;
+  h->magic = SCRIBE_SHM_MAGIC;
+  h->version = SCRIBE_SHM_VERSION;
+  h->dataOffset = DATA_OFFSET;
+  h->capacity = CAPACITY;
+  return h;
+}
+
+// what ShmIngest::release does
+static void release(struct scribe_shm_header* h, uint64_t new_tail) {
+  uint64_t pos = h->tail;
+  while (pos < new_tail) {
+    uint64_t offset = pos & (h->capacity - 1);
+    uint64_t length = new_tail - pos;
+    if (length > h->capacity - offset) {
+      length = h->capacity - offset;
+    }
+    memset(scribe_shm_data(h) + offset, 0, length);
+    pos += length;
+  }
+  __sync_synchronize();
+  h->tail = new_tail;
+}
+
+static int append(struct scribe_shm_header* h, const char* message) {
+  return scribe_shm_append(h, "test", 4, message, strlen(message));
+}
+
+struct producer_t {
+  struct scribe_shm_header* ring;
+  int id;
+};
+
+static void* produce(void* arg) {
+  struct producer_t* producer = (struct producer_t*)arg;
+  char message[64];
+  for (long seq = 0; seq < PER_PRODUCER; ) {
+    // varying lengths so records pad at the end of the ring
+    snprintf(message, sizeof(message), "%d %ld %.*s", producer->id, seq,
+             (int)(seq % 37), "abcdefghijklmnopqrstuvwxyz0123456789");
+    if (append(producer->ring, message) == 0) {
+      ++seq;
+    }
+  }
+  return NULL;
+}
+
+// Every record arrives once, in order per producer, with a full ring
+// pushing back on the producers the whole time
+static void testConcurrent() {
+  struct scribe_shm_header* h = newRing();
+  pthread_t threads[PRODUCERS];
+  struct producer_t producers[PRODUCERS];
+  for (int i = 0; i < PRODUCERS; ++i) {
+    producers[i].ring = h;
+    producers[i].id = i;
+    pthread_create(&threads[i], NULL, produce, &producers[i]);
+  }
+
+  long next[PRODUCERS] = {0};
+  long received = 0;
+  long padding = 0;
+  while (received < PRODUCERS * PER_PRODUCER) {
+    uint64_t tail = h->tail;
+    uint64_t head = h->head;
+    if (tail == head) {
+      continue;
+    }
+    struct scribe_shm_record* rec = scribe_shm_record_at(h, tail);
+    if (!(rec->flags & SCRIBE_SHM_COMMITTED)) {
+      continue;
+    }
+    CHECK(scribe_shm_record_valid(h, tail, head));
+    if (!(rec->flags & SCRIBE_SHM_PADDING)) {
+      int id;
+      long seq;
+      const char* payload = (const char*)(rec + 1) + rec->categoryLength;
+      CHECK(sscanf(payload, "%d %ld", &id, &seq) == 2);
+      CHECK(id >= 0 && id < PRODUCERS && seq == next[id]);
+      if (id >= 0 && id < PRODUCERS) {
+        next[id] = seq + 1;
+      }
+      ++received;
+    } else {
+      ++padding;
+    }
+    release(h, tail + rec->length);
+  }
+
+  for (int i = 0; i < PRODUCERS; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  CHECK(h->head == h->tail);
+  CHECK(padding > 0);
+  printf("concurrent: %ld records, %ld padding records\n", received, padding);
+  free(h);
+}
+
+// A record whose header was damaged after it was committed is skipped to
+// the record after it, not past it
+static void testCorrupt() {
+  struct scribe_shm_header* h = newRing();
+  CHECK(append(h, "first") == 0);
+  uint64_t bad = h->head;
+  CHECK(append(h, "second, to be corrupted") == 0);
+  uint64_t after = h->head;
+  CHECK(append(h, "third") == 0);
+
+  CHECK(scribe_shm_record_valid(h, 0, h->head));
+  CHECK(scribe_shm_record_valid(h, bad, h->head));
+  scribe_shm_record_at(h, bad)->length += 4 * SCRIBE_SHM_ALIGN;
+  CHECK(!scribe_shm_record_valid(h, bad, h->head));
+  CHECK(scribe_shm_next_record(h, bad, h->head) == after);
+
+  // with nothing good after it, only what was reserved before the limit
+  // is skipped
+  CHECK(scribe_shm_next_record(h, bad, after) == after);
+  free(h);
+}
+
+// A producer that died between reserving and writing leaves zeros
+static void testAbandoned() {
+  struct scribe_shm_header* h = newRing();
+  CHECK(append(h, "first") == 0);
+  uint64_t dead = h->head;
+  h->head += scribe_shm_record_size(4, 100);
+  uint64_t after = h->head;
+  CHECK(append(h, "after the dead producer") == 0);
+
+  CHECK(!scribe_shm_record_valid(h, dead, h->head));
+  CHECK(scribe_shm_next_record(h, dead, h->head) == after);
+  free(h);
+}
+
+// A message that holds a copy of a record header isn't taken for one,
+// since the check ties a header to the position it was written at
+static void testFakeHeader() {
+  struct scribe_shm_header* h = newRing();
+  struct scribe_shm_record fake;
+  memset(&fake, 0, sizeof(fake));
+  fake.length = scribe_shm_record_size(4, 4);
+  fake.flags = SCRIBE_SHM_COMMITTED;
+  fake.categoryLength = 4;
+  fake.messageLength = 4;
+  fake.check = scribe_shm_record_check(0, fake.length, 4, 4);
+
+  char message[256];
+  memset(message, 'x', sizeof(message));
+  for (int i = 0; i + sizeof(fake) <= sizeof(message); i += SCRIBE_SHM_ALIGN) {
+    memcpy(message + i, &fake, sizeof(fake));
+  }
+  uint64_t bad = h->head;
+  CHECK(scribe_shm_append(h, "test", 4, message, sizeof(message)) == 0);
+  uint64_t after = h->head;
+  CHECK(append(h, "after") == 0);
+
+  scribe_shm_record_at(h, bad)->messageLength += 1;
+  CHECK(!scribe_shm_record_valid(h, bad, h->head));
+  CHECK(scribe_shm_next_record(h, bad, h->head) == after);
+  free(h);
+}
+
+int main(int argc, char **argv) {
+  testConcurrent();
+  testCorrupt();
+  testAbandoned();
+  testFakeHeader();
+  if (failures) {
+    printf("FAILED %d checks\n", failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
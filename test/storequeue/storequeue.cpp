@@ -0,0 +1,208 @@
+//  Copyright (c) 2007-2009 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+// Checks that StoreQueue requeues exactly what a store fails to write.
+// The store here writes half of the first batch it gets and then fails,
+// leaving only the rest in the batch: either erased in place, the way
+// FileStore does it, or swapped for a new vector, the way CategoryStore
+// and BucketStore do. Every message has to come out once, in order, with
+// and without adaptive_write_size.
+
+#include "common.h"
+#include "scribe_server.h"
+#include "store_queue.h"
+
+using namespace std;
+using namespace boost;
+using namespace scribe::thrift;
+
+#define MESSAGES 200
+
+shared_ptr<scribeHandler> g_Handler;
+
+static int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAILED line %d: %s\n", __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while (0)
+
+static pthread_mutex_t writtenMutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<string> written;
+static unsigned long failedWrites = 0;
+
+// Store type "erase" or "swap" says how the first batch is left after
+// its partial write; every later batch is written in full.
+class PartialStore : public Store {
+ public:
+  PartialStore(const string& category, const string& type)
+    : Store(category, type) {}
+
+  shared_ptr<Store> copy(const string &category) {
+    return shared_ptr<Store>(new PartialStore(category, storeType));
+  }
+  bool open() { return true; }
+  bool isOpen() { return true; }
+  void configure(pStoreConf configuration) {}
+  void close() {}
+  void flush() {}
+
+  bool handleMessages(shared_ptr<logentry_vector_t> messages) {
+    pthread_mutex_lock(&writtenMutex);
+    bool fail = failedWrites == 0;
+    unsigned long num_written = fail ? messages->size() / 2 : messages->size();
+    for (unsigned long i = 0; i < num_written; ++i) {
+      written.push_back((*messages)[i]->message);
+    }
+    if (fail) {
+      ++failedWrites;
+    }
+    pthread_mutex_unlock(&writtenMutex);
+
+    if (!fail) {
+      return true;
+    }
+    if (0 == storeType.compare("erase")) {
+      messages->erase(messages->begin(), messages->begin() + num_written);
+    } else {
+      shared_ptr<logentry_vector_t> failed_messages(new logentry_vector_t);
+      failed_messages->insert(failed_messages->end(),
+                              messages->begin() + num_written,
+                              messages->end());
+      messages->swap(*failed_messages);
+    }
+    return false;
+  }
+};
+
+// What store.cpp would provide, without linking in every store type
+shared_ptr<Store> Store::createStore(const string& type,
+                                     const string& category,
+                                     bool readable, bool multi_category,
+                                     const string& trigger_path) {
+  return shared_ptr<Store>(new PartialStore(category, type));
+}
+
+Store::Store(const string& category, const string &type,
+             bool multi_category, const string &trigger_path)
+  : categoryHandled(category),
+    multiCategory(multi_category),
+    storeType(type) {
+}
+
+Store::~Store() {
+}
+
+string Store::getStatus() {
+  return string();
+}
+
+bool Store::readOldest(shared_ptr<logentry_vector_t> messages,
+                       struct tm* now) {
+  return false;
+}
+
+void Store::deleteOldest(struct tm* now) {
+}
+
+bool Store::replaceOldest(shared_ptr<logentry_vector_t> messages,
+                          struct tm* now) {
+  return false;
+}
+
+bool Store::empty(struct tm* now) {
+  return true;
+}
+
+const string& Store::getType() {
+  return storeType;
+}
+
+void Store::setStatus(const string& new_status) {
+}
+
+bool Store::runTrigger(const string& message) {
+  return false;
+}
+
+static void runQueue(const string& type, bool adaptive) {
+  pthread_mutex_lock(&writtenMutex);
+  written.clear();
+  failedWrites = 0;
+  pthread_mutex_unlock(&writtenMutex);
+
+  pStoreConf conf(new StoreConf);
+  conf->setString("adaptive_write_size", adaptive ? "yes" : "no");
+  conf->setUnsigned("target_write_size", adaptive ? 1000 : 1000000);
+  conf->setUnsigned("max_write_interval_ms", 50);
+  conf->setUnsigned("retry_backoff_min_ms", 10);
+  conf->setUnsigned("retry_backoff_max_ms", 100);
+
+  StoreQueue* queue = new StoreQueue(type, "test", 1);
+  queue->configureAndOpen(conf);
+  for (unsigned long i = 0; i < MESSAGES; ++i) {
+    ostringstream message;
+    message << "message " << i << " " << string(50, 'x');
+    shared_ptr<LogEntry> entry(new LogEntry);
+    entry->category = "test";
+    entry->message = message.str();
+    queue->addMessage(entry);
+  }
+
+  // give the queue a few seconds to write them and retry the failure
+  for (int wait = 0; wait < 500; ++wait) {
+    pthread_mutex_lock(&writtenMutex);
+    bool done = written.size() >= MESSAGES;
+    pthread_mutex_unlock(&writtenMutex);
+    if (done) {
+      break;
+    }
+    usleep(10000);
+  }
+  queue->stop();
+  delete queue;
+
+  CHECK(failedWrites == 1);
+  CHECK(written.size() == MESSAGES);
+  for (unsigned long i = 0; i < written.size() && i < MESSAGES; ++i) {
+    ostringstream message;
+    message << "message " << i << " " << string(50, 'x');
+    if (written[i] != message.str()) {
+      fprintf(stderr, "FAILED %s %s message %lu: <%s>\n", type.c_str(),
+              adaptive ? "adaptive" : "fixed", i, written[i].c_str());
+      ++failures;
+      break;
+    }
+  }
+}
+
+int main(int argc, char **argv) {
+  runQueue("erase", false);
+  runQueue("swap", false);
+  runQueue("erase", true);
+  runQueue("swap", true);
+
+  if (failures) {
+    printf("FAILED %d checks\n", failures);
+    return 1;
+  }
+  printf("PASSED\n");
+  return 0;
+}
@@ -0,0 +1,69 @@
+<?php
+//  Copyright (c) 2007-2008 Facebook
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+//
+// See accompanying file LICENSE or visit the Scribe site at:
+// http://developers.facebook.com/scribe/
+
+require_once 'tests.php';
+require_once 'testutil.php';
+
+// syslog test.  send syslog datagrams over udp and verify that they
+// are written to the file for their mapped category
+
+$success = true;
+$pid = scribe_start('syslogtest', $GLOBALS['SCRIBE_BIN'],
+                    $GLOBALS['SCRIBE_PORT'], 'scribe.conf.syslogtest');
+
+print("running syslog test\n");
+$sock = socket_create(AF_INET, SOCK_DGRAM, SOL_UDP);
+$datagrams = array(
+  "<134>Oct 11 22:14:15 myhost app: rfc3164 local0 message\n",
+  "<38>1 2003-10-11T22:14:15.003Z myhost sshd 8710 - - rfc5424 sshd message",
+  "<13>Oct 11 22:14:15 myhost other[12]: unmapped message",
+);
+foreach ($datagrams as $datagram) {
+  socket_sendto($sock, $datagram, strlen($datagram), 0, '127.0.0.1', 1514);
+}
+socket_close($sock);
+sleep(3);
+
+// check results
+$expected = array(
+  "/tmp/scribetest_/syslog_web/syslog_web_current" => "rfc3164 local0 message",
+  "/tmp/scribetest_/syslog_auth/syslog_auth_current" => "rfc5424 sshd message",
+  "/tmp/scribetest_/syslog/syslog_current" => "unmapped message",
+);
+foreach ($expected as $file => $message) {
+  $cmd = "grep \"$message\" $file > /dev/null 2>&1";
+  echo "checking message: $cmd\n";
+  system($cmd, $ret);
+  if ($ret != 0) {
+    print("ERROR: didn't find message \"$message\" in file $file\n");
+    $success = false;
+  }
+}
+
+$counters = get_counters($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT']);
+if (!isset($counters['syslog received']) || $counters['syslog received'] != 3) {
+  print("ERROR: expected 3 syslog messages received\n");
+  $success = false;
+}
+
+if (!scribe_stop($GLOBALS['SCRIBE_CTRL'], $GLOBALS['SCRIBE_PORT'], $pid)) {
+  print("ERROR: could not stop scribe\n");
+  return false;
+}
+
+return $success;
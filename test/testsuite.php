@@ -46,6 +46,7 @@ $ALL_TESTS = array(
   'bucketupdater',
   'paramtest',
   'twodefaulttest',
+  'syslogtest',
   //'reloadtest',
 );
 